@@ -62,7 +62,7 @@ public:
 		{
 			this->x /= mag;
 			this->y /= mag;
-			this->y /= mag;
+			this->z /= mag;
 		}
 	}
 
@@ -125,6 +125,9 @@ public:
 	Vect3 row_0() { return Vect3{this->a00, this->a01, this->a02}; }
 	Vect3 row_1() { return Vect3{this->a10, this->a11, this->a12}; }
 	Vect3 row_2() { return Vect3{this->a20, this->a21, this->a22}; }
+	Vect3 col_0() { return Vect3{this->a00, this->a10, this->a20}; }
+	Vect3 col_1() { return Vect3{this->a01, this->a11, this->a21}; }
+	Vect3 col_2() { return Vect3{this->a02, this->a12, this->a22}; }
 };
 const Matrix3by3 Matrix3by3::IdentityMatrix{1.0, 0.0, 0.0,
 											0.0, 1.0, 0.0,
@@ -217,6 +220,12 @@ double dot_prod(Vect3 v1, Vect3 v2)
 {
 	return v1.get_x() * v2.get_x() + v1.get_y() * v2.get_y() + v1.get_z() * v2.get_z();
 }
+Vect3 cross_prod(Vect3 v1, Vect3 v2)
+{
+	return Vect3{v1.get_y() * v2.get_z() - v1.get_z() * v2.get_y(),
+				 v1.get_z() * v2.get_x() - v1.get_x() * v2.get_z(),
+				 v1.get_x() * v2.get_y() - v1.get_y() * v2.get_x()};
+}
 Vect3 mult_matrix_by_vector3(Matrix3by3 m, Vect3 v)
 {
 	double new_x = dot_prod(m.row_0(), v);
@@ -224,4 +233,11 @@ Vect3 mult_matrix_by_vector3(Matrix3by3 m, Vect3 v)
 	double new_z = dot_prod(m.row_2(), v);
 
 	return Vect3{new_x, new_y, new_z};
+}
+Matrix3by3 mult_matrices(Matrix3by3 m1, Matrix3by3 m2)
+{
+	// m1 * m2 (m2 is applied first)
+	return Matrix3by3{dot_prod(m1.row_0(), m2.col_0()), dot_prod(m1.row_0(), m2.col_1()), dot_prod(m1.row_0(), m2.col_2()),
+					  dot_prod(m1.row_1(), m2.col_0()), dot_prod(m1.row_1(), m2.col_1()), dot_prod(m1.row_1(), m2.col_2()),
+					  dot_prod(m1.row_2(), m2.col_0()), dot_prod(m1.row_2(), m2.col_1()), dot_prod(m1.row_2(), m2.col_2())};
 }
\ No newline at end of file
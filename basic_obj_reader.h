@@ -6,27 +6,218 @@
  * Brief: Basic implementation of a obj files reader
  */
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "profiling.h"
 #include "shapes_3D.h"
 
+// --------- VERTEX WELDING --------- //
+class SpatialHashGrid
+{
+private:
+	double cell_size;
+	std::unordered_map<unsigned long long, std::vector<int>> cells; // Indices of the vertices in each cell
+
+public:
+	// Constructor
+	SpatialHashGrid(double input_cell_size) : cell_size(input_cell_size) {}
+
+	// Vertices
+	void insert(Vect3 position, int index)
+	{
+		cells[get_cell_key(get_cell(position.get_x()), get_cell(position.get_y()), get_cell(position.get_z()))].push_back(index);
+	}
+	int find(Vect3 position, std::vector<Vect3> &vertices)
+	{
+		// Index of a vertex within cell_size of the position (-1 if none). Only the 27 surrounding cells can hold one
+		long long cx = get_cell(position.get_x()), cy = get_cell(position.get_y()), cz = get_cell(position.get_z());
+		for (long long x = cx - 1; x <= cx + 1; x++)
+		{
+			for (long long y = cy - 1; y <= cy + 1; y++)
+			{
+				for (long long z = cz - 1; z <= cz + 1; z++)
+				{
+					std::unordered_map<unsigned long long, std::vector<int>>::iterator cell = cells.find(get_cell_key(x, y, z));
+					if (cell == cells.end())
+						continue;
+					for (int index : cell->second)
+					{
+						if (vertices[index].get_distance(position) <= cell_size)
+							return index;
+					}
+				}
+			}
+		}
+		return -1;
+	}
+
+private:
+	long long get_cell(double coord) { return (long long)std::floor(coord / cell_size); }
+	static unsigned long long get_cell_key(long long x, long long y, long long z)
+	{
+		// 21 bits per axis. Far away cells may share a key, which only costs a few more distance checks
+		const unsigned long long MASK = (1ULL << 21) - 1;
+		return ((unsigned long long)x & MASK) | (((unsigned long long)y & MASK) << 21) | (((unsigned long long)z & MASK) << 42);
+	}
+};
+
+// --------- SUB-MESHES --------- //
+struct SubMesh
+{
+	std::string name;				// From the last "o" or "g" statement ("default" before any)
+	size_t first_edge, edge_count; // Range of its edges in the edge pool
+	BoundingBox bounding_box;		// Corners only (no faces)
+};
+
+// --------- OBJ PRE-SCAN --------- //
+struct ObjCounts
+{
+	long long vertices, faces;
+	long long face_corners; // One edge each, before the duplicates are removed
+};
+ObjCounts scan_obj_counts(std::string obj_filepath)
+{
+	// Only the statements read by ObjReader are counted, nothing is parsed
+	ObjCounts counts{0, 0, 0};
+	std::ifstream f{obj_filepath};
+	std::string line;
+	while (std::getline(f, line))
+	{
+		if (line.size() > 1 && line[0] == 'v' && line[1] == ' ')
+			counts.vertices++;
+		else if (!line.empty() && line[0] == 'f')
+		{
+			counts.faces++;
+			bool in_token = false;
+			for (size_t i = 1; i < line.size(); i++)
+			{
+				bool is_space = line[i] == ' ' || line[i] == '\t' || line[i] == '\r';
+				if (!is_space && !in_token)
+					counts.face_corners++;
+				in_token = !is_space;
+			}
+		}
+	}
+	return counts;
+}
+
+// --------- COMPACT MESH --------- //
+class CompactMesh
+{
+private:
+	Vect3 low, step;						   // Vertices are at low + step * quantized coords (on each axis)
+	std::vector<unsigned short> positions;	   // Quantized x, y and z of every vertex (16 bits each)
+	std::vector<unsigned short> short_indices; // Origin and end of every edge, while the vertex count fits in 16 bits
+	std::vector<unsigned int> long_indices;	   // Otherwise
+
+public:
+	// Constructor
+	CompactMesh() {}
+
+	// Encoding
+	void build(std::vector<Edge> &edges, BoundingBox &box)
+	{
+		// Positions quantized to 16 bits relative to the box, vertices that share them stored once
+		Vect3 tl = box.get_top_left();
+		Vect3 br = box.get_bottom_right();
+		this->low = Vect3{tl.get_x(), br.get_y(), br.get_z()};
+		this->step = Vect3{(br.get_x() - tl.get_x()) / QUANTIZED_STEPS, (tl.get_y() - br.get_y()) / QUANTIZED_STEPS, (tl.get_z() - br.get_z()) / QUANTIZED_STEPS};
+		auto quantize = [](double coord, double low_coord, double step_coord) {
+			return step_coord > 0.0 ? (unsigned short)std::min(std::lround((coord - low_coord) / step_coord), (long)QUANTIZED_STEPS) : (unsigned short)0;
+		};
+
+		this->positions.clear();
+		this->short_indices.clear();
+		this->long_indices.clear();
+		std::unordered_map<unsigned long long, unsigned int> vertex_ids;
+		std::vector<unsigned int> indices;
+		indices.reserve(edges.size() * 2);
+		for (Edge &e : edges)
+		{
+			for (Vect3 v : {e.get_origin(), e.get_end()})
+			{
+				unsigned short qx = quantize(v.get_x(), low.get_x(), step.get_x());
+				unsigned short qy = quantize(v.get_y(), low.get_y(), step.get_y());
+				unsigned short qz = quantize(v.get_z(), low.get_z(), step.get_z());
+				unsigned long long key = (unsigned long long)qx | ((unsigned long long)qy << 16) | ((unsigned long long)qz << 32);
+				std::pair<std::unordered_map<unsigned long long, unsigned int>::iterator, bool> found = vertex_ids.insert({key, (unsigned int)(this->positions.size() / 3)});
+				if (found.second)
+					this->positions.insert(this->positions.end(), {qx, qy, qz});
+				indices.push_back(found.first->second);
+			}
+		}
+
+		if (count_vertices() <= 65536)
+			this->short_indices.assign(indices.begin(), indices.end());
+		else
+			this->long_indices.swap(indices);
+	}
+
+	// Get
+	size_t count_edges() { return (this->short_indices.size() + this->long_indices.size()) / 2; }
+	size_t count_vertices() { return this->positions.size() / 3; }
+	int get_index_bits() { return this->long_indices.empty() ? 16 : 32; }
+	Vect3 get_low() { return this->low; }
+	Vect3 get_step() { return this->step; }
+	double get_max_error() { return this->step.get_magnitude() * 0.5; } // Half a step on every axis
+	size_t estimate_memory_bytes()
+	{
+		return this->positions.capacity() * sizeof(unsigned short) + this->short_indices.capacity() * sizeof(unsigned short) +
+			   this->long_indices.capacity() * sizeof(unsigned int);
+	}
+
+	// Decoding
+	unsigned int get_origin_index(size_t edge) { return this->long_indices.empty() ? this->short_indices[edge * 2] : this->long_indices[edge * 2]; }
+	unsigned int get_end_index(size_t edge) { return this->long_indices.empty() ? this->short_indices[edge * 2 + 1] : this->long_indices[edge * 2 + 1]; }
+	Vect3 get_quantized_vertex(unsigned int index)
+	{
+		const unsigned short *q = &this->positions[(size_t)index * 3];
+		return Vect3{(double)q[0], (double)q[1], (double)q[2]};
+	}
+	Vect3 get_vertex(unsigned int index)
+	{
+		Vect3 q = get_quantized_vertex(index);
+		return Vect3{low.get_x() + q.get_x() * step.get_x(), low.get_y() + q.get_y() * step.get_y(), low.get_z() + q.get_z() * step.get_z()};
+	}
+	Edge get_edge(size_t edge) { return Edge{get_vertex(get_origin_index(edge)), get_vertex(get_end_index(edge))}; }
+
+	// Steps of the quantized coords
+	static constexpr double QUANTIZED_STEPS = 65535.0;
+};
+
+// --------- OBJ READER --------- //
 class ObjReader
 {
 private:
 	// Reading
 	std::string source_file;
 	bool invert_y;
+	double weld_tolerance; // Vertices closer than this are merged on load (0 to keep them all)
+	int welded_vertex_count;
+	ObjCounts expected_counts; // From a pre-scan, so that the containers are allocated once (zero when unknown)
 
 	// Geometry
 	std::vector<Face> faces;
 	BoundingBox bounding_box;
+	CompactMesh compact_mesh; // Replaces the faces and the edge pool once compact() is called
 
-	// Edge pool (just for drawing purposes)
+	// Edge pool (just for drawing purposes), split in sub-meshes by the "o" and "g" statements
 	std::vector<Edge> edge_pool;
+	std::vector<SubMesh> sub_meshes;
+
+	// Edge adjacency (only built for drawing feature edges)
+	std::vector<Vect3> face_normals, face_origins;
+	std::vector<Edge> feature_edges;					  // Boundary, non-manifold and crease edges
+	std::vector<Edge> smooth_edges;						  // Between two faces, on the silhouette depending on the view
+	std::vector<std::pair<int, int>> smooth_edge_faces; // Faces on each side of the smooth edges
 
 	// Polycount and general feedback
 	int face_count;
@@ -34,22 +225,41 @@ private:
 
 public:
 	// Constructor
-	ObjReader(std::string input_file) : source_file(input_file), invert_y(true), face_count(0), vertex_count(0)
+	ObjReader(std::string input_file) : ObjReader(input_file, 0.0) {}
+	ObjReader(std::string input_file, double input_weld_tolerance) : ObjReader(input_file, input_weld_tolerance, ObjCounts{0, 0, 0}) {}
+	ObjReader(std::string input_file, bool process_on_load) : ObjReader(input_file, 0.0, ObjCounts{0, 0, 0}, process_on_load) {}
+	ObjReader(std::string input_file, double input_weld_tolerance, ObjCounts input_expected_counts, bool process_on_load = true)
+		: source_file(input_file), invert_y(true), weld_tolerance(input_weld_tolerance), welded_vertex_count(0), expected_counts(input_expected_counts), face_count(0), vertex_count(0)
 	{
+		if (!process_on_load)
+			return; // Caller runs read_from_file(), clear_edge_pool(), calculate_bb(), order_edges_spatially() and to_center() itself
+
 		read_from_file();
+		if (this->face_count == 0)
+			return; // Nothing to bound or center
 		clear_edge_pool();
 		calculate_bb();
+		order_edges_spatially();
 		to_center();
 	}
 
 	// Read from file
 	void read_from_file()
 	{
+		PROFILE_SCOPE("obj_parse");
 		std::ifstream f{this->source_file};
 		if (!f.is_open())
 			return;
 
 		std::vector<Vect3> temp_vertices;
+		std::vector<int> vertex_remap; // OBJ index to index in temp_vertices (they differ for welded vertices)
+		SpatialHashGrid weld_grid{weld_tolerance};
+		std::unordered_set<unsigned long long> welded_edges; // Pairs of welded indices already in the edge pool
+		this->sub_meshes.push_back(SubMesh{"default", this->edge_pool.size(), 0, BoundingBox{}});
+		temp_vertices.reserve((size_t)expected_counts.vertices);
+		vertex_remap.reserve((size_t)expected_counts.vertices);
+		this->faces.reserve((size_t)expected_counts.faces);
+		this->edge_pool.reserve((size_t)(weld_tolerance > 0.0 ? expected_counts.face_corners / 2 : expected_counts.face_corners));
 		while (!f.eof())
 		{
 			char line[512];
@@ -60,13 +270,40 @@ public:
 
 			char type;
 
-			if (line[0] == 'v' && line[1] == ' ')
+			if ((line[0] == 'o' || line[0] == 'g') && (line[1] == ' ' || line[1] == '\0' || line[1] == '\r'))
+			{
+				std::string name;
+				s >> type >> name;
+				if (name.empty())
+					name = "default";
+
+				// A sub-mesh without edges yet just takes the new name (e.g. "o" followed by "g")
+				SubMesh &current = this->sub_meshes.back();
+				if (this->edge_pool.size() == current.first_edge)
+					current.name = name;
+				else
+					this->sub_meshes.push_back(SubMesh{name, this->edge_pool.size(), 0, BoundingBox{}});
+			}
+			else if (line[0] == 'v' && line[1] == ' ')
 			{
 				double vx, vy, vz;
 				s >> type >> vx >> vy >> vz;
 				if (invert_y)
 					vy *= -1;
 				Vect3 vert{vx, vy, vz};
+
+				if (weld_tolerance > 0.0)
+				{
+					int welded_index = weld_grid.find(vert, temp_vertices);
+					if (welded_index >= 0)
+					{
+						vertex_remap.push_back(welded_index);
+						this->welded_vertex_count++;
+						continue;
+					}
+					weld_grid.insert(vert, (int)temp_vertices.size());
+				}
+				vertex_remap.push_back((int)temp_vertices.size());
 				temp_vertices.push_back(vert);
 
 				this->vertex_count++;
@@ -74,6 +311,7 @@ public:
 			else if (line[0] == 'f')
 			{
 				Face f;
+				std::vector<int> face_indices;
 				std::string face_data;
 				s >> type;
 
@@ -87,13 +325,26 @@ public:
 						face_index += c;
 					}
 
-					int idx = std::stoi(face_index) - 1;
+					int idx = vertex_remap[std::stoi(face_index) - 1];
 					f.add_vertex(temp_vertices[idx]);
+					face_indices.push_back(idx);
 				}
 				this->faces.push_back(f);
 				this->face_count++;
 
-				// Edges
+				// Edges (once per pair of welded vertices when welding, the epsilon compare of clear_edge_pool otherwise)
+				if (weld_tolerance > 0.0)
+				{
+					for (size_t i = 0; i < face_indices.size(); i++)
+					{
+						int a = face_indices[i];
+						int b = face_indices[(i + 1) % face_indices.size()];
+						unsigned long long edge_key = ((unsigned long long)std::min(a, b) << 32) | (unsigned int)std::max(a, b);
+						if (a != b && welded_edges.insert(edge_key).second)
+							this->edge_pool.push_back(Edge{temp_vertices[a], temp_vertices[b]});
+					}
+					continue;
+				}
 				for (int i = 1; i < f.count_vertices(); i++)
 				{
 					Edge e{f[i - 1], f[i]};
@@ -106,8 +357,21 @@ public:
 
 		f.close();
 
+		// Closing the sub-meshes (the empty ones are dropped)
+		for (size_t i = 0; i < this->sub_meshes.size(); i++)
+		{
+			size_t end = i + 1 < this->sub_meshes.size() ? this->sub_meshes[i + 1].first_edge : this->edge_pool.size();
+			this->sub_meshes[i].edge_count = end - this->sub_meshes[i].first_edge;
+		}
+		this->sub_meshes.erase(std::remove_if(this->sub_meshes.begin(), this->sub_meshes.end(), [](SubMesh &sub_mesh) { return sub_mesh.edge_count == 0; }),
+							   this->sub_meshes.end());
+
 		// Printing feedback
 		printf("[INFO] Total faces: %i, Total vertices: %i\n", this->face_count, this->vertex_count);
+		if (this->sub_meshes.size() > 1)
+			printf("[INFO] Objects and groups: %i\n", (int)this->sub_meshes.size());
+		if (weld_tolerance > 0.0)
+			printf("[INFO] Welding (tolerance %g) merged %i vertices, %i unique edges\n", weld_tolerance, this->welded_vertex_count, (int)this->edge_pool.size());
 	}
 
 	// Get
@@ -115,9 +379,33 @@ public:
 	BoundingBox &get_bb() { return this->bounding_box; }
 	int count_total_faces() { return this->face_count; }
 	int count_total_vertices() { return this->vertex_count; }
+	int count_welded_vertices() { return this->welded_vertex_count; }
+	int count_total_edges() { return (int)(is_compact() ? this->compact_mesh.count_edges() : this->edge_pool.size()); }
+	size_t estimate_memory_bytes()
+	{
+		size_t bytes = sizeof(ObjReader) + faces.capacity() * sizeof(Face) + edge_pool.capacity() * sizeof(Edge) + compact_mesh.estimate_memory_bytes();
+		bytes += (face_normals.capacity() + face_origins.capacity()) * sizeof(Vect3) + (feature_edges.capacity() + smooth_edges.capacity()) * sizeof(Edge) +
+				 smooth_edge_faces.capacity() * sizeof(std::pair<int, int>);
+		for (Face &f : faces)
+			bytes += f.count_vertices() * sizeof(Vect3);
+		return bytes;
+	}
+
+	// Set (before read_from_file)
+	void set_weld_tolerance(double tolerance) { this->weld_tolerance = tolerance; }
 
 	// Utility for drawing
-	std::vector<Edge> get_edge_pool() { return this->edge_pool; }
+	std::vector<Edge> &get_edge_pool() { return this->edge_pool; }
+	bool is_compact() { return this->compact_mesh.count_edges() > 0; }
+	CompactMesh &get_compact_mesh() { return this->compact_mesh; }
+	Edge get_edge(size_t index) { return is_compact() ? this->compact_mesh.get_edge(index) : this->edge_pool[index]; }
+	std::vector<SubMesh> &get_sub_meshes() { return this->sub_meshes; }
+	bool has_edge_adjacency() { return !this->face_normals.empty(); }
+	std::vector<Vect3> &get_face_normals() { return this->face_normals; }
+	std::vector<Vect3> &get_face_origins() { return this->face_origins; }
+	std::vector<Edge> &get_feature_edges() { return this->feature_edges; }
+	std::vector<Edge> &get_smooth_edges() { return this->smooth_edges; }
+	std::vector<std::pair<int, int>> &get_smooth_edge_faces() { return this->smooth_edge_faces; }
 
 	// Transformations
 	void to_center()
@@ -131,11 +419,13 @@ public:
 				   displacement.get_x(), displacement.get_y(), displacement.get_z());
 
 		// Moving faces and BB
-		for (Face f : this->faces)
+		for (Face &f : this->faces)
 		{
 			f.move(displacement);
 		}
 		this->bounding_box.move(displacement);
+		for (SubMesh &sub_mesh : this->sub_meshes)
+			sub_mesh.bounding_box.move(displacement);
 
 		// Moving edge pool
 		for (Edge &e : this->edge_pool)
@@ -158,8 +448,193 @@ public:
 	// Utility
 	void clear_edge_pool()
 	{
-		std::sort(this->edge_pool.begin(), this->edge_pool.end());
-		this->edge_pool.erase(std::unique(this->edge_pool.begin(), this->edge_pool.end()), this->edge_pool.end());
+		PROFILE_SCOPE("edge_dedup");
+
+		// Within each sub-mesh, so that they keep a contiguous range of the pool
+		size_t cleared_count = 0;
+		for (SubMesh &sub_mesh : this->sub_meshes)
+		{
+			std::vector<Edge>::iterator first = this->edge_pool.begin() + sub_mesh.first_edge;
+			std::vector<Edge>::iterator last = first + sub_mesh.edge_count;
+			std::sort(first, last);
+			last = std::unique(first, last);
+
+			if (sub_mesh.first_edge != cleared_count)
+				std::move(first, last, this->edge_pool.begin() + cleared_count);
+			sub_mesh.first_edge = cleared_count;
+			sub_mesh.edge_count = last - first;
+			cleared_count += sub_mesh.edge_count;
+		}
+		this->edge_pool.erase(this->edge_pool.begin() + cleared_count, this->edge_pool.end());
+	}
+	void order_edges_spatially()
+	{
+		// Edges of every sub-mesh sorted along a Morton curve of their midpoints, so that consecutive edges land close on screen.
+		// Duplicated edges share their midpoint, so the duplicates left by the sort by length of clear_edge_pool become neighbours and are removed.
+		// Every edge is given its canonical direction first: which copy of a duplicate survives does not change the frames
+		PROFILE_SCOPE("edge_order");
+		Vect3 tl = this->bounding_box.get_top_left();
+		Vect3 br = this->bounding_box.get_bottom_right();
+		Vect3 low{tl.get_x(), br.get_y(), br.get_z()};
+		Vect3 size{br.get_x() - tl.get_x(), tl.get_y() - br.get_y(), tl.get_z() - br.get_z()};
+		const double MORTON_STEPS = (double)((1 << 21) - 1);
+		auto quantize = [&](double coord, double low_coord, double size_coord) {
+			return size_coord > 0.0 ? (unsigned int)((coord - low_coord) / size_coord * MORTON_STEPS) : 0u;
+		};
+
+		std::vector<std::pair<unsigned long long, size_t>> keys;
+		std::vector<Edge> ordered;
+		size_t ordered_count = 0;
+		size_t largest_edge_count = 0;
+		for (SubMesh &sub_mesh : this->sub_meshes)
+			largest_edge_count = std::max(largest_edge_count, sub_mesh.edge_count);
+		keys.reserve(largest_edge_count);
+		ordered.reserve(largest_edge_count);
+		for (SubMesh &sub_mesh : this->sub_meshes)
+		{
+			keys.clear();
+			ordered.clear();
+			for (size_t i = sub_mesh.first_edge; i < sub_mesh.first_edge + sub_mesh.edge_count; i++)
+			{
+				Vect3 mid = this->edge_pool[i].get_origin().get_midpoint(this->edge_pool[i].get_end());
+				keys.push_back({get_morton_code(quantize(mid.get_x(), low.get_x(), size.get_x()),
+												quantize(mid.get_y(), low.get_y(), size.get_y()),
+												quantize(mid.get_z(), low.get_z(), size.get_z())),
+								i});
+			}
+			std::sort(keys.begin(), keys.end());
+			for (std::pair<unsigned long long, size_t> &key : keys)
+				ordered.push_back(this->edge_pool[key.second].get_canonical());
+			ordered.erase(std::unique(ordered.begin(), ordered.end()), ordered.end());
+
+			std::copy(ordered.begin(), ordered.end(), this->edge_pool.begin() + ordered_count);
+			sub_mesh.first_edge = ordered_count;
+			sub_mesh.edge_count = ordered.size();
+			ordered_count += ordered.size();
+		}
+		this->edge_pool.erase(this->edge_pool.begin() + ordered_count, this->edge_pool.end());
+	}
+	void compact()
+	{
+		// Edges re-encoded with 16-bit positions, and the full precision faces and edges released.
+		// Goes last: the edge ranges of the sub-meshes are kept, but nothing can be rebuilt from the faces afterwards
+		PROFILE_SCOPE("mesh_compaction");
+		if (this->edge_pool.empty())
+			return;
+		size_t full_bytes = estimate_memory_bytes();
+		this->compact_mesh.build(this->edge_pool, this->bounding_box);
+		std::vector<Edge>().swap(this->edge_pool);
+		std::vector<Face>().swap(this->faces);
+
+		printf("[INFO] Compact mesh: %i vertices, %i-bit indices, %.2f MB instead of %.2f MB\n", (int)this->compact_mesh.count_vertices(),
+			   this->compact_mesh.get_index_bits(), estimate_memory_bytes() / (1024.0 * 1024.0), full_bytes / (1024.0 * 1024.0));
+	}
+	void release_faces()
+	{
+		// The faces are only read to build the bounding box, the edges and their adjacency: once those are done, drawing never needs them
+		if (this->faces.empty())
+			return;
+		size_t full_bytes = estimate_memory_bytes();
+		std::vector<Face>().swap(this->faces);
+		printf("[INFO] Faces released after edge extraction: %.2f MB instead of %.2f MB\n", estimate_memory_bytes() / (1024.0 * 1024.0), full_bytes / (1024.0 * 1024.0));
+	}
+	void build_edge_adjacency(double crease_angle)
+	{
+		// Edges shared by faces, matched by position (so split vertices are still joined), and the normal of every face
+		PROFILE_SCOPE("edge_adjacency");
+		this->face_normals.clear();
+		this->face_origins.clear();
+		this->feature_edges.clear();
+		this->smooth_edges.clear();
+		this->smooth_edge_faces.clear();
+
+		SpatialHashGrid vertex_grid{0.000001};
+		std::vector<Vect3> positions;
+		auto get_vertex_id = [&](Vect3 v) {
+			int id = vertex_grid.find(v, positions);
+			if (id < 0)
+			{
+				id = (int)positions.size();
+				vertex_grid.insert(v, id);
+				positions.push_back(v);
+			}
+			return id;
+		};
+
+		std::unordered_map<unsigned long long, size_t> edge_ids;
+		std::vector<Edge> edges;
+		std::vector<int> edge_face_counts;
+		std::vector<std::pair<int, int>> edge_faces;
+		for (size_t fi = 0; fi < this->faces.size(); fi++)
+		{
+			// Newell's method, valid for non-planar polygons too
+			Face &f = this->faces[fi];
+			Vect3 normal;
+			std::vector<int> ids;
+			for (int i = 0; i < f.count_vertices(); i++)
+			{
+				Vect3 current = f[i];
+				Vect3 next = f[(i + 1) % f.count_vertices()];
+				normal = normal + cross_prod(current, next);
+				ids.push_back(get_vertex_id(current));
+			}
+			if (normal.get_magnitude() > 0.0)
+				normal.normalize();
+			this->face_normals.push_back(normal);
+			this->face_origins.push_back(f[0]);
+
+			for (size_t i = 0; i < ids.size(); i++)
+			{
+				int a = ids[i];
+				int b = ids[(i + 1) % ids.size()];
+				if (a == b)
+					continue;
+				unsigned long long edge_key = ((unsigned long long)std::min(a, b) << 32) | (unsigned int)std::max(a, b);
+				std::pair<std::unordered_map<unsigned long long, size_t>::iterator, bool> found = edge_ids.insert({edge_key, edges.size()});
+				if (found.second)
+				{
+					edges.push_back(Edge{positions[a], positions[b]});
+					edge_face_counts.push_back(1);
+					edge_faces.push_back({(int)fi, -1});
+				}
+				else if (++edge_face_counts[found.first->second] == 2)
+					edge_faces[found.first->second].second = (int)fi;
+			}
+		}
+
+		// Classification (crease edges join faces at more than crease_angle, non-manifold ones are always drawn)
+		double crease_cos = rad_cos(crease_angle);
+		int boundary_count = 0, crease_count = 0, non_manifold_count = 0;
+		for (size_t i = 0; i < edges.size(); i++)
+		{
+			if (edge_face_counts[i] == 1)
+				boundary_count++;
+			else if (edge_face_counts[i] > 2)
+				non_manifold_count++;
+			else if (dot_prod(face_normals[edge_faces[i].first], face_normals[edge_faces[i].second]) < crease_cos)
+				crease_count++;
+			else
+			{
+				this->smooth_edges.push_back(edges[i]);
+				this->smooth_edge_faces.push_back(edge_faces[i]);
+				continue;
+			}
+			this->feature_edges.push_back(edges[i]);
+		}
+
+		printf("[INFO] Feature edges (crease angle %g): %i boundary, %i crease, %i non-manifold, %i smooth (drawn on the silhouette)\n",
+			   crease_angle, boundary_count, crease_count, non_manifold_count, (int)this->smooth_edges.size());
+	}
+	static unsigned long long get_morton_code(unsigned int x, unsigned int y, unsigned int z)
+	{
+		// Bits of the three coords (21 each) interleaved
+		unsigned long long code = 0;
+		for (int bit = 0; bit < 21; bit++)
+		{
+			code |= ((unsigned long long)((x >> bit) & 1) << (3 * bit)) | ((unsigned long long)((y >> bit) & 1) << (3 * bit + 1)) |
+					((unsigned long long)((z >> bit) & 1) << (3 * bit + 2));
+		}
+		return code;
 	}
 	void calculate_bb()
 	{
@@ -177,5 +652,17 @@ public:
 		}
 
 		this->bounding_box.create_faces();
+
+		for (SubMesh &sub_mesh : this->sub_meshes)
+		{
+			Vect3 first_sub_v = this->edge_pool[sub_mesh.first_edge].get_origin();
+			sub_mesh.bounding_box.set_top_left(first_sub_v);
+			sub_mesh.bounding_box.set_bottom_right(first_sub_v);
+			for (size_t i = sub_mesh.first_edge; i < sub_mesh.first_edge + sub_mesh.edge_count; i++)
+			{
+				sub_mesh.bounding_box.expand(this->edge_pool[i].get_origin());
+				sub_mesh.bounding_box.expand(this->edge_pool[i].get_end());
+			}
+		}
 	}
 };
\ No newline at end of file
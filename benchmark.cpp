@@ -0,0 +1,865 @@
+/*
+ * Author: Jaime Rivera
+ * Date : 2020.04.20
+ * Copyright : Copyright 2020 Jaime Rivera | www.jaimervq.com
+ * Brief: Micro and macro benchmarks of the renderer's hot paths, on synthetic meshes, with JSON output. Also golden-image regression runs with time budgets.
+ * Credits: Sean Barrett, author of the STB library, used in this project (https://github.com/nothings/stb)
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+#define OBJ_RENDERER_PROFILING_IMPLEMENTATION // Only used when built with OBJ_RENDERER_PROFILING
+
+#include "basic_obj_reader.h"
+#include "drawing_utils.h"
+#include "frame_output.h"
+#include "memory_plan.h"
+#include "turntable.h"
+
+// --------- HARDWARE COUNTERS --------- //
+class CacheMissCounter
+{
+private:
+	int fd; // -1 when the counter is not available (other systems, VMs, or no permission)
+
+public:
+	// Constructor
+	CacheMissCounter() : fd(-1)
+	{
+#ifdef __linux__
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		this->fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+	}
+	CacheMissCounter(const CacheMissCounter &) = delete;
+	~CacheMissCounter()
+	{
+#ifdef __linux__
+		if (fd >= 0)
+			close(fd);
+#endif
+	}
+
+	// Get
+	bool is_available() { return fd >= 0; }
+
+	// Counting
+	void start()
+	{
+#ifdef __linux__
+		if (fd < 0)
+			return;
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	}
+	long long stop()
+	{
+		long long misses = 0;
+#ifdef __linux__
+		if (fd < 0 || ioctl(fd, PERF_EVENT_IOC_DISABLE, 0) != 0 || read(fd, &misses, sizeof(misses)) != sizeof(misses))
+			return 0;
+#endif
+		return misses;
+	}
+};
+
+// --------- BENCHMARK RESULTS --------- //
+struct BenchResult
+{
+	std::string name;
+	long long iterations;
+	double total_ns;
+	double items_per_iteration;
+	long long cache_misses; // Of all iterations (0 when not counted)
+
+	double ns_per_iteration() const { return total_ns / (double)iterations; }
+	double items_per_second() const { return items_per_iteration * (double)iterations / (total_ns * 1e-9); }
+};
+
+class BenchRunner
+{
+private:
+	double min_seconds;
+	std::string filter;
+	std::vector<BenchResult> results;
+	CacheMissCounter cache_miss_counter;
+
+public:
+	// Constructor
+	BenchRunner(double input_min_seconds, std::string input_filter) : min_seconds(input_min_seconds), filter(input_filter) {}
+
+	// Running (setup is executed before every iteration, outside of the measured time)
+	void run(std::string name, double items_per_iteration, std::function<void()> setup, std::function<void()> body)
+	{
+		if (!filter.empty() && name.find(filter) == std::string::npos)
+			return;
+
+		BenchResult result{name, 0, 0.0, items_per_iteration, 0};
+		while (result.total_ns < min_seconds * 1e9 || result.iterations < 3)
+		{
+			if (setup)
+				setup();
+
+			cache_miss_counter.start();
+			std::chrono::time_point start = std::chrono::steady_clock::now();
+			body();
+			std::chrono::time_point end = std::chrono::steady_clock::now();
+			result.cache_misses += cache_miss_counter.stop();
+
+			result.total_ns += (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+			result.iterations++;
+		}
+
+		printf("[BENCH] %-32s %10lld iters %14.1f ns/iter %14.1f items/s",
+			   result.name.c_str(), result.iterations, result.ns_per_iteration(), result.items_per_second());
+		if (cache_miss_counter.is_available())
+			printf(" %12.1f cache misses/iter", (double)result.cache_misses / (double)result.iterations);
+		printf("\n");
+		results.push_back(result);
+	}
+	void run(std::string name, double items_per_iteration, std::function<void()> body)
+	{
+		run(name, items_per_iteration, nullptr, body);
+	}
+
+	// Get
+	std::vector<BenchResult> &get_results() { return this->results; }
+
+	// Output
+	void to_json(std::string filename, std::string mesh_description)
+	{
+		std::ofstream f{filename};
+		f << "{\n";
+		f << "  \"mesh\": \"" << mesh_description << "\",\n";
+		f << "  \"min_seconds\": " << min_seconds << ",\n";
+		f << "  \"results\": [\n";
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			BenchResult &r = results[i];
+			f << "    {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+			  << ", \"ns_per_iteration\": " << std::fixed << r.ns_per_iteration()
+			  << ", \"items_per_second\": " << r.items_per_second();
+			if (cache_miss_counter.is_available())
+				f << ", \"cache_misses_per_iteration\": " << (double)r.cache_misses / (double)r.iterations;
+			f << "}";
+			f << (i + 1 < results.size() ? ",\n" : "\n");
+		}
+		f << "  ]\n";
+		f << "}\n";
+	}
+	void compare_with(std::string baseline_filename)
+	{
+		std::ifstream f{baseline_filename};
+		if (!f.is_open())
+		{
+			std::cerr << "[ERROR] Could not open the baseline results: " << baseline_filename << std::endl;
+			return;
+		}
+
+		// Only the format written by to_json() is understood (one result per line)
+		printf("[BENCH] Comparison against %s (ratio > 1.0 means faster now)\n", baseline_filename.c_str());
+		std::string line;
+		while (std::getline(f, line))
+		{
+			size_t name_pos = line.find("\"name\": \"");
+			size_t ns_pos = line.find("\"ns_per_iteration\": ");
+			if (name_pos == std::string::npos || ns_pos == std::string::npos)
+				continue;
+
+			name_pos += 9;
+			std::string name = line.substr(name_pos, line.find('"', name_pos) - name_pos);
+			double baseline_ns = std::stod(line.substr(ns_pos + 20));
+
+			for (BenchResult &r : results)
+			{
+				if (r.name == name)
+					printf("[BENCH] %-32s %14.1f -> %14.1f ns/iter  x%.2f\n",
+						   name.c_str(), baseline_ns, r.ns_per_iteration(), baseline_ns / r.ns_per_iteration());
+			}
+		}
+	}
+};
+
+// --------- SYNTHETIC MESHES --------- //
+class SyntheticObjWriter
+{
+private:
+	std::vector<Vect3> vertices;
+	std::vector<std::vector<int>> faces;
+
+public:
+	// Shapes
+	void add_cube(Cube cube)
+	{
+		for (Face &f : cube.get_faces())
+			add_face(f);
+	}
+	void add_cylinder(Vect3 base, double radius, double height, int sides, int rings)
+	{
+		// Every ring is a Polygon, consecutive rings are stitched with quads
+		Polygon ring{radius, sides};
+		int first = (int)vertices.size();
+		for (int r = 0; r < rings + 1; r++)
+		{
+			double y = base.get_y() + height * (double)r / (double)rings;
+			for (int i = 0; i < ring.count_vertices(); i++)
+				vertices.push_back(Vect3{base.get_x() + ring[i].get_x(), y, base.get_z() + ring[i].get_y()});
+		}
+		for (int r = 0; r < rings; r++)
+		{
+			for (int i = 0; i < sides; i++)
+			{
+				int a = first + r * sides + i;
+				int b = first + r * sides + (i + 1) % sides;
+				faces.push_back({a, b, b + sides, a + sides});
+			}
+		}
+	}
+	void add_sphere(Vect3 center, double radius, int segments, int rings)
+	{
+		// Triangles around the poles, quads in between
+		int north = (int)vertices.size();
+		vertices.push_back(center + Vect3{0.0, radius, 0.0});
+		for (int r = 1; r < rings; r++)
+		{
+			double polar = M_PI * (double)r / (double)rings;
+			for (int i = 0; i < segments; i++)
+			{
+				double azimuth = 2.0 * M_PI * (double)i / (double)segments;
+				vertices.push_back(center + Vect3{radius * sin(polar) * cos(azimuth), radius * cos(polar), radius * sin(polar) * sin(azimuth)});
+			}
+		}
+		int south = (int)vertices.size();
+		vertices.push_back(center + Vect3{0.0, -radius, 0.0});
+
+		for (int i = 0; i < segments; i++)
+		{
+			int next = (i + 1) % segments;
+			faces.push_back({north, north + 1 + next, north + 1 + i});
+			for (int r = 0; r < rings - 2; r++)
+			{
+				int a = north + 1 + r * segments;
+				faces.push_back({a + i, a + next, a + segments + next, a + segments + i});
+			}
+			int last_ring = north + 1 + (rings - 2) * segments;
+			faces.push_back({south, last_ring + i, last_ring + next});
+		}
+	}
+	void add_face(Face f)
+	{
+		std::vector<int> indices;
+		for (Vect3 v : f.get_vertices())
+		{
+			indices.push_back((int)vertices.size());
+			vertices.push_back(v);
+		}
+		faces.push_back(indices);
+	}
+
+	// Get
+	int count_vertices() { return (int)vertices.size(); }
+	int count_faces() { return (int)faces.size(); }
+
+	// Output
+	void to_file(std::string filename)
+	{
+		std::ofstream f{filename};
+		for (Vect3 v : vertices)
+			f << "v " << v.get_x() << " " << v.get_y() << " " << v.get_z() << "\n";
+		for (std::vector<int> &face : faces)
+		{
+			f << "f";
+			for (int idx : face)
+				f << " " << idx + 1;
+			f << "\n";
+		}
+	}
+};
+
+SyntheticObjWriter build_synthetic_mesh(int cubes_per_side, int cylinder_sides)
+{
+	SyntheticObjWriter mesh;
+	for (int i = 0; i < cubes_per_side; i++)
+	{
+		for (int j = 0; j < cubes_per_side; j++)
+		{
+			for (int k = 0; k < cubes_per_side; k++)
+			{
+				Vect3 corner{i * 3.0, j * 3.0, k * 3.0};
+				mesh.add_cube(Cube{corner, corner + Vect3{2.0, 2.0, 2.0}});
+			}
+		}
+	}
+	if (cylinder_sides > 2)
+		mesh.add_cylinder(Vect3{cubes_per_side * 1.5, 0.0, cubes_per_side * 1.5}, cubes_per_side * 2.0, cubes_per_side * 3.0, cylinder_sides, cylinder_sides / 2);
+
+	return mesh;
+}
+
+// --------- EDGE ORDER --------- //
+int count_tile_changes(BasicImage &image, std::vector<Edge> &edges)
+{
+	// Portable stand-in for cache misses: how often the next edge starts on another tile than the one the last edge ended on
+	int changes = 0;
+	int last_tile = -1;
+	for (Edge e : edges)
+	{
+		e.rotate_around_axis(33.0, Vect3::YAxis);
+		StraightLine line = image.project_edge(e);
+		int x1, y1, x2, y2;
+		image.transform_to_image_cords(line.get_origin().get_x(), line.get_origin().get_y(), x1, y1);
+		image.transform_to_image_cords(line.get_end().get_x(), line.get_end().get_y(), x2, y2);
+		int first_tile = (y1 / BasicImage::TILE_SIZE) * 1000 + x1 / BasicImage::TILE_SIZE;
+		changes += first_tile != last_tile ? 1 : 0;
+		last_tile = (y2 / BasicImage::TILE_SIZE) * 1000 + x2 / BasicImage::TILE_SIZE;
+	}
+	return changes;
+}
+
+// --------- GOLDEN IMAGES --------- //
+struct GoldenFrameDiff
+{
+	int differing_pixels; // Beyond the tolerance
+	int max_difference;	  // Biggest difference of a channel, in 0-255
+	std::string error;	  // Set when the images could not be compared
+};
+
+GoldenFrameDiff compare_with_golden(std::string frame_path, std::string golden_path, int tolerance)
+{
+	// Both images are read as RGBA, so that indexed frames compare with their RGBA goldens and the other way around
+	GoldenFrameDiff diff{0, 0, ""};
+	int width = 0, height = 0, golden_width = 0, golden_height = 0, file_channels = 0;
+	unsigned char *frame = stbi_load(frame_path.c_str(), &width, &height, &file_channels, 4);
+	unsigned char *golden = stbi_load(golden_path.c_str(), &golden_width, &golden_height, &file_channels, 4);
+	if (!golden)
+		diff.error = "no golden image (run with --update-golden first)";
+	else if (!frame)
+		diff.error = "the frame could not be read";
+	else if (width != golden_width || height != golden_height)
+		diff.error = "size " + std::to_string(width) + "x" + std::to_string(height) + " instead of " + std::to_string(golden_width) + "x" + std::to_string(golden_height);
+	else
+	{
+		for (size_t i = 0; i < (size_t)width * height; i++)
+		{
+			int pixel_difference = 0;
+			for (int c = 0; c < 4; c++)
+				pixel_difference = std::max(pixel_difference, std::abs((int)frame[i * 4 + c] - (int)golden[i * 4 + c]));
+			diff.max_difference = std::max(diff.max_difference, pixel_difference);
+			if (pixel_difference > tolerance)
+				diff.differing_pixels++;
+		}
+	}
+	if (frame)
+		stbi_image_free(frame);
+	if (golden)
+		stbi_image_free(golden);
+	return diff;
+}
+
+// --------- STAGE BUDGETS --------- //
+class StageBudgets
+{
+	// Time allowed to each stage of the regression runs. Recorded on one machine, and only meaningful on that machine
+private:
+	std::map<std::string, double> budgets_ms;
+
+public:
+	// Room left over the measured times when recording, for the noise between runs (the slack is for the very short stages)
+	static constexpr double RECORDING_MARGIN = 1.5;
+	static constexpr double RECORDING_SLACK_MS = 10.0;
+
+	// Get
+	bool has_budget(std::string stage) { return budgets_ms.count(stage) > 0; }
+	double get_budget_ms(std::string stage) { return budgets_ms[stage]; }
+
+	// Files (one stage per line)
+	bool load(std::string filename)
+	{
+		std::ifstream f{filename};
+		if (!f.is_open())
+		{
+			std::cerr << "[ERROR] Could not open the stage budgets: " << filename << std::endl;
+			return false;
+		}
+		std::string line;
+		while (std::getline(f, line))
+		{
+			size_t stage_pos = line.find("\"stage\": \"");
+			size_t budget_pos = line.find("\"budget_ms\": ");
+			if (stage_pos == std::string::npos || budget_pos == std::string::npos)
+				continue;
+			stage_pos += 10;
+			const char *budget_start = line.c_str() + budget_pos + 13;
+			char *budget_end = nullptr;
+			double budget_ms = std::strtod(budget_start, &budget_end);
+			if (budget_end == budget_start)
+			{
+				std::cerr << "[ERROR] Invalid stage budget in " << filename << ": " << line << std::endl;
+				return false;
+			}
+			budgets_ms[line.substr(stage_pos, line.find('"', stage_pos) - stage_pos)] = budget_ms;
+		}
+		return true;
+	}
+	static void record(std::string filename, std::vector<std::pair<std::string, double>> &measured_ms)
+	{
+		std::ofstream f{filename};
+		f << "{\n  \"margin\": " << RECORDING_MARGIN << ",\n  \"slack_ms\": " << RECORDING_SLACK_MS << ",\n  \"budgets\": [\n";
+		for (size_t i = 0; i < measured_ms.size(); i++)
+		{
+			f << "    {\"stage\": \"" << measured_ms[i].first << "\", \"budget_ms\": " << std::fixed << measured_ms[i].second * RECORDING_MARGIN + RECORDING_SLACK_MS << "}";
+			f << (i + 1 < measured_ms.size() ? ",\n" : "\n");
+		}
+		f << "  ]\n}\n";
+	}
+};
+
+// --------- REGRESSION RUNS --------- //
+struct RegressionCase
+{
+	std::string name;
+	SyntheticObjWriter mesh;
+	std::vector<std::string> arguments; // Options of the renderer, as given in the command line
+};
+
+std::vector<RegressionCase> build_regression_cases()
+{
+	// Fixed meshes and options (changing them means recording the golden images again), covering several paths of the renderer
+	std::vector<RegressionCase> cases;
+
+	SyntheticObjWriter cube;
+	cube.add_cube(Cube{Vect3{-1.0, -1.0, -1.0}, Vect3{1.0, 1.0, 1.0}});
+	cases.push_back(RegressionCase{"cube", cube, {"--resolutions", "1080,720", "--every", "20"}});
+
+	SyntheticObjWriter sphere;
+	sphere.add_sphere(Vect3{0.0, 0.0, 0.0}, 1.0, 48, 24);
+	cases.push_back(RegressionCase{"sphere", sphere, {"--edges", "features", "--aa", "--every", "20"}});
+
+	cases.push_back(RegressionCase{"grid", build_synthetic_mesh(16, 256), {"--compact", "--format", "png8", "--every", "40"}});
+	return cases;
+}
+
+std::vector<std::filesystem::path> list_regression_frames(std::filesystem::path folder, std::string case_name)
+{
+	// Frames of the case in the folder, relative to it and sorted
+	std::vector<std::filesystem::path> frames;
+	if (!std::filesystem::is_directory(folder))
+		return frames;
+	for (const std::filesystem::directory_entry &entry : std::filesystem::recursive_directory_iterator(folder))
+	{
+		std::filesystem::path relative_path = std::filesystem::relative(entry.path(), folder);
+		if (entry.is_regular_file() && entry.path().extension() == ".png" && relative_path.string().rfind(case_name + "_turntable", 0) == 0)
+			frames.push_back(relative_path);
+	}
+	std::sort(frames.begin(), frames.end());
+	return frames;
+}
+
+int run_regression(std::string golden_folder, bool update_golden, int tolerance, int runs, std::string budget_path, std::string record_budget_path)
+{
+	// Every case goes through the same steps as a run of the renderer (main.cpp): the frames it writes are compared with
+	// (or stored as) the golden images, and the best time of each stage over the runs is checked against its budget
+	std::filesystem::path work_folder = std::filesystem::temp_directory_path() / "obj_renderer_regression";
+	std::filesystem::remove_all(work_folder);
+	std::filesystem::create_directories(work_folder);
+
+	StageBudgets budgets;
+	if (!budget_path.empty() && !budgets.load(budget_path))
+		return EXIT_FAILURE;
+	std::vector<std::pair<std::string, double>> measured_ms;
+	int failures = 0;
+
+	for (RegressionCase &regression_case : build_regression_cases())
+	{
+		// ------ Job ------ //
+		std::string obj_path = (work_folder / (regression_case.name + ".obj")).string();
+		regression_case.mesh.to_file(obj_path);
+		std::vector<std::string> arguments{obj_path};
+		arguments.insert(arguments.end(), regression_case.arguments.begin(), regression_case.arguments.end());
+		TurntableJob job;
+		if (!job.parse_arguments(arguments))
+		{
+			std::cerr << "[ERROR] Invalid options for the regression case " << regression_case.name << std::endl;
+			return EXIT_FAILURE;
+		}
+		std::unique_ptr<MemoryPlan> memory_plan = plan_job_memory(job);
+
+		// ------ Stages (best of the runs) ------ //
+		double load_ms = 0.0, render_ms = 0.0;
+		bool render_failed = false;
+		for (int run = 0; run < runs; run++)
+		{
+			std::chrono::time_point load_start = std::chrono::steady_clock::now();
+			std::shared_ptr<ObjReader> obj = load_job_mesh(job, memory_plan.get());
+			std::chrono::time_point render_start = std::chrono::steady_clock::now();
+			render_failed |= render_turntable(job, *obj) < 0;
+			std::chrono::time_point render_end = std::chrono::steady_clock::now();
+
+			double run_load_ms = std::chrono::duration<double, std::milli>(render_start - load_start).count();
+			double run_render_ms = std::chrono::duration<double, std::milli>(render_end - render_start).count();
+			load_ms = run == 0 ? run_load_ms : std::min(load_ms, run_load_ms);
+			render_ms = run == 0 ? run_render_ms : std::min(render_ms, run_render_ms);
+		}
+		measured_ms.push_back({regression_case.name + "/load", load_ms});
+		measured_ms.push_back({regression_case.name + "/render", render_ms});
+
+		// ------ Frames ------ //
+		std::vector<std::filesystem::path> frames = list_regression_frames(work_folder, regression_case.name);
+		if (update_golden)
+		{
+			// The golden images of the case are replaced as a whole, so none is left from frames no longer written
+			for (std::filesystem::path &golden_frame : list_regression_frames(golden_folder, regression_case.name))
+				std::filesystem::remove(std::filesystem::path{golden_folder} / golden_frame);
+			for (std::filesystem::path &frame : frames)
+			{
+				std::filesystem::path golden_path = std::filesystem::path{golden_folder} / frame;
+				std::filesystem::create_directories(golden_path.parent_path());
+				std::filesystem::copy_file(work_folder / frame, golden_path, std::filesystem::copy_options::overwrite_existing);
+			}
+			printf("[GOLDEN] %-8s %3i golden images stored in %s\n", regression_case.name.c_str(), (int)frames.size(), golden_folder.c_str());
+			failures += frames.empty() || render_failed ? 1 : 0;
+			continue;
+		}
+
+		// Every golden image must have been written again, and nothing else
+		std::vector<std::filesystem::path> golden_frames = list_regression_frames(golden_folder, regression_case.name);
+		int failed_frames = render_failed ? 1 : 0;
+		int max_difference = 0;
+		for (std::filesystem::path &frame : frames)
+		{
+			if (!std::binary_search(golden_frames.begin(), golden_frames.end(), frame))
+			{
+				printf("[GOLDEN] %s: no golden image\n", frame.string().c_str());
+				failed_frames++;
+			}
+		}
+		for (std::filesystem::path &frame : golden_frames)
+		{
+			if (!std::binary_search(frames.begin(), frames.end(), frame))
+			{
+				printf("[GOLDEN] %s: not written\n", frame.string().c_str());
+				failed_frames++;
+				continue;
+			}
+			GoldenFrameDiff diff = compare_with_golden((work_folder / frame).string(), (std::filesystem::path{golden_folder} / frame).string(), tolerance);
+			max_difference = std::max(max_difference, diff.max_difference);
+			if (!diff.error.empty())
+				printf("[GOLDEN] %s: %s\n", frame.string().c_str(), diff.error.c_str());
+			else if (diff.differing_pixels > 0)
+				printf("[GOLDEN] %s: %i pixels beyond the tolerance (max difference %i)\n", frame.string().c_str(), diff.differing_pixels, diff.max_difference);
+			failed_frames += !diff.error.empty() || diff.differing_pixels > 0 ? 1 : 0;
+		}
+		printf("[GOLDEN] %-8s %3i frames, %i failed (max difference %i, tolerance %i)\n", regression_case.name.c_str(), (int)golden_frames.size(), failed_frames, max_difference, tolerance);
+		failures += golden_frames.empty() ? 1 : failed_frames;
+	}
+
+	// ------ Budgets ------ //
+	for (std::pair<std::string, double> &stage : measured_ms)
+	{
+		if (!budgets.has_budget(stage.first))
+		{
+			printf("[BUDGET] %-16s %10.1f ms%s\n", stage.first.c_str(), stage.second, budget_path.empty() ? "" : " (no budget recorded)");
+			continue;
+		}
+		bool over_budget = stage.second > budgets.get_budget_ms(stage.first);
+		printf("[BUDGET] %-16s %10.1f ms of %10.1f ms%s\n", stage.first.c_str(), stage.second, budgets.get_budget_ms(stage.first), over_budget ? "  OVER BUDGET" : "");
+		failures += over_budget ? 1 : 0;
+	}
+	if (!record_budget_path.empty())
+	{
+		StageBudgets::record(record_budget_path, measured_ms);
+		printf("[INFO] Stage budgets recorded in %s (x%.2f the measured times, plus %.0f ms)\n", record_budget_path.c_str(), StageBudgets::RECORDING_MARGIN, StageBudgets::RECORDING_SLACK_MS);
+	}
+
+	std::filesystem::remove_all(work_folder);
+	if (failures > 0)
+	{
+		std::cerr << "[ERROR] Regression run failed: " << failures << " failed frames or stages over budget" << std::endl;
+		return EXIT_FAILURE;
+	}
+	printf("[INFO] Regression run passed\n");
+	return 0;
+}
+
+// --------- MAIN --------- //
+int main(int argc, char *argv[])
+{
+	// ------ Input arguments ------ //
+	int cubes_per_side = 8;
+	int cylinder_sides = 256;
+	double min_seconds = 0.5;
+	std::string filter;
+	std::string json_path = "benchmark_results.json";
+	std::string baseline_path;
+	std::string golden_folder, budget_path, record_budget_path;
+	bool update_golden = false;
+	int tolerance = 0;
+	int runs = 3;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--cubes" && has_value)
+			cubes_per_side = std::atoi(argv[++i]);
+		else if (arg == "--sides" && has_value)
+			cylinder_sides = std::atoi(argv[++i]);
+		else if (arg == "--min-time" && has_value)
+			min_seconds = std::atof(argv[++i]);
+		else if (arg == "--filter" && has_value)
+			filter = argv[++i];
+		else if (arg == "--out" && has_value)
+			json_path = argv[++i];
+		else if (arg == "--compare" && has_value)
+			baseline_path = argv[++i];
+		else if (arg == "--regression" && has_value)
+			golden_folder = argv[++i];
+		else if (arg == "--update-golden")
+			update_golden = true;
+		else if (arg == "--tolerance" && has_value)
+			tolerance = std::atoi(argv[++i]);
+		else if (arg == "--runs" && has_value)
+			runs = std::max(1, std::atoi(argv[++i]));
+		else if (arg == "--budget" && has_value)
+			budget_path = argv[++i];
+		else if (arg == "--record-budget" && has_value)
+			record_budget_path = argv[++i];
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--cubes N] [--sides N] [--min-time SECONDS] [--filter NAME] [--out FILE.json] [--compare BASELINE.json]" << std::endl;
+			std::cerr << "       " << argv[0] << " --regression GOLDEN_FOLDER [--update-golden] [--tolerance N] [--runs N] [--budget FILE.json] [--record-budget FILE.json]" << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+	}
+
+	// ------ Golden-image regression run (instead of the benchmarks) ------ //
+	if (!golden_folder.empty())
+		return run_regression(golden_folder, update_golden, tolerance, runs, budget_path, record_budget_path);
+
+	// ------ Synthetic mesh ------ //
+	SyntheticObjWriter synthetic = build_synthetic_mesh(cubes_per_side, cylinder_sides);
+	std::string obj_path = (std::filesystem::temp_directory_path() / "obj_renderer_bench.obj").string();
+	synthetic.to_file(obj_path);
+
+	std::string mesh_description = std::to_string(cubes_per_side) + "^3 cubes + " + std::to_string(cylinder_sides) + "-sided cylinder (" +
+								   std::to_string(synthetic.count_faces()) + " faces, " + std::to_string(synthetic.count_vertices()) + " vertices)";
+	printf("[INFO] Synthetic mesh: %s\n", mesh_description.c_str());
+
+	BenchRunner runner{min_seconds, filter};
+
+	// ------ OBJ loading ------ //
+	ObjReader parsed_obj{obj_path, false};
+	runner.run(
+		"obj_parse", synthetic.count_faces(),
+		[&]() { parsed_obj = ObjReader{obj_path, false}; },
+		[&]() { parsed_obj.read_from_file(); });
+
+	ObjReader dedup_obj = parsed_obj;
+	runner.run(
+		"clear_edge_pool", (double)parsed_obj.get_edge_pool().size(),
+		[&]() { dedup_obj = parsed_obj; },
+		[&]() { dedup_obj.clear_edge_pool(); });
+
+	ObjReader obj{obj_path};
+	std::vector<Edge> edges = obj.get_edge_pool();
+
+	// ------ Vertex transform ------ //
+	std::vector<Edge> rotated_edges = edges;
+	runner.run(
+		"vertex_transform", (double)edges.size() * 2,
+		[&]() { rotated_edges = edges; },
+		[&]() {
+			for (Edge &e : rotated_edges)
+				e.rotate_around_axis(33.0, Vect3::YAxis);
+		});
+
+	// ------ Rasterization and blending ------ //
+	BasicImage image = BasicImage::HD_1080();
+	image.estimate_obj_drawing_params(obj);
+
+	BasicColor retro_yellow{0.8, 0.57, 0.05};
+	BasicBrush regular_brush{retro_yellow};
+	BasicBrush square_brush{retro_yellow, 4, BasicBrush::SQUARE_TIP_SHAPE};
+	BasicBrush round_brush{retro_yellow, 3, BasicBrush::ROUND_TIP_SHAPE};
+
+	std::mt19937 rng{1234};
+	std::uniform_real_distribution<double> coord_x{-1000.0, 1000.0};
+	std::uniform_real_distribution<double> coord_y{-600.0, 600.0};
+	std::uniform_int_distribution<int> pixel_x{0, image.get_width() - 1};
+	std::uniform_int_distribution<int> pixel_y{0, image.get_height() - 1};
+
+	const int LINE_COUNT = 1000;
+	std::vector<StraightLine> lines;
+	double total_line_length = 0.0;
+	for (int i = 0; i < LINE_COUNT; i++)
+	{
+		StraightLine line{coord_x(rng), coord_y(rng), coord_x(rng), coord_y(rng)};
+		total_line_length += line.get_length();
+		lines.push_back(line);
+	}
+
+	const int DOT_COUNT = 10000;
+	std::vector<std::pair<int, int>> pixel_coords;
+	for (int i = 0; i < DOT_COUNT; i++)
+		pixel_coords.push_back({pixel_x(rng), pixel_y(rng)});
+
+	runner.run("draw_solid_line", total_line_length, [&]() {
+		for (StraightLine &line : lines)
+			image.draw_solid_line(line, regular_brush);
+	});
+	runner.run("draw_solid_line_thick", total_line_length, [&]() {
+		for (StraightLine &line : lines)
+			image.draw_solid_line(line, square_brush);
+	});
+	BasicBrush aa_brush = regular_brush;
+	aa_brush.set_anti_aliased(true);
+	BasicBrush aa_thick_brush = square_brush;
+	aa_thick_brush.set_anti_aliased(true);
+	runner.run("draw_solid_line_aa", total_line_length, [&]() {
+		for (StraightLine &line : lines)
+			image.draw_solid_line(line, aa_brush);
+	});
+	runner.run("draw_solid_line_aa_thick", total_line_length, [&]() {
+		for (StraightLine &line : lines)
+			image.draw_solid_line(line, aa_thick_brush);
+	});
+	runner.run("draw_thick_dot_square", DOT_COUNT, [&]() {
+		for (std::pair<int, int> &c : pixel_coords)
+			image.draw_thick_dot(c.first, c.second, square_brush);
+	});
+	runner.run("draw_thick_dot_round", DOT_COUNT, [&]() {
+		for (std::pair<int, int> &c : pixel_coords)
+			image.draw_thick_dot(c.first, c.second, round_brush);
+	});
+	Circumference circular_frame{Vect2{0, 0}, 700};
+	runner.run("draw_dotted_circle", circular_frame.get_circumference(), [&]() { image.draw_dotted_circle(circular_frame, round_brush); });
+	runner.run("draw_solid_circle", circular_frame.get_circumference(), [&]() { image.draw_solid_circle(circular_frame, regular_brush); });
+	runner.run("draw_dotted_line", total_line_length, [&]() {
+		for (StraightLine &line : lines)
+			image.draw_dotted_line(line, regular_brush);
+	});
+	runner.run("draw_single_pixel", DOT_COUNT, [&]() {
+		for (std::pair<int, int> &c : pixel_coords)
+			image.draw_single_pixel(c.first, c.second, regular_brush);
+	});
+
+	std::string text = "obj_renderer_bench.obj\nfaces: " + std::to_string(obj.count_total_faces()) + " / vertices: " + std::to_string(obj.count_total_vertices());
+	runner.run("draw_text", (double)text.size(), [&]() {
+		image.draw_text(76, 950, text, 20, regular_brush);
+	});
+	runner.run(
+		"clear", (double)image.get_width() * image.get_height(),
+		[&]() { image.mark_all_dirty(); },
+		[&]() { image.clear(); });
+
+	// ------ Whole frames ------ //
+	runner.run(
+		"draw_obj", (double)edges.size(),
+		[&]() { image.clear(); },
+		[&]() { image.draw_obj(obj, 33.0, regular_brush, square_brush); });
+
+	// Edges in the order left by clear_edge_pool (by length) instead of along the Morton curve of order_edges_spatially()
+	ObjReader length_order_obj = obj;
+	length_order_obj.clear_edge_pool();
+	runner.run(
+		"draw_obj_length_order", (double)edges.size(),
+		[&]() { image.clear(); },
+		[&]() { image.draw_obj(length_order_obj, 33.0, regular_brush, square_brush); });
+	printf("[INFO] Tile changes between consecutive edges: %i in Morton order, %i in length order (of %i edges)\n",
+		   count_tile_changes(image, obj.get_edge_pool()), count_tile_changes(image, length_order_obj.get_edge_pool()), (int)length_order_obj.get_edge_pool().size());
+
+	// Edges as 16-bit positions and indices (ObjReader::compact), dequantized in the vertex stage
+	ObjReader compact_obj = obj;
+	compact_obj.compact();
+	runner.run(
+		"draw_obj_compact", (double)edges.size(),
+		[&]() { image.clear(); },
+		[&]() { image.draw_obj(compact_obj, 33.0, regular_brush, square_brush); });
+	printf("[INFO] Edge data read per frame: %.1f bytes per edge full precision, %.1f bytes per edge compact (%i-bit indices)\n", (double)sizeof(Edge),
+		   (double)compact_obj.get_compact_mesh().estimate_memory_bytes() / compact_obj.count_total_edges(), compact_obj.get_compact_mesh().get_index_bits());
+
+	// Translucent thick edges: every pixel is blended once per draw call, however many samples of the brush cover it
+	BasicBrush translucent_brush{BasicColor{0.4, 0.28, 0.02, 0.5}, 4, BasicBrush::SQUARE_TIP_SHAPE};
+	runner.run(
+		"draw_obj_translucent", (double)edges.size(),
+		[&]() { image.clear(); },
+		[&]() { image.draw_obj(obj, 33.0, translucent_brush, square_brush); });
+
+	ObjReader feature_obj = obj;
+	feature_obj.build_edge_adjacency(30.0);
+	runner.run(
+		"draw_obj_features", (double)edges.size(),
+		[&]() { image.clear(); },
+		[&]() { image.draw_obj_features(feature_obj, 33.0, regular_brush, square_brush); });
+
+	BasicImage layer = BasicImage::HD_1080();
+	for (StraightLine &line : lines)
+		layer.draw_solid_line(line, regular_brush);
+	image.clear();
+	runner.run(
+		"copy_from_incremental", (double)image.get_width() * image.get_height(),
+		[&]() { image.draw_obj(obj, 33.0, regular_brush, square_brush); },
+		[&]() { image.copy_from(layer); });
+
+	image.clear();
+	image.draw_obj(obj, 33.0, regular_brush, square_brush);
+	image.draw_text(76, 950, text, 20, regular_brush);
+	BasicImage preview = BasicImage::HD_720();
+	runner.run("downsample_1080_to_720", (double)image.get_width() * image.get_height(), [&]() {
+		preview.downsample_from(image);
+	});
+	runner.run("png_encode", (double)image.get_width() * image.get_height(), [&]() {
+		int png_length = 0;
+		unsigned char *png = stbi_write_png_to_mem(image.get_pixels(), image.get_stride(),
+												   image.get_width(), image.get_height(), image.get_channels(), &png_length);
+		STBIW_FREE(png);
+	});
+	ColorPalette palette;
+	std::vector<BasicColor> palette_colors{retro_yellow};
+	palette.add_brush_blends(palette_colors);
+	ByteBuffer indices((size_t)image.get_width() * image.get_height());
+	runner.run("png_encode_indexed", (double)image.get_width() * image.get_height(), [&]() {
+		for (int y = 0; y < image.get_height(); y++)
+			palette.map_row(image.get_pixels() + (size_t)y * image.get_stride(), image.get_width(), indices.data() + (size_t)y * image.get_width());
+		ByteBuffer png = encode_indexed_png(indices, image.get_width(), image.get_height(), palette.get_colors());
+	});
+
+	// ------ Output ------ //
+	runner.to_json(json_path, mesh_description);
+	printf("[INFO] Results written to %s\n", json_path.c_str());
+	if (!baseline_path.empty())
+		runner.compare_with(baseline_path);
+
+	std::filesystem::remove(obj_path);
+	return 0;
+}
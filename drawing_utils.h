@@ -8,7 +8,15 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
@@ -16,6 +24,8 @@
 #include "basic_color.h"
 #include "basic_math.h"
 #include "basic_obj_reader.h"
+#include "frame_buffer.h"
+#include "profiling.h"
 #include "shapes_2D.h"
 #include "shapes_3D.h"
 #include "text_sprites.h"
@@ -27,13 +37,14 @@ private:
 	BasicColor color;
 	int tip_width;
 	std::string tip_shape;
+	bool anti_aliased;
 
 public:
 	// Constructors
-	BasicBrush() : color(BasicColor::White), tip_width(1), tip_shape(BasicBrush::ROUND_TIP_SHAPE) {}
-	BasicBrush(BasicColor initial_color) : color(initial_color), tip_width(1), tip_shape(BasicBrush::ROUND_TIP_SHAPE) {}
-	BasicBrush(BasicColor initial_color, int initial_thickness) : color(initial_color), tip_width(initial_thickness), tip_shape(BasicBrush::ROUND_TIP_SHAPE) {}
-	BasicBrush(BasicColor initial_color, int initial_thickness, std::string initial_tip_shape) : color(initial_color), tip_width(initial_thickness), tip_shape(initial_tip_shape) {}
+	BasicBrush() : color(BasicColor::White), tip_width(1), tip_shape(BasicBrush::ROUND_TIP_SHAPE), anti_aliased(false) {}
+	BasicBrush(BasicColor initial_color) : color(initial_color), tip_width(1), tip_shape(BasicBrush::ROUND_TIP_SHAPE), anti_aliased(false) {}
+	BasicBrush(BasicColor initial_color, int initial_thickness) : color(initial_color), tip_width(initial_thickness), tip_shape(BasicBrush::ROUND_TIP_SHAPE), anti_aliased(false) {}
+	BasicBrush(BasicColor initial_color, int initial_thickness, std::string initial_tip_shape) : color(initial_color), tip_width(initial_thickness), tip_shape(initial_tip_shape), anti_aliased(false) {}
 
 	// Predefined tips (widths and shapes)
 	static const int SLIM_TIP_WIDTH;
@@ -45,15 +56,66 @@ public:
 	BasicColor get_color() { return this->color; }
 	int get_tip_width() { return this->tip_width; }
 	std::string get_tip_shape() { return this->tip_shape; }
+	bool is_anti_aliased() { return this->anti_aliased; }
 
 	// Set
 	void set_color(BasicColor new_color) { this->color = new_color; }
+	void set_anti_aliased(bool new_anti_aliased) { this->anti_aliased = new_anti_aliased; } // Solid lines are drawn with analytic coverage
 };
 const int BasicBrush::SLIM_TIP_WIDTH = 1;
 const int BasicBrush::THICK_TIP_WIDTH = 4;
 const std::string BasicBrush::SQUARE_TIP_SHAPE = "SQUARE";
 const std::string BasicBrush::ROUND_TIP_SHAPE = "ROUND";
 
+// --------- DASH PATTERN --------- //
+class DashPattern
+{
+private:
+	std::vector<int> runs; // Lengths in pixels along the path, alternating on and off (starting with on)
+	int period;
+
+public:
+	// Constructors
+	DashPattern() : runs{1}, period(1) {} // Solid
+	DashPattern(std::vector<int> input_runs) : runs(input_runs), period(0)
+	{
+		for (int &run : this->runs)
+			this->period += (run = std::max(run, 0));
+		if (this->period == 0)
+		{
+			this->runs = {1};
+			this->period = 1;
+		}
+	}
+
+	// Predefined patterns
+	static DashPattern solid() { return DashPattern{}; }
+	static DashPattern dotted(int spacing) { return DashPattern{{1, spacing - 1}}; } // One pixel every spacing pixels
+
+	// Get
+	int get_period() { return this->period; }
+
+	// Utility
+	template <class Drawing>
+	void for_each_on_step(long long first_step, long long last_step, Drawing drawing)
+	{
+		// Calls drawing(step) for the steps from the start of the path, in [first_step, last_step], where the pattern is on.
+		// Off runs are skipped whole
+		for (long long period_start = first_step - first_step % period; period_start <= last_step; period_start += period)
+		{
+			long long run_start = period_start;
+			for (size_t i = 0; i < runs.size(); run_start += runs[i], i += 2)
+			{
+				long long run_end = std::min(run_start + runs[i] - 1, last_step);
+				for (long long step = std::max(run_start, first_step); step <= run_end; step++)
+					drawing(step);
+				if (i + 1 < runs.size())
+					run_start += runs[i + 1];
+			}
+		}
+	}
+};
+
 // --------- BASIC IMAGE --------- //
 class BasicImage
 {
@@ -61,130 +123,202 @@ private:
 	// Image main properties
 	int width, height;
 	int channels;
+	int stride; // Bytes per row, padded so that every row starts 64-byte aligned
 	unsigned char *pixels;
 	int max_index;
 
+	// Storage (empty when drawing onto external pixels)
+	PixelBuffer buffer;
+	FrameBufferPool *pool;
+	std::unique_ptr<SparseTiles> sparse_tiles; // Only for sparse images, which have no pixels
+
+	// Dirty tiles: epoch in which each tile was last drawn onto (0 for untouched tiles)
+	int tiles_x, tiles_y;
+	std::vector<int> tile_epochs;
+	int current_epoch;
+	long long modification_count;
+
+	// Pixels covered by the current draw call, blended once with its color when the call ends (see with_coverage_mask)
+	CoverageMask coverage_mask;
+	int coverage_depth; // Nested draw calls
+	BasicColor coverage_color;
+
+	// Result of blending the coverage color over each value of a channel (kept while the color does not change)
+	unsigned char blend_tables[4][256];
+	BasicColor blend_tables_color;
+	bool has_blend_tables, is_blend_constant;
+
+	// Layer this image was last copied from (see copy_from)
+	BasicImage *copied_layer;
+	long long copied_layer_modification;
+	int copy_epoch;
+
 	// Drawing coeficients
-	const double SOLID_LINE_FACTOR = 0.5;
-	const double DOTTED_LINE_FACTOR = 8.0;
-	const double SOLID_CIRCUMF_FACTOR = 0.5;
-	const double DOTTED_CIRCUMF_FACTOR = 3200;
+	static constexpr double SOLID_LINE_FACTOR = 0.5;
+	static const int DOT_SPACING = 8; // Pixels from one dot to the next, in dotted lines and circles
+
+	// Round tips up to this half width have their pixels computed only once
+	static const int MAX_CACHED_ROUND_TIP = 32;
+	struct PixelOffset
+	{
+		int x, y;
+	};
+
+	static constexpr double LINE_INCREMENT_COEF = 1.2;
+
+	// Anti-aliasing (fixed point coords and 8-bit coverage)
+	static const int AA_FRACTION_BITS = 16;
+	static const int AA_ONE = 1 << AA_FRACTION_BITS;
+	static const int MAX_WU_SPAN = 256; // Columns of a non-steep anti-aliased line blended in one span
+
+	// Brush color ready for coverage blending, in 0-255
+	struct CoverageColor
+	{
+		int r, g, b, a;
+	};
 
-	const double LINE_INCREMENT_COEF = 1.2;
+	// Source pixels under each pixel of one axis when downsampling, and their share of it (flat, kept while the sizes do not change)
+	struct AreaWeights
+	{
+		int source_size = 0, size = 0;
+		int taps = 0;				// Source pixels under every pixel, when they all have the same number (2 at 2:1 and 3:2, 3 at 3:1), 0 otherwise
+		std::vector<int> firsts;	// First source pixel under each pixel
+		std::vector<int> offsets;	// Weights of pixel i are weights[offsets[i]] to weights[offsets[i + 1] - 1]
+		std::vector<float> weights;
+	};
+	AreaWeights column_weights, row_weights;
 
 	// OBJ drawing properties
 	double z_offset, projection_distance, obj_drawing_scale;
 
+	// Share of a contact sheet cell taken by the OBJ (room left for the label and tilted views)
+	static constexpr double CELL_FILL = 0.8;
+
+	// Work units of the vertex stage (a sub-mesh, or part of a big one)
+	static constexpr size_t MAX_UNIT_EDGES = 16384;
+	static const size_t MIN_PARALLEL_EDGES = 32768;
+	struct EdgeRange
+	{
+		size_t first_edge, edge_count;
+	};
+
 public:
+	// Size of the tiles in which drawing is tracked
+	static constexpr int TILE_SIZE = 64;
+
 	// Constructors
-	BasicImage(int input_width, int input_height, int input_channels) : width(input_width), height(input_height), channels(input_channels), max_index(input_width * input_height * input_channels)
+	BasicImage(int input_width, int input_height, int input_channels) : BasicImage(input_width, input_height, input_channels, FrameBufferPool::shared()) {}
+	BasicImage(int input_width, int input_height, int input_channels, FrameBufferPool &input_pool) : width(input_width), height(input_height), channels(input_channels), pool(&input_pool)
+	{
+		this->stride = (int)PixelBuffer::aligned_stride((size_t)input_width * input_channels);
+		this->max_index = this->stride * input_height;
+		this->buffer = input_pool.acquire((size_t)this->max_index); // Pool buffers are already zeroed
+		this->pixels = this->buffer.get_data();
+		init_tiles();
+	}
+	BasicImage(unsigned char *input_pixels, int input_width, int input_height, int input_channels) : width(input_width), height(input_height), channels(input_channels), stride(input_width * input_channels), pixels(input_pixels),
+																									 max_index(input_width * input_height * input_channels), pool(nullptr)
 	{
-		this->pixels = new unsigned char[max_index];
-		this->clear();
+		init_tiles();
+		mark_all_dirty(); // Unknown contents
+	}
+	static BasicImage sparse(int input_width, int input_height, int input_channels)
+	{
+		// Tiles are only allocated when first drawn onto, for sizes whose full buffer would not fit in memory.
+		// Sparse images can only be drawn onto and written with write_sparse_png
+		BasicImage image{nullptr, input_width, input_height, input_channels};
+		image.max_index = 0;
+		image.sparse_tiles = std::make_unique<SparseTiles>(input_width, input_height, input_channels, TILE_SIZE);
+		std::fill(image.tile_epochs.begin(), image.tile_epochs.end(), 0);
+		return image;
+	}
+	BasicImage(const BasicImage &) = delete;
+	BasicImage(BasicImage &&other) noexcept : pool(nullptr) { take_from(other); }
+	~BasicImage() { release_storage(); }
+
+	// Operators
+	BasicImage &operator=(const BasicImage &) = delete;
+	BasicImage &operator=(BasicImage &&other) noexcept
+	{
+		if (this != &other)
+		{
+			release_storage(); // Hands the current buffer back to its pool
+			take_from(other);
+		}
+		return *this;
 	}
-	BasicImage(unsigned char *input_pixels, int input_width, int input_height, int input_channels) : pixels(input_pixels), width(input_width), height(input_height), channels(input_channels), max_index(input_width * input_height * input_channels) {}
 
 	// Predefided resolutions
 	static BasicImage HD_720();
 	static BasicImage HD_1080();
 	static BasicImage UHD_4K();
+	static bool is_preset(std::string name) { return name == "720" || name == "1080" || name == "4k"; }
+	static BasicImage from_preset(std::string name); // "720", "1080" or "4k"
+	static void get_preset_size(std::string name, int &width, int &height, int &channels);
 
 	// Get
 	int get_width() { return width; }
 	int get_height() { return height; }
 	int get_channels() { return channels; }
+	int get_stride() { return stride; }
 	unsigned char *get_pixels() { return this->pixels; }
+	bool is_sparse() { return (bool)this->sparse_tiles; }
+	SparseTiles *get_sparse_tiles() { return this->sparse_tiles.get(); }
 
 	double get_line_increment_coef() { return this->LINE_INCREMENT_COEF; }
 
 	// Drawing 2D
 	void draw_point(Vect2 pos, BasicBrush brush)
 	{
-		double x = pos.get_x();
-		double y = pos.get_y();
-
-		int xi, yi;
-		transform_to_image_cords(x, y, xi, yi);
-
-		if (brush.get_tip_width() > 1)
-			draw_thick_dot(xi, yi, brush);
-		else
-			draw_single_pixel(xi, yi, brush);
+		with_geometry([&](auto geometry) { draw_point(geometry, pos, brush); });
 	}
 	void draw_solid_line(StraightLine line, BasicBrush brush)
 	{
-		double line_len = line.get_length();
-		double solid_step = SOLID_LINE_FACTOR / line_len;
-
-		for (double t = 0.0; t < 1.0; t += solid_step)
-		{
-			Vect2 pixel_pos = line.get_coord_from_t(t);
-			draw_point(pixel_pos, brush);
-		}
+		with_coverage_mask(brush, [&]() { with_geometry([&](auto geometry) { draw_solid_line(geometry, line, brush); }); });
 	}
-	void draw_dotted_line(StraightLine line, BasicBrush brush)
+	void draw_anti_aliased_line(StraightLine line, BasicBrush brush)
 	{
-		double line_len = line.get_length();
-		double dotted_step = DOTTED_LINE_FACTOR / line_len;
-
-		for (double t = 0.0; t < 1.0; t += dotted_step)
-		{
-			Vect2 pixel_pos = line.get_coord_from_t(t);
-			draw_point(pixel_pos, brush);
-		}
+		with_geometry([&](auto geometry) { draw_anti_aliased_line(geometry, line, brush); });
 	}
-	void draw_solid_circle(Circumference circumf, BasicBrush brush)
+	void draw_dotted_line(StraightLine line, BasicBrush brush) { draw_dashed_line(line, DashPattern::dotted(DOT_SPACING), brush); }
+	void draw_dashed_line(StraightLine line, DashPattern pattern, BasicBrush brush)
 	{
-		double circumf_length = circumf.get_circumference();
-		double solid_step = SOLID_CIRCUMF_FACTOR / circumf_length;
-
-		for (double th = 0.0; th < 360.0; th += solid_step)
-		{
-			Vect2 pixel_pos = circumf.get_coord_from_theta(th);
-			draw_point(pixel_pos, brush);
-		}
+		with_coverage_mask(brush, [&]() { with_geometry([&](auto geometry) { draw_dashed_line(geometry, line, pattern, brush); }); });
 	}
-	void draw_dotted_circle(Circumference circumf, BasicBrush brush)
+	void draw_solid_circle(Circumference circumf, BasicBrush brush) { draw_dashed_circle(circumf, DashPattern::solid(), brush); }
+	void draw_dotted_circle(Circumference circumf, BasicBrush brush) { draw_dashed_circle(circumf, DashPattern::dotted(DOT_SPACING), brush); }
+	void draw_dashed_circle(Circumference circumf, DashPattern pattern, BasicBrush brush)
 	{
-		double circumf_length = circumf.get_circumference();
-		double dotted_step = DOTTED_CIRCUMF_FACTOR / circumf_length;
-
-		for (double th = 0.0f; th < 360.0f; th += dotted_step)
-		{
-			Vect2 pixel_pos = circumf.get_coord_from_theta(th);
-			draw_point(pixel_pos, brush);
-		}
+		with_coverage_mask(brush, [&]() { with_geometry([&](auto geometry) { draw_dashed_arc(geometry, circumf, 0.0, 360.0, pattern, brush); }); });
+	}
+	void draw_arc(Circumference circumf, double start_angle, double end_angle, BasicBrush brush) { draw_dashed_arc(circumf, start_angle, end_angle, DashPattern::solid(), brush); }
+	void draw_dashed_arc(Circumference circumf, double start_angle, double end_angle, DashPattern pattern, BasicBrush brush)
+	{
+		// From the start to the end angle, in degrees increasing as in Circumference::get_coord_from_theta
+		with_coverage_mask(brush, [&]() { with_geometry([&](auto geometry) { draw_dashed_arc(geometry, circumf, start_angle, end_angle, pattern, brush); }); });
 	}
 	void draw_polygon(Polygon poly, BasicBrush brush)
 	{
-		for (int i = 1; i < poly.count_vertices(); i++)
-		{
-			StraightLine line{poly[i - 1], poly[i]};
-			draw_solid_line(line, brush);
-		}
-		StraightLine line_closure{poly[poly.count_vertices() - 1], poly[0]};
-		draw_solid_line(line_closure, brush);
+		with_coverage_mask(brush, [&]() {
+			for (int i = 1; i < poly.count_vertices(); i++)
+			{
+				StraightLine line{poly[i - 1], poly[i]};
+				draw_solid_line(line, brush);
+			}
+			StraightLine line_closure{poly[poly.count_vertices() - 1], poly[0]};
+			draw_solid_line(line_closure, brush);
+		});
 	}
 
 	// Drawing 3D
 	void draw_edge(Edge e, BasicBrush brush)
 	{
-		Vect3 v1 = e.get_origin();
-		double z1 = abs(v1.get_z() - this->z_offset);
-		double x1_flat = (this->projection_distance / z1) * v1.get_x() * this->obj_drawing_scale;
-		double y1_flat = (this->projection_distance / z1) * v1.get_y() * this->obj_drawing_scale;
-
-		Vect3 v2 = e.get_end();
-		double z2 = abs(v2.get_z() - this->z_offset);
-		double x2_flat = (this->projection_distance / z2) * v2.get_x() * this->obj_drawing_scale;
-		double y2_flat = (this->projection_distance / z2) * v2.get_y() * this->obj_drawing_scale;
-
-		draw_solid_line(StraightLine{x1_flat, y1_flat, x2_flat, y2_flat}, brush);
+		draw_solid_line(project_edge(e), brush);
+		PROFILE_COUNT(EDGES_DRAWN, 1);
 	}
 	void draw_face(Face f, BasicBrush brush)
 	{
-		for (Vect3 v : f.get_vertices())
-		{
+		with_coverage_mask(brush, [&]() {
 			for (int i = 1; i < f.count_vertices(); i++)
 			{
 				Edge e{f[i - 1], f[i]};
@@ -192,10 +326,21 @@ public:
 			}
 			Edge e_closure{f[f.count_vertices() - 1], f[0]};
 			draw_edge(e_closure, brush);
-		}
+		});
+	}
+	void estimate_obj_drawing_params(ObjReader &obj)
+	{
+		get_obj_drawing_params(obj, this->width, this->height, this->z_offset, this->projection_distance, this->obj_drawing_scale);
+
+		printf("[INFO] The parameters used for drawing the OBJ file are:\n"
+			   "       - Z Offset: %f\n"
+			   "       - Projection distance: %f\n"
+			   "       - Drawing scale: %f\n",
+			   this->z_offset, this->projection_distance, this->obj_drawing_scale);
 	}
-	void estimate_obj_drawing_params(ObjReader obj)
+	static void get_obj_drawing_params(ObjReader &obj, int target_width, int target_height, double &z_offset, double &projection_distance, double &drawing_scale_out)
 	{
+		// Camera distance and scale that fit the bounding box of the OBJ in target_width x target_height at every angle of a turntable
 		Vect3 tl = obj.get_bb().get_top_left();
 		Vect3 br = obj.get_bb().get_bottom_right();
 
@@ -224,20 +369,20 @@ public:
 								  3.0;
 		double proj_distance = max_displacement * 1.5;
 
-		double tl_scale_x = (this->width * 0.5 * 0.92) / ((proj_distance / (tl.get_z() - max_displacement)) * tl.get_x());
-		double tl_scale_y = (this->height * 0.5 * 0.92) / ((proj_distance / (tl.get_z() - max_displacement)) * tl.get_y());
-		double br_scale_x = (this->width * 0.5 * 0.92) / ((proj_distance / (br.get_z() - max_displacement)) * br.get_x());
-		double br_scale_y = (this->height * 0.5 * 0.92) / ((proj_distance / (br.get_z() - max_displacement)) * br.get_y());
+		double tl_scale_x = (target_width * 0.5 * 0.92) / ((proj_distance / (tl.get_z() - max_displacement)) * tl.get_x());
+		double tl_scale_y = (target_height * 0.5 * 0.92) / ((proj_distance / (tl.get_z() - max_displacement)) * tl.get_y());
+		double br_scale_x = (target_width * 0.5 * 0.92) / ((proj_distance / (br.get_z() - max_displacement)) * br.get_x());
+		double br_scale_y = (target_height * 0.5 * 0.92) / ((proj_distance / (br.get_z() - max_displacement)) * br.get_y());
 
-		double tl_45_scale_x = (this->width * 0.5 * 0.92) / ((proj_distance / (tl_45.get_z() - max_displacement)) * tl_45.get_x());
-		double tl_45_scale_y = (this->height * 0.5 * 0.92) / ((proj_distance / (tl_45.get_z() - max_displacement)) * tl_45.get_y());
-		double br_45_scale_x = (this->width * 0.5 * 0.92) / ((proj_distance / (br_45.get_z() - max_displacement)) * br_45.get_x());
-		double br_45_scale_y = (this->height * 0.5 * 0.92) / ((proj_distance / (br_45.get_z() - max_displacement)) * br_45.get_y());
+		double tl_45_scale_x = (target_width * 0.5 * 0.92) / ((proj_distance / (tl_45.get_z() - max_displacement)) * tl_45.get_x());
+		double tl_45_scale_y = (target_height * 0.5 * 0.92) / ((proj_distance / (tl_45.get_z() - max_displacement)) * tl_45.get_y());
+		double br_45_scale_x = (target_width * 0.5 * 0.92) / ((proj_distance / (br_45.get_z() - max_displacement)) * br_45.get_x());
+		double br_45_scale_y = (target_height * 0.5 * 0.92) / ((proj_distance / (br_45.get_z() - max_displacement)) * br_45.get_y());
 
-		double tl_90_scale_x = (this->width * 0.5 * 0.92) / ((proj_distance / (tl_90.get_z() - max_displacement)) * tl_90.get_x());
-		double tl_90_scale_y = (this->height * 0.5 * 0.92) / ((proj_distance / (tl_90.get_z() - max_displacement)) * tl_90.get_y());
-		double br_90_scale_x = (this->width * 0.5 * 0.92) / ((proj_distance / (br_90.get_z() - max_displacement)) * br_90.get_x());
-		double br_90_scale_y = (this->height * 0.5 * 0.92) / ((proj_distance / (br_90.get_z() - max_displacement)) * br_90.get_y());
+		double tl_90_scale_x = (target_width * 0.5 * 0.92) / ((proj_distance / (tl_90.get_z() - max_displacement)) * tl_90.get_x());
+		double tl_90_scale_y = (target_height * 0.5 * 0.92) / ((proj_distance / (tl_90.get_z() - max_displacement)) * tl_90.get_y());
+		double br_90_scale_x = (target_width * 0.5 * 0.92) / ((proj_distance / (br_90.get_z() - max_displacement)) * br_90.get_x());
+		double br_90_scale_y = (target_height * 0.5 * 0.92) / ((proj_distance / (br_90.get_z() - max_displacement)) * br_90.get_y());
 
 		double drawing_scale = std::min({abs(tl_scale_x), abs(tl_scale_y),
 										 abs(br_scale_x), abs(br_scale_y),
@@ -246,23 +391,177 @@ public:
 										 abs(tl_90_scale_x), abs(tl_90_scale_y),
 										 abs(br_90_scale_x), abs(br_90_scale_y)});
 
-		this->z_offset = max_displacement;
-		this->projection_distance = proj_distance;
-		this->obj_drawing_scale = drawing_scale;
+		z_offset = max_displacement;
+		projection_distance = proj_distance;
+		drawing_scale_out = drawing_scale;
+	}
+	void draw_obj(ObjReader &obj, double rot_angle, BasicBrush faces_brush, BasicBrush bb_brush)
+	{
+		Matrix3by3 rotation_matrix = Matrix3by3::RotationMatrix(rot_angle, Vect3::YAxis);
+		std::vector<Edge> &edges = obj.get_edge_pool();
 
-		printf("[INFO] The parameters used for drawing the OBJ file are:\n"
-			   "       - Z Offset: %f\n"
-			   "       - Projection distance: %f\n"
-			   "       - Drawing scale: %f\n",
-			   this->z_offset, this->projection_distance, this->obj_drawing_scale);
+		// Sub-meshes out of the image or behind the camera are skipped whole, the rest split in units of similar size
+		std::vector<EdgeRange> units;
+		size_t unit_edges = 0;
+		for (SubMesh &sub_mesh : obj.get_sub_meshes())
+		{
+			if (is_out_of_view(sub_mesh.bounding_box, rotation_matrix, faces_brush.get_tip_width() + 2))
+			{
+				PROFILE_COUNT(SUB_MESHES_CULLED, 1);
+				continue;
+			}
+			for (size_t first = 0; first < sub_mesh.edge_count; first += MAX_UNIT_EDGES)
+				units.push_back(EdgeRange{sub_mesh.first_edge + first, std::min(MAX_UNIT_EDGES, sub_mesh.edge_count - first)});
+			unit_edges += sub_mesh.edge_count;
+		}
+
+		// Vertex stage (units are independent, so big meshes rotate and project them in parallel).
+		// Compact meshes are dequantized by the transform itself: rotation * (low + step * q) = (rotation * step) * q + rotation * low
+		CompactMesh &compact_mesh = obj.get_compact_mesh();
+		Vect3 step = compact_mesh.get_step();
+		Matrix3by3 dequantize_matrix = mult_matrices(rotation_matrix, Matrix3by3{step.get_x(), 0.0, 0.0, 0.0, step.get_y(), 0.0, 0.0, 0.0, step.get_z()});
+		Vect3 dequantize_offset = mult_matrix_by_vector3(rotation_matrix, compact_mesh.get_low());
+		bool compact = obj.is_compact();
+
+		std::vector<std::vector<StraightLine>> unit_lines(units.size());
+		std::atomic<size_t> next_unit{0};
+		auto project_units = [&]() {
+			for (size_t u = next_unit++; u < units.size(); u = next_unit++)
+			{
+				unit_lines[u].reserve(units[u].edge_count);
+				for (size_t i = units[u].first_edge; i < units[u].first_edge + units[u].edge_count; i++)
+				{
+					if (compact)
+					{
+						Vect3 origin = mult_matrix_by_vector3(dequantize_matrix, compact_mesh.get_quantized_vertex(compact_mesh.get_origin_index(i))) + dequantize_offset;
+						Vect3 end = mult_matrix_by_vector3(dequantize_matrix, compact_mesh.get_quantized_vertex(compact_mesh.get_end_index(i))) + dequantize_offset;
+						unit_lines[u].push_back(project_segment(origin, end, this->obj_drawing_scale));
+						continue;
+					}
+					Edge e = edges[i];
+					e.rotate_around_axis(rotation_matrix);
+					unit_lines[u].push_back(project_edge(e));
+				}
+			}
+		};
+		size_t workers = unit_edges >= MIN_PARALLEL_EDGES ? std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), units.size()) : 1;
+		std::vector<std::future<void>> projections;
+		for (size_t w = 1; w < workers; w++)
+			projections.push_back(std::async(std::launch::async, project_units));
+		project_units();
+		for (std::future<void> &projection : projections)
+			projection.get();
+
+		// Raster stage (in the order of the units, so frames do not depend on the number of threads), as one draw call
+		with_coverage_mask(faces_brush, [&]() {
+			for (std::vector<StraightLine> &lines : unit_lines)
+			{
+				for (StraightLine &line : lines)
+					draw_solid_line(line, faces_brush);
+				PROFILE_COUNT(EDGES_DRAWN, (long long)lines.size());
+			}
+		});
+
+		for (Face f : obj.get_bb().get_faces())
+		{
+			f.rotate_around_axis(rot_angle, Vect3::YAxis);
+			draw_face(f, bb_brush);
+		}
 	}
-	void draw_obj(ObjReader obj, double rot_angle, BasicBrush faces_brush, BasicBrush bb_brush)
+	void draw_obj_views(ObjReader &obj, std::vector<Matrix3by3> &view_matrices, int columns, BasicBrush faces_brush, BasicBrush bb_brush)
 	{
-		for (Edge e : obj.get_edge_pool())
+		// Every view in its own cell of a grid (row by row), each cell clipped to itself
+		size_t view_count = view_matrices.size();
+		int rows = ((int)view_count + columns - 1) / columns;
+		int cell_width = this->width / columns;
+		int cell_height = this->height / rows;
+		double cell_z_offset, cell_projection_distance, cell_scale;
+		get_obj_drawing_params(obj, cell_width, cell_height, cell_z_offset, cell_projection_distance, cell_scale);
+		cell_scale *= CELL_FILL;
+
+		// Vertex stage: the mesh is read once, and every vertex transformed for all views with the coefficients of all matrices side by side
+		std::vector<double> coefs;
+		for (Matrix3by3 &m : view_matrices)
+		{
+			for (Vect3 row : {m.row_0(), m.row_1(), m.row_2()})
+				coefs.insert(coefs.end(), {row.get_x(), row.get_y(), row.get_z()});
+		}
+		std::vector<Vect3> origins(view_count), ends(view_count);
+		auto transform = [&](Vect3 v, std::vector<Vect3> &out) {
+			double x = v.get_x(), y = v.get_y(), z = v.get_z();
+			const double *c = coefs.data();
+			for (size_t i = 0; i < view_count; i++, c += 9)
+				out[i] = Vect3{c[0] * x + c[1] * y + c[2] * z, c[3] * x + c[4] * y + c[5] * z, c[6] * x + c[7] * y + c[8] * z};
+		};
+
+		std::vector<Edge> bb_edges;
+		for (Face f : obj.get_bb().get_faces())
+		{
+			for (int i = 0; i < f.count_vertices(); i++)
+				bb_edges.push_back(Edge{f[i], f[(i + 1) % f.count_vertices()]});
+		}
+		std::vector<std::vector<StraightLine>> view_lines(view_count);
+		size_t edge_count = obj.count_total_edges();
+		for (size_t e = 0; e < edge_count + bb_edges.size(); e++)
 		{
-			e.rotate_around_axis(rot_angle, Vect3::YAxis);
-			draw_edge(e, faces_brush);
+			Edge edge = e < edge_count ? obj.get_edge(e) : bb_edges[e - edge_count];
+			transform(edge.get_origin(), origins);
+			transform(edge.get_end(), ends);
+			for (size_t v = 0; v < view_count; v++)
+				view_lines[v].push_back(project_segment(origins[v], ends[v], cell_scale));
 		}
+
+		// Raster stage, one cell after another (the bounding box edges are the last ones of every view, and resolve the mesh edges of their view)
+		with_coverage_mask(faces_brush, [&]() {
+			for (size_t v = 0; v < view_count; v++)
+			{
+				double left = (double)((int)v % columns * cell_width - this->width / 2);
+				double top = (double)((int)v / columns * cell_height - this->height / 2);
+				double center_x = left + cell_width / 2;
+				double center_y = top + cell_height / 2;
+				for (size_t i = 0; i < view_lines[v].size(); i++)
+				{
+					BasicBrush &brush = i < edge_count ? faces_brush : bb_brush;
+					double margin = brush.get_tip_width() + 1.0;
+					double x1 = view_lines[v][i].get_origin().get_x() + center_x, y1 = view_lines[v][i].get_origin().get_y() + center_y;
+					double x2 = view_lines[v][i].get_end().get_x() + center_x, y2 = view_lines[v][i].get_end().get_y() + center_y;
+					if (clip_segment_to_rect(x1, y1, x2, y2, left + margin, top + margin, left + cell_width - 1 - margin, top + cell_height - 1 - margin))
+						draw_solid_line(StraightLine{x1, y1, x2, y2}, brush);
+				}
+				PROFILE_COUNT(EDGES_DRAWN, (long long)view_lines[v].size());
+			}
+		});
+	}
+	void draw_obj_features(ObjReader &obj, double rot_angle, BasicBrush faces_brush, BasicBrush bb_brush)
+	{
+		// Boundary and crease edges always, smooth edges only between a face towards the camera and one away from it
+		Matrix3by3 rotation_matrix = Matrix3by3::RotationMatrix(rot_angle, Vect3::YAxis);
+		Vect3 camera = mult_matrix_by_vector3(Matrix3by3::RotationMatrix(-rot_angle, Vect3::YAxis), Vect3{0.0, 0.0, this->z_offset}); // In OBJ space
+
+		std::vector<Vect3> &normals = obj.get_face_normals();
+		std::vector<Vect3> &origins = obj.get_face_origins();
+		std::vector<char> towards_camera(normals.size());
+		for (size_t i = 0; i < normals.size(); i++)
+			towards_camera[i] = dot_prod(normals[i], camera + origins[i].get_inverted()) > 0.0;
+
+		with_coverage_mask(faces_brush, [&]() {
+			for (Edge e : obj.get_feature_edges())
+			{
+				e.rotate_around_axis(rotation_matrix);
+				draw_edge(e, faces_brush);
+			}
+			std::vector<Edge> &smooth_edges = obj.get_smooth_edges();
+			std::vector<std::pair<int, int>> &smooth_edge_faces = obj.get_smooth_edge_faces();
+			for (size_t i = 0; i < smooth_edges.size(); i++)
+			{
+				if (towards_camera[smooth_edge_faces[i].first] == towards_camera[smooth_edge_faces[i].second])
+					continue;
+				Edge e = smooth_edges[i];
+				e.rotate_around_axis(rotation_matrix);
+				draw_edge(e, faces_brush);
+			}
+		});
+
 		for (Face f : obj.get_bb().get_faces())
 		{
 			f.rotate_around_axis(rot_angle, Vect3::YAxis);
@@ -270,6 +569,63 @@ public:
 		}
 	}
 
+	// Projection
+	StraightLine project_edge(Edge e) { return project_segment(e.get_origin(), e.get_end(), this->obj_drawing_scale); }
+	StraightLine project_segment(Vect3 v1, Vect3 v2, double drawing_scale)
+	{
+		double z1 = abs(v1.get_z() - this->z_offset);
+		double x1_flat = (this->projection_distance / z1) * v1.get_x() * drawing_scale;
+		double y1_flat = (this->projection_distance / z1) * v1.get_y() * drawing_scale;
+
+		double z2 = abs(v2.get_z() - this->z_offset);
+		double x2_flat = (this->projection_distance / z2) * v2.get_x() * drawing_scale;
+		double y2_flat = (this->projection_distance / z2) * v2.get_y() * drawing_scale;
+
+		return StraightLine{x1_flat, y1_flat, x2_flat, y2_flat};
+	}
+	double get_max_pixels_per_unit(BoundingBox &box)
+	{
+		// Magnification at the nearest depth any corner of the box reaches while turning around Y
+		Vect3 tl = box.get_top_left();
+		Vect3 br = box.get_bottom_right();
+		double radius = sqrt(std::max(tl.get_x() * tl.get_x(), br.get_x() * br.get_x()) + std::max(tl.get_z() * tl.get_z(), br.get_z() * br.get_z()));
+		return (this->projection_distance / (this->z_offset - radius)) * this->obj_drawing_scale;
+	}
+	bool is_out_of_view(BoundingBox &box, Matrix3by3 &rotation_matrix, int margin)
+	{
+		// The drawing of a box fully in front of the camera lies inside the rectangle of its projected corners
+		Vect3 tl = box.get_top_left();
+		Vect3 br = box.get_bottom_right();
+		double min_x = std::numeric_limits<double>::max(), min_y = min_x;
+		double max_x = -min_x, max_y = -min_x;
+		int corners_behind = 0;
+		for (int corner = 0; corner < 8; corner++)
+		{
+			Vect3 v{(corner & 1) ? br.get_x() : tl.get_x(), (corner & 2) ? br.get_y() : tl.get_y(), (corner & 4) ? br.get_z() : tl.get_z()};
+			v = mult_matrix_by_vector3(rotation_matrix, v);
+			double depth = this->z_offset - v.get_z();
+			if (depth <= 0.0)
+			{
+				corners_behind++;
+				continue;
+			}
+			double x_flat = (this->projection_distance / depth) * v.get_x() * this->obj_drawing_scale;
+			double y_flat = (this->projection_distance / depth) * v.get_y() * this->obj_drawing_scale;
+			min_x = std::min(min_x, x_flat);
+			max_x = std::max(max_x, x_flat);
+			min_y = std::min(min_y, y_flat);
+			max_y = std::max(max_y, y_flat);
+		}
+		if (corners_behind == 8)
+			return true; // Behind the near plane
+		if (corners_behind > 0)
+			return false; // Crosses it, so its projection is not bounded by the corners
+
+		double half_width = this->width * 0.5 + margin;
+		double half_height = this->height * 0.5 + margin;
+		return max_x < -half_width || min_x > half_width || max_y < -half_height || min_y > half_height;
+	}
+
 	// Transformations to image coords
 	void transform_to_image_cords(double x, double y, int &xi, int &yi)
 	{
@@ -281,72 +637,51 @@ public:
 	}
 	int get_index_from_coords(int xi, int yi)
 	{
-		int index_count = ((yi + 1) * width - (width - xi)) * channels;
+		int index_count = yi * stride + xi * channels;
 		return index_count;
 	}
 
 	// Drawing in image coords
 	void draw_single_pixel(int xi, int yi, BasicBrush brush)
 	{
-		const bool IS_DEBUGGING = false;
-		int index_pos = get_index_from_coords(xi, yi);
-
-		if (index_pos < 0 || index_pos >= max_index || xi < 0 || xi > width - 1 || yi < 0 || yi > height - 1)
-		{
-			if (IS_DEBUGGING)
-				printf("[DEBUG] Coordinates are not valid for drawing! [%i,%i]\n", xi, yi);
-			return;
-		}
-
-		BasicColor brush_color = brush.get_color();
-		BasicColor pixel_color = get_color_at(xi, yi);
-		BasicColor blend_color = blend_two_colors(brush_color, BasicColor::over_ID, pixel_color); // TODO have brushes carry blendmode
-
-		pixels[index_pos++] = blend_color.r255();
-		pixels[index_pos++] = blend_color.g255();
-		pixels[index_pos++] = blend_color.b255();
-		if (channels == 4)
-			pixels[index_pos++] = blend_color.a255();
+		with_geometry([&](auto geometry) { draw_single_pixel(geometry, xi, yi, brush); });
+	}
+	void draw_coverage_pixel(int xi, int yi, int coverage, CoverageColor color)
+	{
+		with_geometry([&](auto geometry) { draw_coverage_pixel(geometry, xi, yi, coverage, color); });
+	}
+	void draw_coverage_span(int xi, int yi, int count, const unsigned char *coverage, CoverageColor color)
+	{
+		with_geometry([&](auto geometry) { draw_coverage_span(geometry, xi, yi, count, coverage, color); });
+	}
+	void draw_wu_line(double x1, double y1, double x2, double y2, BasicBrush brush)
+	{
+		with_geometry([&](auto geometry) { draw_wu_line(geometry, x1, y1, x2, y2, brush); });
+	}
+	void draw_coverage_line(double x1, double y1, double x2, double y2, BasicBrush brush)
+	{
+		with_geometry([&](auto geometry) { draw_coverage_line(geometry, x1, y1, x2, y2, brush); });
 	}
 	void draw_thick_dot(int xi, int yi, BasicBrush brush)
 	{
-		int half_tip = (int)(brush.get_tip_width() / 2.0);
-
-		if (brush.get_tip_shape() == BasicBrush::SQUARE_TIP_SHAPE)
-		{
-			for (int x = -half_tip; x < half_tip + 1; x++)
-			{
-				for (int y = -half_tip; y < half_tip + 1; y++)
+		with_geometry([&](auto geometry) { draw_thick_dot(geometry, xi, yi, brush); });
+	}
+	void draw_frame(int xi1, int yi1, int xi2, int yi2, BasicBrush brush)
+	{
+		with_coverage_mask(brush, [&]() {
+			with_geometry([&](auto geometry) {
+				for (int x = xi1; x < xi2 + 1; x++)
 				{
-					draw_single_pixel(x + xi, y + yi, brush);
+					draw_single_pixel(geometry, x, yi1, brush);
+					draw_single_pixel(geometry, x, yi2, brush);
 				}
-			}
-		}
-		else if (brush.get_tip_shape() == BasicBrush::ROUND_TIP_SHAPE)
-		{
-			for (int i = 0; i < half_tip + 1; i++)
-			{
-				for (double th = 0.0; th < 360.0; th += 1.0)
+				for (int y = yi1; y < yi2 + 1; y++)
 				{
-					int p_x = (int)(i * (rad_cos(th)));
-					int p_y = (int)(i * (rad_sin(th)));
-					draw_single_pixel(p_x + xi, p_y + yi, brush);
+					draw_single_pixel(geometry, xi1, y, brush);
+					draw_single_pixel(geometry, xi2, y, brush);
 				}
-			}
-		}
-	}
-	void draw_frame(int xi1, int yi1, int xi2, int yi2, BasicBrush brush)
-	{
-		for (int x = xi1; x < xi2 + 1; x++)
-		{
-			draw_single_pixel(x, yi1, brush);
-			draw_single_pixel(x, yi2, brush);
-		}
-		for (int y = yi1; y < yi2 + 1; y++)
-		{
-			draw_single_pixel(xi1, y, brush);
-			draw_single_pixel(xi2, y, brush);
-		}
+			});
+		});
 	}
 	void draw_text(int upper_left_x, int upper_left_y, std::string text, int text_height, BasicBrush brush)
 	{
@@ -380,56 +715,58 @@ public:
 			spr_side = 20;
 			s_pixels = s_20_20;
 		}
+		int glyph_scale = get_glyph_size(text_height) / spr_side; // Sprite pixels drawn as squares this wide
 		int line_increment = (int)(LINE_INCREMENT_COEF * text_height);
 
 		// Text writing
 		int image_x = upper_left_x;
 		int image_y = upper_left_y;
 
-		for (char ch : text)
-		{
-			if (ch == '\n')
-			{
-				image_x = upper_left_x;
-				image_y = upper_left_y + line_increment;
-				continue;
-			}
-
-			int c = (int)ch;
-			int sprite_row = c / SPR_COLUMNS == 0 ? 0 : c / SPR_COLUMNS - 2;
-			int sprite_column = c % SPR_COLUMNS;
-
-			int sprite_x = sprite_column * spr_side;
-			int sprite_y = sprite_row * spr_side;
-
-			for (int j = 0; j < spr_side; j++)
-			{
-				for (int i = 0; i < spr_side; i++)
+		with_coverage_mask(brush, [&]() {
+			with_geometry([&](auto geometry) {
+				for (char ch : text)
 				{
-					int s_index = ((sprite_y + 1) * spr_width - (spr_width - sprite_x)) * SPR_CHANNELS;
-
-					if (s_pixels[s_index] != 0)
+					if (ch == '\n')
 					{
-						draw_single_pixel(image_x, image_y, brush);
+						image_x = upper_left_x;
+						image_y = upper_left_y + line_increment;
+						continue;
 					}
 
-					sprite_x++;
-					image_x++;
-				}
+					int c = (int)ch;
+					int sprite_row = c / SPR_COLUMNS == 0 ? 0 : c / SPR_COLUMNS - 2;
+					int sprite_column = c % SPR_COLUMNS;
 
-				sprite_x -= spr_side;
-				image_x -= spr_side;
+					int sprite_x = sprite_column * spr_side;
+					int sprite_y = sprite_row * spr_side;
 
-				sprite_y++;
-				image_y++;
-			}
+					for (int j = 0; j < spr_side; j++)
+					{
+						for (int i = 0; i < spr_side; i++)
+						{
+							int s_index = ((sprite_y + j) * spr_width + sprite_x + i) * SPR_CHANNELS;
+							if (s_pixels[s_index] == 0)
+								continue;
 
-			image_x += spr_side;
-			image_y -= spr_side;
-		}
+							for (int dy = 0; dy < glyph_scale; dy++)
+								for (int dx = 0; dx < glyph_scale; dx++)
+									draw_single_pixel(geometry, image_x + i * glyph_scale + dx, image_y + j * glyph_scale + dy, brush);
+						}
+					}
+
+					image_x += spr_side * glyph_scale;
+				}
+			});
+		});
 	}
 
 	// Get
+	static int get_glyph_size(int text_height)
+	{
+		// Side in pixels of the characters of draw_text: the biggest sprite (10 to 25 pixels) not above the height, magnified in whole steps
+		int spr_side = text_height < 15 ? 10 : (text_height < 20 ? 15 : (text_height < 25 ? 20 : 25));
+		return spr_side * std::max(1, text_height / spr_side);
+	}
 	BasicColor get_color_at(int xi, int yi)
 	{
 		int idx = get_index_from_coords(xi, yi);
@@ -451,19 +788,1040 @@ public:
 	// Utility
 	void clear()
 	{
-		for (int i = 0; i < width * height * channels; ++i)
+		// Only the dirty tiles are zeroed, a whole run of consecutive dirty tiles per row at once
+		if (sparse_tiles)
+			sparse_tiles->release_all();
+		else
+			for (PixelRect &rect : get_dirty_rects())
+				fill_rect(rect, nullptr, 0);
+
+		std::fill(tile_epochs.begin(), tile_epochs.end(), 0);
+		coverage_mask.clear();
+		current_epoch = 1;
+		modification_count++;
+		copied_layer = nullptr;
+	}
+	void mark_all_dirty()
+	{
+		// To be called after writing to get_pixels() directly
+		std::fill(tile_epochs.begin(), tile_epochs.end(), current_epoch);
+		modification_count++;
+	}
+	int next_epoch()
+	{
+		// Tiles drawn onto from now on can be told apart from the ones drawn before
+		return ++current_epoch;
+	}
+	int get_epoch() { return this->current_epoch; }
+	bool is_tile_dirty(int tx, int ty, int since_epoch = 1) { return tile_epochs[ty * tiles_x + tx] >= since_epoch; }
+	int count_tiles_x() { return this->tiles_x; }
+	int count_tiles_y() { return this->tiles_y; }
+	PixelRect get_tile_rect(int tx, int ty)
+	{
+		return PixelRect{tx * TILE_SIZE, ty * TILE_SIZE, std::min((tx + 1) * TILE_SIZE, width), std::min((ty + 1) * TILE_SIZE, height)};
+	}
+	std::vector<PixelRect> get_dirty_rects(int since_epoch = 1)
+	{
+		// One rect per run of consecutive dirty tiles in a row of tiles
+		std::vector<PixelRect> rects;
+		for (int ty = 0; ty < tiles_y; ty++)
 		{
-			pixels[i] = 0;
+			int tx = 0;
+			while (tx < tiles_x)
+			{
+				if (!is_tile_dirty(tx, ty, since_epoch))
+				{
+					tx++;
+					continue;
+				}
+				int run_start = tx;
+				while (tx < tiles_x && is_tile_dirty(tx, ty, since_epoch))
+					tx++;
+
+				PixelRect first = get_tile_rect(run_start, ty);
+				PixelRect last = get_tile_rect(tx - 1, ty);
+				rects.push_back(PixelRect{first.x0, first.y0, last.x1, last.y1});
+			}
 		}
+		return rects;
+	}
+	PixelRect get_dirty_bounds(int since_epoch = 1)
+	{
+		PixelRect bounds;
+		for (PixelRect &rect : get_dirty_rects(since_epoch))
+			bounds.expand(rect);
+		return bounds;
 	}
 
-	// Write to file
-	void to_file(std::string filename_string)
+	// Compositing
+	void copy_from(BasicImage &layer)
 	{
-		const char *filename = (filename_string + ".png").c_str();
-		stbi_write_png(filename, width, height, channels, pixels, width * channels);
+		// Makes this image equal to the layer. When the previous copy was from the same, untouched layer,
+		// only the tiles drawn onto since then are restored
+		if (layer.width != width || layer.height != height || layer.channels != channels)
+		{
+			std::cerr << "[ERROR] Layers can only be copied between images of the same size!" << std::endl;
+			return;
+		}
+		if (sparse_tiles || layer.sparse_tiles)
+		{
+			std::cerr << "[ERROR] Layers can not be copied to or from sparse images!" << std::endl;
+			return;
+		}
+
+		bool incremental = copied_layer == &layer && copied_layer_modification == layer.modification_count;
+		int new_copy_epoch = next_epoch();
+		for (int ty = 0; ty < tiles_y; ty++)
+		{
+			for (int tx = 0; tx < tiles_x; tx++)
+			{
+				int &epoch = tile_epochs[ty * tiles_x + tx];
+				bool layer_dirty = layer.is_tile_dirty(tx, ty);
+				bool needs_copy = incremental ? epoch > copy_epoch : (epoch > 0 || layer_dirty);
+				if (needs_copy)
+					fill_rect(get_tile_rect(tx, ty), layer_dirty ? &layer : nullptr, 0);
+
+				epoch = layer_dirty ? new_copy_epoch : 0;
+			}
+		}
+
+		copied_layer = &layer;
+		copied_layer_modification = layer.modification_count;
+		copy_epoch = new_copy_epoch;
+		modification_count++;
+		next_epoch(); // Drawing after the copy stamps tiles newer than copy_epoch
 	}
-};
-BasicImage BasicImage::HD_720() { return BasicImage{1280, 720, 4}; }
-BasicImage BasicImage::HD_1080() { return BasicImage{1920, 1080, 4}; }
-BasicImage BasicImage::UHD_4K() { return BasicImage{3840, 2160, 4}; }
+	void downsample_from(BasicImage &source) { downsample_from(source, PixelRect{0, 0, source.width, source.height}); }
+	void downsample_from(BasicImage &source, PixelRect source_rect)
+	{
+		// Area-averaged resampling of the source rect onto the matching part of this (smaller) image.
+		// Colors are averaged weighted by their alpha, so edges against transparent pixels do not darken
+		if (source.width < width || source.height < height || source.channels != channels)
+		{
+			std::cerr << "[ERROR] Images can only be downsampled from bigger images with the same channels!" << std::endl;
+			return;
+		}
+		if (sparse_tiles || source.sparse_tiles)
+		{
+			std::cerr << "[ERROR] Sparse images can not be downsampled!" << std::endl;
+			return;
+		}
+		if (source_rect.is_empty())
+			return;
+
+		double scale_x = (double)source.width / width;
+		double scale_y = (double)source.height / height;
+		PixelRect rect{(int)std::floor(source_rect.x0 / scale_x), (int)std::floor(source_rect.y0 / scale_y),
+					   std::min((int)std::ceil(source_rect.x1 / scale_x), width), std::min((int)std::ceil(source_rect.y1 / scale_y), height)};
+
+		// Source columns and rows that fall into each pixel, and their share of it
+		update_area_weights(column_weights, source.width, width);
+		update_area_weights(row_weights, source.height, height);
+
+		std::vector<float> row_sums((size_t)rect.get_width() * 4);
+		for (int y = rect.y0; y < rect.y1; y++)
+		{
+			std::fill(row_sums.begin(), row_sums.end(), 0.0f);
+			for (int r = row_weights.offsets[y]; r < row_weights.offsets[y + 1]; r++)
+			{
+				unsigned char *source_row = source.pixels + (size_t)(row_weights.firsts[y] + r - row_weights.offsets[y]) * source.stride;
+				float row_weight = row_weights.weights[r];
+#ifdef OBJ_RENDERER_HAS_SSE2
+				if (channels == 4)
+				{
+					if (column_weights.taps == 2)
+						accumulate_downsample_row<2>(source_row, row_weight, rect.x0, rect.get_width(), row_sums.data());
+					else if (column_weights.taps == 3)
+						accumulate_downsample_row<3>(source_row, row_weight, rect.x0, rect.get_width(), row_sums.data());
+					else
+						accumulate_downsample_row<0>(source_row, row_weight, rect.x0, rect.get_width(), row_sums.data());
+					continue;
+				}
+#endif
+				for (int i = 0; i < rect.get_width(); i++)
+				{
+					float *sum = &row_sums[(size_t)i * 4];
+					int x = rect.x0 + i;
+					unsigned char *source_pixel = source_row + (size_t)column_weights.firsts[x] * channels;
+					for (int c = column_weights.offsets[x]; c < column_weights.offsets[x + 1]; c++, source_pixel += channels)
+					{
+						float alpha = channels == 4 ? source_pixel[3] : 255.0f;
+						float weight = column_weights.weights[c] * row_weight * alpha;
+						sum[0] += source_pixel[0] * weight;
+						sum[1] += source_pixel[1] * weight;
+						sum[2] += source_pixel[2] * weight;
+						sum[3] += weight;
+					}
+				}
+			}
+
+			unsigned char *pixel = pixels + get_index_from_coords(rect.x0, y);
+#ifdef OBJ_RENDERER_HAS_SSE2
+			if (channels == 4)
+			{
+				write_downsample_row(row_sums.data(), rect.get_width(), pixel);
+				continue;
+			}
+#endif
+			for (int i = 0; i < rect.get_width(); i++, pixel += channels)
+			{
+				float *sum = &row_sums[(size_t)i * 4];
+				float inverse_alpha = sum[3] > 0.0f ? 1.0f / sum[3] : 0.0f;
+				pixel[0] = (unsigned char)std::min(sum[0] * inverse_alpha + 0.5f, 255.0f);
+				pixel[1] = (unsigned char)std::min(sum[1] * inverse_alpha + 0.5f, 255.0f);
+				pixel[2] = (unsigned char)std::min(sum[2] * inverse_alpha + 0.5f, 255.0f);
+				if (channels == 4)
+					pixel[3] = (unsigned char)std::min(sum[3] + 0.5f, 255.0f);
+			}
+		}
+
+		mark_rect_dirty(rect);
+	}
+	BasicImage *get_copied_layer() { return this->copied_layer; }
+	long long get_copied_layer_modification() { return this->copied_layer_modification; }
+	PixelRect get_bounds_over_layer()
+	{
+		// Region drawn onto since the last copy_from (the whole dirty region if there was none)
+		return get_dirty_bounds(copied_layer ? copy_epoch + 1 : 1);
+	}
+
+	// Write to file
+	void to_file(std::string filename_string)
+	{
+		std::string filename = filename_string + ".png";
+		if (sparse_tiles)
+		{
+			std::cerr << "[ERROR] Sparse images are written with write_sparse_png!" << std::endl;
+			return;
+		}
+		stbi_write_png(filename.c_str(), width, height, channels, pixels, stride);
+	}
+
+private:
+	void init_tiles()
+	{
+		this->tiles_x = (this->width + TILE_SIZE - 1) / TILE_SIZE;
+		this->tiles_y = (this->height + TILE_SIZE - 1) / TILE_SIZE;
+		this->tile_epochs.assign((size_t)tiles_x * tiles_y, 0);
+		this->current_epoch = 1;
+		this->modification_count = 0;
+		this->copied_layer = nullptr;
+		this->copied_layer_modification = -1;
+		this->copy_epoch = 0;
+		this->coverage_mask.resize(this->width, this->height);
+		this->coverage_depth = 0;
+		this->has_blend_tables = false;
+		this->is_blend_constant = false;
+		this->z_offset = 0.0;
+		this->projection_distance = 0.0;
+		this->obj_drawing_scale = 0.0;
+	}
+	template <class Geometry>
+	bool has_geometry()
+	{
+		return width == Geometry::width && height == Geometry::height && channels == Geometry::channels && stride == Geometry::stride;
+	}
+	template <class Drawing>
+	void with_geometry(Drawing drawing)
+	{
+		// The preset resolutions get their own instance of the drawing routines, with constant sizes. Any other size uses the runtime one
+		if (sparse_tiles)
+			drawing(SparseGeometry{width, height, channels, sparse_tiles.get()});
+		else if (has_geometry<HD1080Geometry>())
+			drawing(HD1080Geometry{});
+		else if (has_geometry<UHD4KGeometry>())
+			drawing(UHD4KGeometry{});
+		else if (has_geometry<HD720Geometry>())
+			drawing(HD720Geometry{});
+		else
+			drawing(RuntimeGeometry{width, height, channels, stride});
+	}
+	template <class Drawing>
+	void with_coverage_mask(BasicBrush &brush, Drawing drawing)
+	{
+		// One draw call: its pixels are only marked while rasterizing, and blended once with the brush when the outermost call ends,
+		// however many samples land on them. A nested call with another color resolves what was marked before it, keeping the order
+		BasicColor color = brush.get_color();
+		BasicColor outer_color = this->coverage_color;
+		bool switches_color = this->coverage_depth > 0 && !is_same_color(color, outer_color);
+		if (switches_color)
+			with_geometry([&](auto geometry) { resolve_coverage(geometry); });
+
+		this->coverage_color = color;
+		this->coverage_depth++;
+		drawing();
+		this->coverage_depth--;
+
+		if (this->coverage_depth == 0 || switches_color)
+		{
+			with_geometry([&](auto geometry) { resolve_coverage(geometry); });
+			this->coverage_color = outer_color;
+		}
+	}
+	template <class Geometry>
+	void resolve_coverage(Geometry geometry)
+	{
+		// The blend of a channel only depends on its current value, so it is looked up in tables (see build_blend_tables).
+		// With an opaque color every table is that color, which is stored 4 pixels at a time
+		if (coverage_mask.is_empty())
+			return;
+
+		build_blend_tables(geometry.channels);
+
+#ifdef OBJ_RENDERER_HAS_SSE2
+		const bool USE_SIMD = geometry.channels == 4;
+		uint32_t color_word;
+		unsigned char color_bytes[4] = {blend_tables[0][0], blend_tables[1][0], blend_tables[2][0], blend_tables[3][0]};
+		std::memcpy(&color_word, color_bytes, 4);
+		__m128i color_4 = _mm_set1_epi32((int)color_word);
+#endif
+		coverage_mask.for_each_row([&](int x0, int yi, uint64_t bits) {
+			PROFILE_COUNT(PIXELS_BLENDED, (long long)std::bitset<64>(bits).count());
+			unsigned char *row = geometry.get_pixel(pixels, x0, yi); // Contiguous for the whole tile row
+#ifdef OBJ_RENDERER_HAS_SSE2
+			if (USE_SIMD && is_blend_constant)
+			{
+				// Groups of 4 pixels fully inside the image: stored whole, or merged with the unmarked pixels of the group
+				int group_end = std::min(CoverageMask::TILE_SIZE, geometry.width - x0) / 4 * 4;
+				uint64_t group_bits = group_end < 64 ? bits & (((uint64_t)1 << group_end) - 1) : bits;
+				bits ^= group_bits;
+				while (group_bits)
+				{
+					int x = CoverageMask::lowest_bit(group_bits) & ~3;
+					int group = (int)(group_bits >> x) & 15;
+					group_bits &= ~((uint64_t)15 << x);
+					__m128i *target = (__m128i *)(row + x * 4);
+					if (group == 15)
+					{
+						_mm_storeu_si128(target, color_4);
+						continue;
+					}
+					__m128i mask = _mm_setr_epi32(group & 1 ? -1 : 0, group & 2 ? -1 : 0, group & 4 ? -1 : 0, group & 8 ? -1 : 0);
+					_mm_storeu_si128(target, _mm_or_si128(_mm_and_si128(mask, color_4), _mm_andnot_si128(mask, _mm_loadu_si128(target))));
+				}
+			}
+#endif
+			// The rest of the pixels, one channel at a time
+			for (; bits; bits &= bits - 1)
+			{
+				unsigned char *pixel = row + CoverageMask::lowest_bit(bits) * geometry.channels;
+				for (int c = 0; c < geometry.channels; c++)
+					pixel[c] = blend_tables[c][pixel[c]];
+			}
+		});
+		coverage_mask.clear();
+	}
+	static bool is_same_color(BasicColor &a, BasicColor &b)
+	{
+		return a.get_r() == b.get_r() && a.get_g() == b.get_g() && a.get_b() == b.get_b() && a.get_a() == b.get_a();
+	}
+	void build_blend_tables(int channel_count)
+	{
+		BasicColor &color = this->coverage_color;
+		if (has_blend_tables && is_same_color(color, blend_tables_color))
+			return;
+
+		for (int value = 0; value < 256; value++)
+		{
+			BasicColor pixel_color{(double)value, (double)value, (double)value, (double)value}; // As read by draw_single_pixel
+			BasicColor blend_color = blend_two_colors(color, BasicColor::over_ID, pixel_color);
+			blend_tables[0][value] = blend_color.r255();
+			blend_tables[1][value] = blend_color.g255();
+			blend_tables[2][value] = blend_color.b255();
+			blend_tables[3][value] = blend_color.a255();
+		}
+		is_blend_constant = true;
+		for (int c = 0; c < channel_count; c++)
+			is_blend_constant = is_blend_constant && std::count(blend_tables[c], blend_tables[c] + 256, blend_tables[c][0]) == 256;
+		blend_tables_color = color;
+		has_blend_tables = true;
+	}
+
+	// Drawing in image coords, for one framebuffer geometry (see with_geometry)
+	template <class Geometry>
+	void draw_point(Geometry geometry, Vect2 pos, BasicBrush &brush)
+	{
+		int xi = static_cast<int>(std::floor(pos.get_x())) + geometry.width / 2;
+		int yi = static_cast<int>(std::floor(pos.get_y())) + geometry.height / 2;
+		draw_tip(geometry, xi, yi, brush);
+	}
+	template <class Geometry>
+	void draw_tip(Geometry geometry, int xi, int yi, BasicBrush &brush)
+	{
+		if (brush.get_tip_width() > 1)
+			draw_thick_dot(geometry, xi, yi, brush);
+		else
+			draw_single_pixel(geometry, xi, yi, brush);
+	}
+	template <class Geometry>
+	void draw_dashed_line(Geometry geometry, StraightLine &line, DashPattern &pattern, BasicBrush &brush)
+	{
+		// One pixel per step along the major axis (integer DDA, rounding the minor axis), counting the steps for the pattern.
+		// Steps whose pixels are off the image along the major axis are skipped without being walked
+		int x0 = static_cast<int>(std::floor(line.get_origin().get_x())) + geometry.width / 2;
+		int y0 = static_cast<int>(std::floor(line.get_origin().get_y())) + geometry.height / 2;
+		int x1 = static_cast<int>(std::floor(line.get_end().get_x())) + geometry.width / 2;
+		int y1 = static_cast<int>(std::floor(line.get_end().get_y())) + geometry.height / 2;
+
+		bool x_major = std::abs(x1 - x0) >= std::abs(y1 - y0);
+		long long major_length = x_major ? std::abs(x1 - x0) : std::abs(y1 - y0);
+		long long minor_length = x_major ? std::abs(y1 - y0) : std::abs(x1 - x0);
+		int major_start = x_major ? x0 : y0, minor_start = x_major ? y0 : x0;
+		int major_sign = (x_major ? x1 - x0 : y1 - y0) < 0 ? -1 : 1;
+		int minor_sign = (x_major ? y1 - y0 : x1 - x0) < 0 ? -1 : 1;
+
+		// ------ Steps inside the image (plus the tip) along the major axis ------ //
+		int margin = brush.get_tip_width() / 2 + 1;
+		long long major_size = x_major ? geometry.width : geometry.height;
+		long long first_step = major_sign > 0 ? -margin - major_start : major_start - (major_size - 1 + margin);
+		long long last_step = major_sign > 0 ? major_size - 1 + margin - major_start : major_start + margin;
+		first_step = std::max(first_step, 0LL);
+		last_step = std::min(last_step, major_length);
+
+		pattern.for_each_on_step(first_step, last_step, [&](long long step) {
+			int major = major_start + major_sign * (int)step;
+			int minor = minor_start + minor_sign * (int)(major_length ? (2 * step * minor_length + major_length) / (2 * major_length) : 0);
+			draw_tip(geometry, x_major ? major : minor, x_major ? minor : major, brush);
+		});
+	}
+	template <class Geometry>
+	void draw_dashed_arc(Geometry geometry, Circumference &circumf, double start_angle, double end_angle, DashPattern &pattern, BasicBrush &brush)
+	{
+		// Midpoint circle: one octant in integers, mirrored to the other seven and walked by increasing angle (the pattern counts
+		// the pixels along the way). Arcs keep the pixels between the start and end directions, told apart with cross products
+		int radius = (int)std::lround(circumf.get_radius());
+		int center_x = static_cast<int>(std::floor(circumf.get_center().get_x())) + geometry.width / 2;
+		int center_y = static_cast<int>(std::floor(circumf.get_center().get_y())) + geometry.height / 2;
+		if (radius <= 0)
+		{
+			draw_tip(geometry, center_x, center_y, brush);
+			return;
+		}
+
+		// ------ Octant from the x axis to the diagonal (x is the short coord) ------ //
+		std::vector<PixelOffset> octant;
+		for (int x = 0, y = radius, decision = 1 - radius; x <= y; x++)
+		{
+			octant.push_back(PixelOffset{x, y});
+			if (decision < 0)
+				decision += 2 * x + 3;
+			else
+				decision += 2 * (x - --y) + 3;
+		}
+
+		// ------ Whole circle, each pixel once: even octants skip the diagonal, odd ones the axis ------ //
+		static const int MIRRORS[8][4] = {{0, 1, 1, 0}, {1, 0, 0, 1}, {-1, 0, 0, 1}, {0, -1, 1, 0}, {0, -1, -1, 0}, {-1, 0, 0, -1}, {1, 0, 0, -1}, {0, 1, -1, 0}};
+		bool ends_on_diagonal = octant.back().x == octant.back().y;
+		int octant_size = (int)octant.size();
+		std::vector<PixelOffset> path;
+		path.reserve((size_t)octant_size * 8);
+		for (int o = 0; o < 8; o++)
+		{
+			const int *m = MIRRORS[o];
+			int first = o % 2 == 0 ? 0 : octant_size - 1;
+			int last = o % 2 == 0 ? octant_size - (ends_on_diagonal ? 2 : 1) : 1;
+			int direction = o % 2 == 0 ? 1 : -1;
+			for (int i = first; direction * (last - i) >= 0; i += direction)
+				path.push_back(PixelOffset{m[0] * octant[i].x + m[1] * octant[i].y, m[2] * octant[i].x + m[3] * octant[i].y});
+		}
+
+		// ------ Arc (the pattern starts at its first pixel) ------ //
+		double sweep = std::fmod(end_angle - start_angle, 360.0);
+		if (sweep <= 0.0)
+			sweep += 360.0;
+		bool full_circle = sweep >= 360.0;
+		double start_x = rad_cos(start_angle), start_y = rad_sin(start_angle);
+		double end_x = rad_cos(end_angle), end_y = rad_sin(end_angle);
+		auto is_in_arc = [&](PixelOffset p) {
+			if (full_circle)
+				return true;
+			double after_start = start_x * p.y - start_y * p.x;
+			double before_end = p.x * end_y - p.y * end_x;
+			return sweep <= 180.0 ? after_start >= 0.0 && before_end >= 0.0 : after_start >= 0.0 || before_end >= 0.0;
+		};
+
+		size_t path_size = path.size();
+		size_t arc_start = 0, arc_size = path_size;
+		if (!full_circle)
+		{
+			while (arc_start < path_size && !(is_in_arc(path[arc_start]) && !is_in_arc(path[(arc_start + path_size - 1) % path_size])))
+				arc_start++;
+			if (arc_start == path_size)
+				return; // Too short to have a pixel
+			arc_size = 0;
+			while (arc_size < path_size && is_in_arc(path[(arc_start + arc_size) % path_size]))
+				arc_size++;
+		}
+
+		pattern.for_each_on_step(0, (long long)arc_size - 1, [&](long long step) {
+			PixelOffset p = path[(arc_start + step) % path_size];
+			draw_tip(geometry, center_x + p.x, center_y + p.y, brush);
+		});
+	}
+	template <class Geometry>
+	void draw_solid_line(Geometry geometry, StraightLine line, BasicBrush &brush)
+	{
+		if (brush.is_anti_aliased())
+		{
+			draw_anti_aliased_line(geometry, line, brush);
+			return;
+		}
+
+		double line_len = line.get_length();
+		double solid_step = SOLID_LINE_FACTOR / line_len;
+
+		for (double t = 0.0; t < 1.0; t += solid_step)
+		{
+			Vect2 pixel_pos = line.get_coord_from_t(t);
+			draw_point(geometry, pixel_pos, brush);
+		}
+	}
+	template <class Geometry>
+	void draw_anti_aliased_line(Geometry geometry, StraightLine line, BasicBrush &brush)
+	{
+		// Line coords to image coords, with the center of the pixels at integer coords
+		double x1 = line.get_origin().get_x() + (geometry.width / 2) - 0.5;
+		double y1 = line.get_origin().get_y() + (geometry.height / 2) - 0.5;
+		double x2 = line.get_end().get_x() + (geometry.width / 2) - 0.5;
+		double y2 = line.get_end().get_y() + (geometry.height / 2) - 0.5;
+
+		if (brush.get_tip_width() > 1)
+			draw_coverage_line(geometry, x1, y1, x2, y2, brush);
+		else
+			draw_wu_line(geometry, x1, y1, x2, y2, brush);
+	}
+	template <class Geometry>
+	void draw_single_pixel(Geometry geometry, int xi, int yi, BasicBrush &brush)
+	{
+		const bool IS_DEBUGGING = false;
+
+		if (xi < 0 || xi > geometry.width - 1 || yi < 0 || yi > geometry.height - 1)
+		{
+			if (IS_DEBUGGING)
+				printf("[DEBUG] Coordinates are not valid for drawing! [%i,%i]\n", xi, yi);
+			PROFILE_COUNT(PIXELS_CLIPPED, 1);
+			return;
+		}
+		tile_epochs[(yi / TILE_SIZE) * tiles_x + xi / TILE_SIZE] = current_epoch;
+		modification_count++;
+		if (coverage_depth > 0)
+		{
+			coverage_mask.mark(xi, yi); // Blended when the draw call is resolved
+			return;
+		}
+		PROFILE_COUNT(PIXELS_BLENDED, 1);
+
+		unsigned char *pixel = geometry.get_pixel(pixels, xi, yi);
+		BasicColor brush_color = brush.get_color();
+		BasicColor pixel_color{(double)pixel[0], (double)pixel[1], (double)pixel[2], geometry.channels == 4 ? (double)pixel[3] : 0.0};
+		BasicColor blend_color = blend_two_colors(brush_color, BasicColor::over_ID, pixel_color); // TODO have brushes carry blendmode
+
+		pixel[0] = blend_color.r255();
+		pixel[1] = blend_color.g255();
+		pixel[2] = blend_color.b255();
+		if (geometry.channels == 4)
+			pixel[3] = blend_color.a255();
+	}
+	template <class Geometry>
+	void draw_coverage_pixel(Geometry geometry, int xi, int yi, int coverage, CoverageColor color)
+	{
+		// Blends the color weighted by a coverage in 0-255 (1-pixel span)
+		unsigned char coverage_byte = (unsigned char)std::min(coverage, 255);
+		draw_coverage_span(geometry, xi, yi, 1, &coverage_byte, color);
+	}
+	template <class Geometry>
+	void draw_coverage_span(Geometry geometry, int xi, int yi, int count, const unsigned char *coverage, CoverageColor color)
+	{
+		// Blends a horizontal run of pixels, each one weighted by its coverage in 0-255 (right away, after what the draw call marked so far)
+		resolve_coverage(geometry);
+		int first = std::max(xi, 0);
+		int last = std::min(xi + count, geometry.width);
+		if (yi < 0 || yi > geometry.height - 1 || first >= last)
+		{
+			PROFILE_COUNT(PIXELS_CLIPPED, count);
+			return;
+		}
+		PROFILE_COUNT(PIXELS_CLIPPED, count - (last - first));
+		PROFILE_COUNT(PIXELS_BLENDED, last - first);
+
+		int *tile_row = &tile_epochs[(yi / TILE_SIZE) * tiles_x];
+		for (int tx = first / TILE_SIZE; tx <= (last - 1) / TILE_SIZE; tx++)
+			tile_row[tx] = current_epoch;
+		modification_count++;
+
+		// One run per stretch of contiguous pixels (the whole span unless the image is sparse)
+		coverage += first - xi;
+		for (int run_first = first; run_first < last;)
+		{
+			int run_last = std::min(last, geometry.get_row_end(run_first));
+			unsigned char *pixel = geometry.get_pixel(pixels, run_first, yi);
+			if (geometry.channels == 4)
+			{
+				int i = run_first - first;
+#ifdef OBJ_RENDERER_HAS_SSE2
+				for (; i + 4 <= run_last - first; i += 4, pixel += 16)
+					blend_coverage_4(pixel, coverage + i, color);
+#endif
+				for (; i < run_last - first; i++, pixel += 4)
+					pixel[3] = (unsigned char)blend_coverage(pixel, pixel[3], coverage[i], color);
+			}
+			else
+			{
+				for (int i = run_first - first; i < run_last - first; i++, pixel += geometry.channels)
+					blend_coverage(pixel, 255, coverage[i], color);
+			}
+			run_first = run_last;
+		}
+	}
+	template <class Geometry>
+	void draw_wu_line(Geometry geometry, double x1, double y1, double x2, double y2, BasicBrush &brush)
+	{
+		// Xiaolin Wu's line in fixed point: two pixels per step along the major axis, sharing the coverage
+		if (!clip_segment_to_rect(x1, y1, x2, y2, -2.0, -2.0, geometry.width + 1.0, geometry.height + 1.0))
+			return;
+
+		bool steep = std::abs(y2 - y1) > std::abs(x2 - x1);
+		if (steep)
+		{
+			std::swap(x1, y1);
+			std::swap(x2, y2);
+		}
+		if (x1 > x2)
+		{
+			std::swap(x1, x2);
+			std::swap(y1, y2);
+		}
+
+		CoverageColor color = get_coverage_color(brush);
+		long long dx = to_fixed(x2 - x1);
+		long long dy = to_fixed(y2 - y1);
+		long long gradient = dx == 0 ? 0 : (dy * AA_ONE) / dx;
+
+		int x_start = (int)std::floor(x1 + 0.5);
+		int x_end = (int)std::floor(x2 + 0.5);
+		long long y = to_fixed(y1) + ((gradient * to_fixed(x_start - x1)) >> AA_FRACTION_BITS);
+
+		// Columns are blended in spans: two rows (the pixel and the one below) as long as they stay the same, or one 2-pixel span
+		// per row when steep. A pixel is never in two columns, so the blending order does not change the result
+		unsigned char low_coverages[MAX_WU_SPAN], high_coverages[MAX_WU_SPAN];
+		int span_x = x_start, span_y = 0, span_count = 0;
+		auto flush_span = [&]() {
+			if (span_count == 0)
+				return;
+			draw_coverage_span(geometry, span_x, span_y, span_count, low_coverages, color);
+			draw_coverage_span(geometry, span_x, span_y + 1, span_count, high_coverages, color);
+			span_count = 0;
+		};
+
+		for (int x = x_start; x <= x_end; x++, y += gradient)
+		{
+			// Horizontal coverage of the pixel column (only partial at the ends of the line)
+			long long column_coverage = AA_ONE;
+			if (x == x_start && x == x_end)
+				column_coverage = to_fixed(x2 - x1);
+			else if (x == x_start)
+				column_coverage = to_fixed(x_start + 0.5 - x1);
+			else if (x == x_end)
+				column_coverage = to_fixed(x2 - (x_end - 0.5));
+
+			int y_int = (int)(y >> AA_FRACTION_BITS);
+			long long y_fraction = y & (AA_ONE - 1);
+			int coverage_low = (int)((column_coverage * (AA_ONE - y_fraction)) >> (2 * AA_FRACTION_BITS - 8));
+			int coverage_high = (int)((column_coverage * y_fraction) >> (2 * AA_FRACTION_BITS - 8));
+
+			if (steep)
+			{
+				unsigned char row_coverages[2] = {(unsigned char)std::min(coverage_low, 255), (unsigned char)std::min(coverage_high, 255)};
+				draw_coverage_span(geometry, y_int, x, 2, row_coverages, color);
+				continue;
+			}
+			if (span_count > 0 && (y_int != span_y || span_count == MAX_WU_SPAN))
+				flush_span();
+			if (span_count == 0)
+			{
+				span_x = x;
+				span_y = y_int;
+			}
+			low_coverages[span_count] = (unsigned char)std::min(coverage_low, 255);
+			high_coverages[span_count++] = (unsigned char)std::min(coverage_high, 255);
+		}
+		flush_span();
+	}
+	template <class Geometry>
+	void draw_coverage_line(Geometry geometry, double x1, double y1, double x2, double y2, BasicBrush &brush)
+	{
+		// Line as wide as the brush tip, with round ends. Coverage fades from 1 to 0 across the pixel on its border
+		double half_tip = brush.get_tip_width() / 2.0;
+		if (!clip_segment_to_rect(x1, y1, x2, y2, -half_tip - 2.0, -half_tip - 2.0, geometry.width + half_tip + 1.0, geometry.height + half_tip + 1.0))
+			return;
+
+		CoverageColor color = get_coverage_color(brush);
+		double dx = x2 - x1;
+		double dy = y2 - y1;
+		double length_sq = dx * dx + dy * dy;
+		double reach = half_tip + 1.0;
+
+		int y_first = std::max((int)std::floor(std::min(y1, y2) - reach), 0);
+		int y_last = std::min((int)std::ceil(std::max(y1, y2) + reach), geometry.height - 1);
+		std::vector<unsigned char> coverage;
+
+		for (int yi = y_first; yi <= y_last; yi++)
+		{
+			// Horizontal extent of the line within reach of this row
+			double x_min = std::min(x1, x2);
+			double x_max = std::max(x1, x2);
+			if (std::abs(dy) > 1e-9)
+			{
+				double t_a = std::clamp((yi - reach - y1) / dy, 0.0, 1.0);
+				double t_b = std::clamp((yi + reach - y1) / dy, 0.0, 1.0);
+				x_min = std::min(x1 + t_a * dx, x1 + t_b * dx);
+				x_max = std::max(x1 + t_a * dx, x1 + t_b * dx);
+
+				// Narrowed down to the band of the line that crosses this row (ends included)
+				double band_center = x1 + (yi - y1) * dx / dy;
+				double band_half = (half_tip + 0.5) * std::sqrt(length_sq) / std::abs(dy);
+				x_min = std::max(x_min, band_center - band_half);
+				x_max = std::min(x_max, band_center + band_half);
+			}
+			int x_first = std::max((int)std::floor(x_min - reach), 0);
+			int x_last = std::min((int)std::ceil(x_max + reach), geometry.width - 1);
+			if (x_first > x_last)
+				continue;
+
+			coverage.assign(x_last - x_first + 1, 0);
+			for (int xi = x_first; xi <= x_last; xi++)
+			{
+				double t = length_sq > 0.0 ? std::clamp(((xi - x1) * dx + (yi - y1) * dy) / length_sq, 0.0, 1.0) : 0.0;
+				double distance_x = xi - (x1 + t * dx);
+				double distance_y = yi - (y1 + t * dy);
+				double distance = std::sqrt(distance_x * distance_x + distance_y * distance_y);
+				double pixel_coverage = std::clamp(half_tip + 0.5 - distance, 0.0, 1.0);
+				coverage[xi - x_first] = (unsigned char)(pixel_coverage * 255.0 + 0.5);
+			}
+			draw_coverage_span(geometry, x_first, yi, x_last - x_first + 1, coverage.data(), color);
+		}
+	}
+	template <class Geometry>
+	void draw_thick_dot(Geometry geometry, int xi, int yi, BasicBrush &brush)
+	{
+		int half_tip = (int)(brush.get_tip_width() / 2.0);
+
+		if (brush.get_tip_shape() == BasicBrush::SQUARE_TIP_SHAPE)
+		{
+			for (int x = -half_tip; x < half_tip + 1; x++)
+			{
+				for (int y = -half_tip; y < half_tip + 1; y++)
+				{
+					draw_single_pixel(geometry, x + xi, y + yi, brush);
+				}
+			}
+		}
+		else if (brush.get_tip_shape() == BasicBrush::ROUND_TIP_SHAPE)
+		{
+			std::vector<PixelOffset> uncached_footprint;
+			const std::vector<PixelOffset> &footprint = half_tip <= MAX_CACHED_ROUND_TIP ? get_round_footprint(half_tip) : (uncached_footprint = build_round_footprint(half_tip));
+			for (const PixelOffset &offset : footprint)
+				draw_single_pixel(geometry, offset.x + xi, offset.y + yi, brush);
+		}
+	}
+	static std::vector<PixelOffset> build_round_footprint(int half_tip)
+	{
+		// Pixels of the rings of the tip sampled every degree, each one once
+		std::vector<PixelOffset> footprint;
+		std::vector<bool> is_used((size_t)(2 * half_tip + 1) * (2 * half_tip + 1), false);
+		for (int i = 0; i < half_tip + 1; i++)
+		{
+			for (double th = 0.0; th < 360.0; th += 1.0)
+			{
+				int p_x = (int)(i * (rad_cos(th)));
+				int p_y = (int)(i * (rad_sin(th)));
+				size_t used_index = (size_t)(p_y + half_tip) * (2 * half_tip + 1) + (p_x + half_tip);
+				if (!is_used[used_index])
+				{
+					is_used[used_index] = true;
+					footprint.push_back(PixelOffset{p_x, p_y});
+				}
+			}
+		}
+		return footprint;
+	}
+	static const std::vector<PixelOffset> &get_round_footprint(int half_tip)
+	{
+		static std::vector<PixelOffset> footprints[MAX_CACHED_ROUND_TIP + 1];
+		static std::once_flag footprints_built[MAX_CACHED_ROUND_TIP + 1];
+		std::call_once(footprints_built[half_tip], [&]() { footprints[half_tip] = build_round_footprint(half_tip); });
+		return footprints[half_tip];
+	}
+	static long long to_fixed(double value) { return (long long)std::llround(value * AA_ONE); }
+	CoverageColor get_coverage_color(BasicBrush brush)
+	{
+		BasicColor brush_color = brush.get_color();
+		return CoverageColor{brush_color.r255(), brush_color.g255(), brush_color.b255(), brush_color.a255()};
+	}
+	static int blend_coverage(unsigned char *pixel, int pixel_alpha, int coverage, CoverageColor color)
+	{
+		// Straight-alpha 'over' of the brush weighted by its coverage (integers only, no branches). Returns the new alpha
+		int source_alpha = (color.a * coverage + 127) / 255;
+		int source_weight = source_alpha * 255;
+		int pixel_weight = pixel_alpha * (255 - source_alpha);
+		int total_weight = source_weight + pixel_weight;
+		int rounding = total_weight / 2;
+		int divisor = std::max(total_weight, 1);
+
+		pixel[0] = (unsigned char)((color.r * source_weight + pixel[0] * pixel_weight + rounding) / divisor);
+		pixel[1] = (unsigned char)((color.g * source_weight + pixel[1] * pixel_weight + rounding) / divisor);
+		pixel[2] = (unsigned char)((color.b * source_weight + pixel[2] * pixel_weight + rounding) / divisor);
+		return (total_weight + 127) / 255;
+	}
+#ifdef OBJ_RENDERER_HAS_SSE2
+	static void blend_coverage_4(unsigned char *pixels, const unsigned char *coverage, CoverageColor color)
+	{
+		// blend_coverage on 4 RGBA pixels at once, one pixel per lane, with the exact same results. Divisions by 255 are done as
+		// (x + 1 + (x >> 8)) >> 8 (exact below 65536). Numerators stay below 2^24, so float holds them exactly, and the float
+		// quotient is corrected by one where it rounded across an integer
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i one = _mm_set1_epi32(1);
+		const __m128i byte_mask = _mm_set1_epi32(0xFF);
+		auto divide_by_255 = [&](__m128i x) { return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, one), _mm_srli_epi32(x, 8)), 8); };
+
+		__m128i pixel_words = _mm_loadu_si128((const __m128i *)pixels);
+		int coverage_word;
+		std::memcpy(&coverage_word, coverage, 4);
+		__m128i coverage_4 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(coverage_word), zero), zero);
+
+		// Products of two bytes fit the 16-bit lanes (the upper halves of the 32-bit ones are 0)
+		__m128i source_alpha = divide_by_255(_mm_add_epi32(_mm_mullo_epi16(_mm_set1_epi32(color.a), coverage_4), _mm_set1_epi32(127)));
+		__m128i source_weight = _mm_sub_epi32(_mm_slli_epi32(source_alpha, 8), source_alpha);
+		__m128i pixel_alpha = _mm_srli_epi32(pixel_words, 24);
+		__m128i pixel_weight = _mm_mullo_epi16(pixel_alpha, _mm_sub_epi32(_mm_set1_epi32(255), source_alpha));
+		__m128i total_weight = _mm_add_epi32(source_weight, pixel_weight);
+		__m128i divisor = _mm_or_si128(total_weight, _mm_and_si128(_mm_cmpeq_epi32(total_weight, zero), one));
+
+		__m128 source_weight_f = _mm_cvtepi32_ps(source_weight);
+		__m128 pixel_weight_f = _mm_cvtepi32_ps(pixel_weight);
+		__m128 rounding_f = _mm_cvtepi32_ps(_mm_srli_epi32(total_weight, 1));
+		__m128 divisor_f = _mm_cvtepi32_ps(divisor);
+		const int color_channels[3] = {color.r, color.g, color.b};
+		__m128i result = _mm_slli_epi32(divide_by_255(_mm_add_epi32(total_weight, _mm_set1_epi32(127))), 24);
+		for (int c = 0; c < 3; c++)
+		{
+			__m128 channel = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixel_words, 8 * c), byte_mask));
+			__m128 numerator = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps((float)color_channels[c]), source_weight_f), _mm_mul_ps(channel, pixel_weight_f)), rounding_f);
+			__m128 quotient = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_div_ps(numerator, divisor_f)));
+			__m128 remainder = _mm_sub_ps(numerator, _mm_mul_ps(quotient, divisor_f));
+			quotient = _mm_sub_ps(quotient, _mm_and_ps(_mm_cmplt_ps(remainder, _mm_setzero_ps()), _mm_set1_ps(1.0f)));
+			quotient = _mm_add_ps(quotient, _mm_and_ps(_mm_cmpge_ps(remainder, divisor_f), _mm_set1_ps(1.0f)));
+			result = _mm_or_si128(result, _mm_slli_epi32(_mm_cvttps_epi32(quotient), 8 * c));
+		}
+		_mm_storeu_si128((__m128i *)pixels, result);
+	}
+#endif
+	static bool clip_segment_to_rect(double &x1, double &y1, double &x2, double &y2, double x_min, double y_min, double x_max, double y_max)
+	{
+		// Liang-Barsky clipping. False when nothing is left to draw
+		double t_enter = 0.0;
+		double t_exit = 1.0;
+		double dx = x2 - x1;
+		double dy = y2 - y1;
+		double p[4] = {-dx, dx, -dy, dy};
+		double q[4] = {x1 - x_min, x_max - x1, y1 - y_min, y_max - y1};
+
+		for (int i = 0; i < 4; i++)
+		{
+			if (p[i] == 0.0)
+			{
+				if (q[i] < 0.0)
+					return false;
+				continue;
+			}
+			double t = q[i] / p[i];
+			if (p[i] < 0.0)
+				t_enter = std::max(t_enter, t);
+			else
+				t_exit = std::min(t_exit, t);
+		}
+		if (t_enter > t_exit)
+			return false;
+
+		double clipped_x1 = x1 + t_enter * dx;
+		double clipped_y1 = y1 + t_enter * dy;
+		x2 = x1 + t_exit * dx;
+		y2 = y1 + t_exit * dy;
+		x1 = clipped_x1;
+		y1 = clipped_y1;
+		return true;
+	}
+	static void update_area_weights(AreaWeights &area_weights, int source_size, int size)
+	{
+		// Share of each pixel [i, i + 1) of the small image covered by each source pixel under it
+		if (area_weights.source_size == source_size && area_weights.size == size)
+			return;
+		area_weights.source_size = source_size;
+		area_weights.size = size;
+		area_weights.firsts.resize(size);
+		area_weights.offsets.resize((size_t)size + 1);
+		area_weights.weights.clear();
+
+		double scale = (double)source_size / size;
+		for (int i = 0; i < size; i++)
+		{
+			double begin = i * scale;
+			double end = std::min((i + 1) * scale, (double)source_size);
+			int first = (int)std::floor(begin);
+			int last = std::min((int)std::ceil(end), source_size);
+			area_weights.firsts[i] = first;
+			area_weights.offsets[i] = (int)area_weights.weights.size();
+			for (int s = first; s < last; s++)
+				area_weights.weights.push_back((float)((std::min(end, s + 1.0) - std::max(begin, (double)s)) / (end - begin)));
+		}
+		area_weights.offsets[size] = (int)area_weights.weights.size();
+
+		area_weights.taps = size > 0 ? area_weights.offsets[1] : 0;
+		for (int i = 1; i < size && area_weights.taps; i++)
+		{
+			if (area_weights.offsets[i + 1] - area_weights.offsets[i] != area_weights.taps)
+				area_weights.taps = 0;
+		}
+	}
+#ifdef OBJ_RENDERER_HAS_SSE2
+	template <int TAPS>
+	void accumulate_downsample_row(const unsigned char *source_row, float row_weight, int x0, int count, float *row_sums)
+	{
+		// Adds one source row to the sums of the 4-channel pixels [x0, x0 + count), one pixel per register: color times weight in
+		// the first 3 lanes, the weight in the last one. Same operations and order as the scalar loop, so the results are identical.
+		// TAPS source pixels under every pixel (unrolled), or 0 for any number
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 color_lanes = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+		const __m128 weight_lane = _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f);
+		for (int i = 0; i < count; i++)
+		{
+			int x = x0 + i;
+			const unsigned char *source_pixel = source_row + (size_t)column_weights.firsts[x] * 4;
+			const float *weights = &column_weights.weights[column_weights.offsets[x]];
+			int taps = TAPS > 0 ? TAPS : column_weights.offsets[x + 1] - column_weights.offsets[x];
+
+			__m128 sum = _mm_loadu_ps(row_sums + (size_t)i * 4);
+			for (int t = 0; t < taps; t++, source_pixel += 4)
+			{
+				int source_word;
+				std::memcpy(&source_word, source_pixel, 4);
+				__m128 color = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(source_word), zero), zero));
+				__m128 alpha = _mm_shuffle_ps(color, color, _MM_SHUFFLE(3, 3, 3, 3));
+				__m128 weight = _mm_mul_ps(_mm_set1_ps(weights[t] * row_weight), alpha);
+				sum = _mm_add_ps(sum, _mm_mul_ps(_mm_or_ps(_mm_and_ps(color, color_lanes), weight_lane), weight));
+			}
+			_mm_storeu_ps(row_sums + (size_t)i * 4, sum);
+		}
+	}
+	static void write_downsample_row(const float *row_sums, int count, unsigned char *pixel)
+	{
+		// Colors divided by the summed alpha (kept as it is in the last lane), rounded and packed back to 4 bytes per pixel
+		const __m128 half = _mm_set1_ps(0.5f);
+		const __m128 max_value = _mm_set1_ps(255.0f);
+		for (int i = 0; i < count; i++, pixel += 4)
+		{
+			__m128 sum = _mm_loadu_ps(row_sums + (size_t)i * 4);
+			float total_alpha = row_sums[(size_t)i * 4 + 3];
+			float inverse_alpha = total_alpha > 0.0f ? 1.0f / total_alpha : 0.0f;
+			__m128 value = _mm_min_ps(_mm_add_ps(_mm_mul_ps(sum, _mm_setr_ps(inverse_alpha, inverse_alpha, inverse_alpha, 1.0f)), half), max_value);
+			__m128i words = _mm_cvttps_epi32(value);
+			int pixel_word = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(words, words), words));
+			std::memcpy(pixel, &pixel_word, 4);
+		}
+	}
+#endif
+	void mark_rect_dirty(PixelRect rect)
+	{
+		if (rect.is_empty())
+			return;
+		for (int ty = rect.y0 / TILE_SIZE; ty <= (rect.y1 - 1) / TILE_SIZE; ty++)
+			for (int tx = rect.x0 / TILE_SIZE; tx <= (rect.x1 - 1) / TILE_SIZE; tx++)
+				tile_epochs[ty * tiles_x + tx] = current_epoch;
+		modification_count++;
+	}
+	void fill_rect(PixelRect rect, BasicImage *source, unsigned char value)
+	{
+		// Copies the rect from the source image, or sets it to the value when there is no source
+		size_t row_bytes = (size_t)(rect.x1 - rect.x0) * channels;
+		for (int y = rect.y0; y < rect.y1; y++)
+		{
+			size_t offset = (size_t)y * stride + (size_t)rect.x0 * channels;
+			if (source)
+				std::memcpy(pixels + offset, source->pixels + (size_t)y * source->stride + (size_t)rect.x0 * channels, row_bytes);
+			else
+				std::memset(pixels + offset, value, row_bytes);
+		}
+	}
+	void take_from(BasicImage &other)
+	{
+		// Member-wise move. The moved-from image is left empty (0x0, no pixels, no layer), so drawing onto it touches nothing and it releases nothing
+		this->width = other.width;
+		this->height = other.height;
+		this->channels = other.channels;
+		this->stride = other.stride;
+		this->pixels = other.pixels;
+		this->max_index = other.max_index;
+		this->buffer = std::move(other.buffer);
+		this->pool = other.pool;
+		this->sparse_tiles = std::move(other.sparse_tiles);
+		this->tiles_x = other.tiles_x;
+		this->tiles_y = other.tiles_y;
+		this->tile_epochs = std::move(other.tile_epochs);
+		this->current_epoch = other.current_epoch;
+		this->modification_count = other.modification_count;
+		this->coverage_mask = std::move(other.coverage_mask);
+		this->coverage_depth = other.coverage_depth;
+		this->coverage_color = other.coverage_color;
+		std::memcpy(this->blend_tables, other.blend_tables, sizeof(this->blend_tables));
+		this->blend_tables_color = other.blend_tables_color;
+		this->has_blend_tables = other.has_blend_tables;
+		this->is_blend_constant = other.is_blend_constant;
+		this->copied_layer = other.copied_layer;
+		this->copied_layer_modification = other.copied_layer_modification;
+		this->copy_epoch = other.copy_epoch;
+		this->z_offset = other.z_offset;
+		this->projection_distance = other.projection_distance;
+		this->obj_drawing_scale = other.obj_drawing_scale;
+		this->column_weights = std::move(other.column_weights);
+		this->row_weights = std::move(other.row_weights);
+
+		other.width = other.height = other.stride = other.max_index = 0;
+		other.pixels = nullptr;
+		other.pool = nullptr;
+		other.tiles_x = other.tiles_y = 0;
+		other.tile_epochs.clear();
+		other.column_weights = other.row_weights = AreaWeights{};
+		other.coverage_mask = CoverageMask{};
+		other.coverage_depth = 0;
+		other.copied_layer = nullptr;
+		other.copied_layer_modification = -1;
+	}
+	void release_storage()
+	{
+		// Buffers go back to their pool zeroed, ready for the next image
+		if (this->pool && this->buffer.get_data())
+		{
+			clear();
+			this->pool->release(std::move(this->buffer));
+		}
+		this->pixels = nullptr;
+	}
+};
+BasicImage BasicImage::HD_720() { return BasicImage{1280, 720, 4}; }
+BasicImage BasicImage::HD_1080() { return BasicImage{1920, 1080, 4}; }
+BasicImage BasicImage::UHD_4K() { return BasicImage{3840, 2160, 4}; }
+BasicImage BasicImage::from_preset(std::string name)
+{
+	if (name == "720")
+		return HD_720();
+	if (name == "4k")
+		return UHD_4K();
+	return HD_1080();
+}
+void BasicImage::get_preset_size(std::string name, int &width, int &height, int &channels)
+{
+	// Without allocating the image
+	width = name == "720" ? 1280 : name == "4k" ? 3840 : 1920;
+	height = name == "720" ? 720 : name == "4k" ? 2160 : 1080;
+	channels = 4;
+}
@@ -0,0 +1,366 @@
+#pragma once
+/*
+ * Author: Jaime Rivera
+ * Date : 2020.04.20
+ * Copyright : Copyright 2020 Jaime Rivera | www.jaimervq.com
+ * Brief: Aligned pixel storage for images (dense or sparse tiles), its geometry, a pool to reuse it between frames and assets, pixel rects and coverage masks
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define OBJ_RENDERER_HAS_SSE2
+#endif
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+// --------- PIXEL RECT --------- //
+struct PixelRect
+{
+	int x0, y0, x1, y1; // x1 and y1 are excluded
+
+	// Constructors
+	PixelRect() : x0(0), y0(0), x1(0), y1(0) {}
+	PixelRect(int input_x0, int input_y0, int input_x1, int input_y1) : x0(input_x0), y0(input_y0), x1(input_x1), y1(input_y1) {}
+
+	// Get
+	int get_width() { return x1 - x0; }
+	int get_height() { return y1 - y0; }
+	bool is_empty() { return x1 <= x0 || y1 <= y0; }
+
+	// Utility
+	void expand(PixelRect other)
+	{
+		if (other.is_empty())
+			return;
+		if (this->is_empty())
+		{
+			*this = other;
+			return;
+		}
+		x0 = std::min(x0, other.x0);
+		y0 = std::min(y0, other.y0);
+		x1 = std::max(x1, other.x1);
+		y1 = std::max(y1, other.y1);
+	}
+};
+
+// --------- PIXEL BUFFER --------- //
+class PixelBuffer
+{
+private:
+	unsigned char *data;
+	size_t size;
+
+public:
+	// Alignment of every buffer (and of every row, see BasicImage's stride)
+	static const size_t ALIGNMENT = 64;
+
+	// Constructors
+	PixelBuffer() : data(nullptr), size(0) {}
+	PixelBuffer(size_t input_size) : data(nullptr), size(input_size)
+	{
+		this->data = static_cast<unsigned char *>(::operator new(input_size, std::align_val_t{ALIGNMENT}));
+		std::memset(this->data, 0, input_size);
+	}
+	PixelBuffer(const PixelBuffer &) = delete;
+	PixelBuffer(PixelBuffer &&other) noexcept : data(other.data), size(other.size)
+	{
+		other.data = nullptr;
+		other.size = 0;
+	}
+	~PixelBuffer() { free(); }
+
+	// Operators
+	PixelBuffer &operator=(const PixelBuffer &) = delete;
+	PixelBuffer &operator=(PixelBuffer &&other) noexcept
+	{
+		if (this != &other)
+		{
+			free();
+			this->data = other.data;
+			this->size = other.size;
+			other.data = nullptr;
+			other.size = 0;
+		}
+		return *this;
+	}
+
+	// Get
+	unsigned char *get_data() { return this->data; }
+	size_t get_size() { return this->size; }
+
+	// Utility
+	static size_t aligned_stride(size_t row_bytes)
+	{
+		return (row_bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+	}
+	void free()
+	{
+		if (this->data)
+			::operator delete(this->data, std::align_val_t{ALIGNMENT});
+		this->data = nullptr;
+		this->size = 0;
+	}
+};
+
+// --------- SPARSE TILES --------- //
+class SparseTiles
+{
+private:
+	int width, height, channels;
+	int tile_size, tiles_x, tiles_y;
+	std::vector<std::unique_ptr<unsigned char[]>> tiles; // Null until first written
+	size_t allocated_count, peak_count;
+
+public:
+	// Constructor
+	SparseTiles(int input_width, int input_height, int input_channels, int input_tile_size) : width(input_width), height(input_height), channels(input_channels), tile_size(input_tile_size),
+																							 allocated_count(0), peak_count(0)
+	{
+		this->tiles_x = (input_width + input_tile_size - 1) / input_tile_size;
+		this->tiles_y = (input_height + input_tile_size - 1) / input_tile_size;
+		this->tiles.resize((size_t)tiles_x * tiles_y);
+	}
+
+	// Get
+	int get_tile_size() { return this->tile_size; }
+	int get_tile_stride() { return this->tile_size * this->channels; } // Bytes per row of a tile
+	size_t get_tile_bytes() { return (size_t)this->tile_size * this->tile_size * this->channels; }
+	int count_tiles_x() { return this->tiles_x; }
+	int count_tiles_y() { return this->tiles_y; }
+	size_t count_allocated_tiles() { return this->allocated_count; }
+	size_t count_peak_tiles() { return this->peak_count; }
+	unsigned char *get_tile(int tx, int ty) { return this->tiles[(size_t)ty * tiles_x + tx].get(); } // Null for untouched tiles
+
+	// Tiles
+	unsigned char *get_pixel_for_writing(int xi, int yi)
+	{
+		// Allocates (zeroed) the tile of the pixel the first time it is written
+		std::unique_ptr<unsigned char[]> &tile = this->tiles[(size_t)(yi / tile_size) * tiles_x + xi / tile_size];
+		if (!tile)
+		{
+			tile.reset(new unsigned char[get_tile_bytes()]());
+			this->peak_count = std::max(this->peak_count, ++this->allocated_count);
+		}
+		return tile.get() + (size_t)(yi % tile_size) * get_tile_stride() + (size_t)(xi % tile_size) * channels;
+	}
+	void release_tile(int tx, int ty)
+	{
+		std::unique_ptr<unsigned char[]> &tile = this->tiles[(size_t)ty * tiles_x + tx];
+		if (tile)
+			this->allocated_count--;
+		tile.reset();
+	}
+	void release_all()
+	{
+		for (std::unique_ptr<unsigned char[]> &tile : this->tiles)
+			tile.reset();
+		this->allocated_count = 0;
+	}
+};
+
+// --------- COVERAGE MASK --------- //
+class CoverageMask
+{
+	// One bit per pixel, stored only for the tiles marked since the last clear
+private:
+	int tiles_x;
+	std::vector<int> tile_slots;	 // Per tile: its slot in the rows, -1 while unmarked
+	std::vector<uint64_t> rows;		 // TILE_SIZE rows of TILE_SIZE bits per slot
+	std::vector<uint64_t> row_flags; // Per slot: one bit per row with marked pixels
+	std::vector<int> marked_tiles;	 // In the order they were first marked
+
+public:
+	static constexpr int TILE_SIZE = 64;
+
+	// Constructor
+	CoverageMask() : tiles_x(0) {}
+
+	// Bits
+	static int lowest_bit(uint64_t bits)
+	{
+		// Index of the lowest set bit (bits must not be 0)
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_ctzll(bits);
+#elif defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanForward64(&index, bits);
+		return (int)index;
+#else
+		int index = 0;
+		for (; !(bits & 1); bits >>= 1)
+			index++;
+		return index;
+#endif
+	}
+
+	// Get
+	bool is_empty() { return this->marked_tiles.empty(); }
+	size_t count_marked_tiles() { return this->marked_tiles.size(); }
+
+	// Utility
+	void resize(int width, int height)
+	{
+		this->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+		this->tile_slots.assign((size_t)tiles_x * ((height + TILE_SIZE - 1) / TILE_SIZE), -1);
+		this->rows.clear();
+		this->row_flags.clear();
+		this->marked_tiles.clear();
+	}
+	void mark(int xi, int yi)
+	{
+		unsigned x = (unsigned)xi, y = (unsigned)yi; // Never negative, and unsigned makes the divisions shifts
+		int tile = (int)(y / TILE_SIZE) * tiles_x + (int)(x / TILE_SIZE);
+		int slot = this->tile_slots[tile];
+		if (slot < 0)
+		{
+			slot = this->tile_slots[tile] = (int)this->marked_tiles.size();
+			this->marked_tiles.push_back(tile);
+			if (this->rows.size() < (size_t)(slot + 1) * TILE_SIZE)
+			{
+				this->rows.resize((size_t)(slot + 1) * TILE_SIZE, 0);
+				this->row_flags.resize((size_t)slot + 1, 0);
+			}
+		}
+		this->rows[(size_t)slot * TILE_SIZE + y % TILE_SIZE] |= (uint64_t)1 << (x % TILE_SIZE);
+		this->row_flags[slot] |= (uint64_t)1 << (y % TILE_SIZE);
+	}
+	template <class Visit>
+	void for_each_row(Visit visit)
+	{
+		// visit(x0, yi, bits) for every tile row with marked pixels, bit i being the pixel x0 + i
+		for (size_t slot = 0; slot < this->marked_tiles.size(); slot++)
+		{
+			int x0 = this->marked_tiles[slot] % tiles_x * TILE_SIZE;
+			int y0 = this->marked_tiles[slot] / tiles_x * TILE_SIZE;
+			const uint64_t *tile_rows = &this->rows[slot * TILE_SIZE];
+			for (uint64_t flags = this->row_flags[slot]; flags; flags &= flags - 1)
+			{
+				int row = lowest_bit(flags);
+				visit(x0, y0 + row, tile_rows[row]);
+			}
+		}
+	}
+	void clear()
+	{
+		// Only the marked rows are zeroed
+		for (size_t slot = 0; slot < this->marked_tiles.size(); slot++)
+		{
+			uint64_t *tile_rows = &this->rows[slot * TILE_SIZE];
+			for (uint64_t flags = this->row_flags[slot]; flags; flags &= flags - 1)
+				tile_rows[lowest_bit(flags)] = 0;
+			this->row_flags[slot] = 0;
+			this->tile_slots[this->marked_tiles[slot]] = -1;
+		}
+		this->marked_tiles.clear();
+	}
+};
+
+// --------- FRAME GEOMETRY --------- //
+template <int WIDTH, int HEIGHT, int CHANNELS>
+struct FixedGeometry
+{
+	// Sizes known at compile time (the preset resolutions), so the index math of the raster loops folds into constants
+	static constexpr int width = WIDTH;
+	static constexpr int height = HEIGHT;
+	static constexpr int channels = CHANNELS;
+	static constexpr int stride = (int)((WIDTH * CHANNELS + PixelBuffer::ALIGNMENT - 1) / PixelBuffer::ALIGNMENT * PixelBuffer::ALIGNMENT);
+
+	// Utility
+	static int get_index(int xi, int yi) { return yi * stride + xi * CHANNELS; }
+	static unsigned char *get_pixel(unsigned char *pixels, int xi, int yi) { return pixels + get_index(xi, yi); }
+	static int get_row_end(int) { return WIDTH; } // End of the contiguous pixels from xi
+};
+using HD720Geometry = FixedGeometry<1280, 720, 4>;
+using HD1080Geometry = FixedGeometry<1920, 1080, 4>;
+using UHD4KGeometry = FixedGeometry<3840, 2160, 4>;
+
+struct RuntimeGeometry
+{
+	// Any other size
+	int width, height, channels, stride;
+
+	// Utility
+	int get_index(int xi, int yi) const { return yi * stride + xi * channels; }
+	unsigned char *get_pixel(unsigned char *pixels, int xi, int yi) const { return pixels + get_index(xi, yi); }
+	int get_row_end(int) const { return width; }
+};
+
+struct SparseGeometry
+{
+	// Tiles allocated as they are drawn onto (rows are only contiguous within a tile)
+	int width, height, channels;
+	SparseTiles *tiles;
+
+	// Utility
+	unsigned char *get_pixel(unsigned char *, int xi, int yi) const { return tiles->get_pixel_for_writing(xi, yi); } // No pixel array: tiles are found by coords
+	int get_row_end(int xi) const { return std::min((xi / tiles->get_tile_size() + 1) * tiles->get_tile_size(), width); }
+};
+
+// --------- FRAME BUFFER POOL --------- //
+class FrameBufferPool
+{
+private:
+	std::mutex mutex;
+	std::vector<PixelBuffer> free_buffers; // Always handed back zeroed
+	int allocation_count;
+	size_t allocated_bytes;
+
+public:
+	// Constructor
+	FrameBufferPool() : allocation_count(0), allocated_bytes(0) {}
+
+	// Shared instance (used by the predefined image resolutions)
+	static FrameBufferPool &shared()
+	{
+		static FrameBufferPool pool;
+		return pool;
+	}
+
+	// Get
+	int count_allocations() { return this->allocation_count; }
+	size_t count_allocated_bytes() { return this->allocated_bytes; }
+
+	// Buffers
+	PixelBuffer acquire(size_t size)
+	{
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			for (size_t i = 0; i < free_buffers.size(); i++)
+			{
+				if (free_buffers[i].get_size() == size)
+				{
+					PixelBuffer reused = std::move(free_buffers[i]);
+					free_buffers.erase(free_buffers.begin() + i);
+					return reused;
+				}
+			}
+			this->allocation_count++;
+			this->allocated_bytes += size;
+		}
+		return PixelBuffer{size};
+	}
+	void release(PixelBuffer buffer)
+	{
+		if (!buffer.get_data())
+			return;
+
+		std::lock_guard<std::mutex> lock{mutex};
+		free_buffers.push_back(std::move(buffer));
+	}
+	void trim()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		free_buffers.clear();
+	}
+};
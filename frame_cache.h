@@ -0,0 +1,98 @@
+#pragma once
+/*
+ * Author: Jaime Rivera
+ * Date : 2020.04.20
+ * Copyright : Copyright 2020 Jaime Rivera | www.jaimervq.com
+ * Brief: Cache of rendered frame files, keyed by what they are rendered from, so unchanged frames are copied instead of rendered again
+ */
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+
+// --------- CONTENT HASHING --------- //
+unsigned long long hash_bytes(unsigned long long hash, const void *data, size_t length)
+{
+	// FNV-1a (64 bits), continuing from the given hash
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+unsigned long long hash_string(unsigned long long hash, std::string text)
+{
+	hash = hash_bytes(hash, text.data(), text.size());
+	return hash_bytes(hash, "\n", 1); // So that consecutive strings can not run into each other
+}
+unsigned long long hash_file(std::string filepath)
+{
+	// FNV-1a (64 bits) of the whole file
+	unsigned long long hash = 14695981039346656037ULL;
+	std::ifstream f{filepath, std::ios::binary};
+	char chunk[65536];
+	while (f.read(chunk, sizeof(chunk)) || f.gcount() > 0)
+		hash = hash_bytes(hash, chunk, (size_t)f.gcount());
+	return hash;
+}
+
+// --------- FRAME CACHE --------- //
+class FrameCache
+{
+private:
+	std::string folder;			 // Ending in '/'
+	unsigned long long job_hash; // Mesh contents and every option that changes the pixels of the frames
+
+	// Bumped whenever the drawing changes, so frames cached by older renderers are not reused
+	static const int RENDERER_VERSION = 3;
+
+public:
+	// Constructor
+	FrameCache(std::string input_folder, unsigned long long input_job_hash) : folder(input_folder)
+	{
+		if (!this->folder.empty() && this->folder.back() != '/')
+			this->folder += "/";
+		this->job_hash = hash_string(input_job_hash, "renderer " + std::to_string(RENDERER_VERSION));
+		std::error_code error;
+		std::filesystem::create_directories(this->folder, error);
+	}
+
+	// Get
+	std::string get_key(std::string resolution, double angle)
+	{
+		char angle_text[32];
+		std::snprintf(angle_text, sizeof(angle_text), "%.17g", angle);
+
+		unsigned long long hash = hash_string(hash_string(job_hash, resolution), angle_text);
+		char key[17];
+		std::snprintf(key, sizeof(key), "%016llx", hash);
+		return key;
+	}
+
+	// Frames
+	bool contains(std::string key) { return std::filesystem::exists(get_path(key)); }
+	bool restore(std::string key, std::string output_path)
+	{
+		// Copies the cached frame to the output path (false if it is not cached)
+		std::error_code error;
+		return std::filesystem::copy_file(get_path(key), output_path, std::filesystem::copy_options::overwrite_existing, error);
+	}
+	void store(std::string key, std::string output_path)
+	{
+		// Copied under a temporary name first, so other renders never find a half-written frame
+		std::string path = get_path(key);
+		std::string temporary_path = path + ".tmp" + std::to_string((unsigned long long)this);
+		std::error_code error;
+		if (std::filesystem::copy_file(output_path, temporary_path, std::filesystem::copy_options::overwrite_existing, error))
+			std::filesystem::rename(temporary_path, path, error);
+		if (error)
+			std::filesystem::remove(temporary_path, error);
+	}
+
+private:
+	std::string get_path(std::string key) { return folder + key + ".png"; }
+};
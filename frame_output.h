@@ -0,0 +1,1413 @@
+#pragma once
+/*
+ * Author: Jaime Rivera
+ * Date : 2020.04.20
+ * Copyright : Copyright 2020 Jaime Rivera | www.jaimervq.com
+ * Brief: Outputs for the rendered frames: PNG sequences (RGBA or indexed), animated PNG and GIF (only storing what changed between frames), a single-file frame archive, a callback, or a PNG streamed strip by strip
+ * Credits: Sean Barrett, author of the STB library, used in this project (https://github.com/nothings/stb)
+ */
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "drawing_utils.h"
+#include "frame_buffer.h"
+#include "profiling.h"
+
+// --------- BYTE UTILITIES --------- //
+typedef std::vector<unsigned char> ByteBuffer;
+
+void put_u32_be(ByteBuffer &out, uint32_t value)
+{
+	out.push_back((unsigned char)(value >> 24));
+	out.push_back((unsigned char)(value >> 16));
+	out.push_back((unsigned char)(value >> 8));
+	out.push_back((unsigned char)value);
+}
+void put_u16_be(ByteBuffer &out, uint16_t value)
+{
+	out.push_back((unsigned char)(value >> 8));
+	out.push_back((unsigned char)value);
+}
+void put_u16_le(ByteBuffer &out, uint16_t value)
+{
+	out.push_back((unsigned char)value);
+	out.push_back((unsigned char)(value >> 8));
+}
+void put_u32_le(ByteBuffer &out, uint32_t value)
+{
+	put_u16_le(out, (uint16_t)value);
+	put_u16_le(out, (uint16_t)(value >> 16));
+}
+void put_u64_le(ByteBuffer &out, uint64_t value)
+{
+	put_u32_le(out, (uint32_t)value);
+	put_u32_le(out, (uint32_t)(value >> 32));
+}
+uint64_t get_uint_le(const unsigned char *data, int bytes)
+{
+	uint64_t value = 0;
+	for (int i = bytes - 1; i >= 0; i--)
+		value = (value << 8) | data[i];
+	return value;
+}
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t length)
+{
+	// Built once on first use; static initialization is thread-safe, so concurrent sinks can share it
+	static const std::array<uint32_t, 256> table = []()
+	{
+		std::array<uint32_t, 256> entries{};
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			entries[i] = c;
+		}
+		return entries;
+	}();
+
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+void put_png_chunk(ByteBuffer &out, const char *type, const unsigned char *data, size_t length)
+{
+	put_u32_be(out, (uint32_t)length);
+	size_t crc_start = out.size();
+	out.insert(out.end(), type, type + 4);
+	if (length)
+		out.insert(out.end(), data, data + length);
+	put_u32_be(out, crc32_update(0, out.data() + crc_start, length + 4));
+}
+
+// --------- CHANGED REGIONS --------- //
+PixelRect find_changed_rect(BasicImage &image, unsigned char *previous, PixelRect candidate)
+{
+	// Tightest rect, inside the candidate, in which the image differs from the previous pixels (same stride)
+	int stride = image.get_stride();
+	int channels = image.get_channels();
+	unsigned char *pixels = image.get_pixels();
+	size_t row_bytes = (size_t)candidate.get_width() * channels;
+
+	PixelRect changed;
+	for (int y = candidate.y0; y < candidate.y1; y++)
+	{
+		size_t offset = (size_t)y * stride + (size_t)candidate.x0 * channels;
+		if (std::memcmp(pixels + offset, previous + offset, row_bytes) == 0)
+			continue;
+
+		int x0 = candidate.x0;
+		while (std::memcmp(pixels + offset + (size_t)(x0 - candidate.x0) * channels, previous + offset + (size_t)(x0 - candidate.x0) * channels, channels) == 0)
+			x0++;
+		int x1 = candidate.x1;
+		while (std::memcmp(pixels + offset + (size_t)(x1 - 1 - candidate.x0) * channels, previous + offset + (size_t)(x1 - 1 - candidate.x0) * channels, channels) == 0)
+			x1--;
+
+		changed.expand(PixelRect{x0, y, x1, y + 1});
+	}
+	return changed;
+}
+ByteBuffer extract_png_scanlines(BasicImage &image, PixelRect rect)
+{
+	// Filtered PNG scanlines of the rect, choosing per row the filter with the smallest sum of absolute values
+	int channels = image.get_channels();
+	int stride = image.get_stride();
+	size_t row_bytes = (size_t)rect.get_width() * channels;
+
+	ByteBuffer out;
+	out.reserve((row_bytes + 1) * rect.get_height());
+	std::vector<unsigned char> candidate(row_bytes);
+	std::vector<unsigned char> zero_row(row_bytes, 0);
+	for (int y = rect.y0; y < rect.y1; y++)
+	{
+		unsigned char *row = image.get_pixels() + (size_t)y * stride + (size_t)rect.x0 * channels;
+		unsigned char *up = y > rect.y0 ? row - stride : zero_row.data();
+
+		int best_filter = 0;
+		long long best_score = -1;
+		ByteBuffer best_row;
+		for (int filter = 0; filter < 5; filter++)
+		{
+			long long score = 0;
+			for (size_t i = 0; i < row_bytes; i++)
+			{
+				int a = i >= (size_t)channels ? row[i - channels] : 0;
+				int b = up[i];
+				int c = i >= (size_t)channels ? up[i - channels] : 0;
+				int predictor = 0;
+				if (filter == 1)
+					predictor = a;
+				else if (filter == 2)
+					predictor = b;
+				else if (filter == 3)
+					predictor = (a + b) / 2;
+				else if (filter == 4)
+				{
+					int p = a + b - c;
+					int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+					predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+				}
+				candidate[i] = (unsigned char)(row[i] - predictor);
+				score += abs((signed char)candidate[i]);
+			}
+			if (best_score < 0 || score < best_score)
+			{
+				best_score = score;
+				best_filter = filter;
+				best_row.assign(candidate.begin(), candidate.end());
+			}
+		}
+
+		out.push_back((unsigned char)best_filter);
+		out.insert(out.end(), best_row.begin(), best_row.end());
+	}
+	return out;
+}
+ByteBuffer zlib_compress(ByteBuffer &data)
+{
+	int compressed_length = 0;
+	unsigned char *compressed = stbi_zlib_compress(data.data(), (int)data.size(), &compressed_length, stbi_write_png_compression_level);
+	ByteBuffer out{compressed, compressed + compressed_length};
+	STBIW_FREE(compressed);
+	return out;
+}
+
+// --------- INDEXED COLOR --------- //
+class ColorPalette
+{
+private:
+	std::vector<uint32_t> colors; // The 4 bytes of each RGBA color, as they are in memory
+
+	// Lookup (open addressing, linear probing)
+	std::vector<uint32_t> slot_colors;
+	std::vector<int> slot_indices; // -1 for empty slots
+
+public:
+	static const int MAX_COLORS = 256;
+
+	// Constructor
+	ColorPalette() : slot_colors(LOOKUP_SLOTS, 0), slot_indices(LOOKUP_SLOTS, -1) {}
+
+	// Get
+	std::vector<uint32_t> &get_colors() { return this->colors; }
+	int count_colors() { return (int)this->colors.size(); }
+
+	// Building
+	int find(uint32_t color)
+	{
+		for (uint32_t slot = get_slot(color);; slot = (slot + 1) % LOOKUP_SLOTS)
+		{
+			if (slot_indices[slot] < 0 || slot_colors[slot] == color)
+				return slot_indices[slot];
+		}
+	}
+	int add(uint32_t color)
+	{
+		// Index of the color, -1 if it is new and the palette is full
+		int index = find(color);
+		if (index >= 0 || (int)colors.size() >= MAX_COLORS)
+			return index;
+
+		uint32_t slot = get_slot(color);
+		while (slot_indices[slot] >= 0)
+			slot = (slot + 1) % LOOKUP_SLOTS;
+		slot_colors[slot] = color;
+		slot_indices[slot] = (int)colors.size();
+		colors.push_back(color);
+		return slot_indices[slot];
+	}
+	void truncate(int count)
+	{
+		// Forgets the colors added after the first count. They are the latest ones, so the probe sequences of the rest stay intact
+		if (count >= (int)colors.size())
+			return;
+		for (int &index : slot_indices)
+		{
+			if (index >= count)
+				index = -1;
+		}
+		colors.resize(count);
+	}
+	void add_brush_blends(std::vector<BasicColor> &brush_colors)
+	{
+		// Transparent black, and every brush 'over' every color already in (as draw_single_pixel blends them) until no new color comes out
+		add(0);
+		size_t previous_count = 0;
+		while (previous_count != colors.size() && (int)colors.size() < MAX_COLORS)
+		{
+			previous_count = colors.size();
+			for (size_t i = 0; i < previous_count; i++)
+			{
+				unsigned char *bytes = (unsigned char *)&colors[i];
+				BasicColor pixel_color{(double)bytes[0], (double)bytes[1], (double)bytes[2], (double)bytes[3]};
+				for (BasicColor brush_color : brush_colors)
+				{
+					BasicColor blend_color = blend_two_colors(brush_color, BasicColor::over_ID, pixel_color);
+					unsigned char blend_bytes[4] = {(unsigned char)blend_color.r255(), (unsigned char)blend_color.g255(), (unsigned char)blend_color.b255(), (unsigned char)blend_color.a255()};
+					uint32_t blend;
+					std::memcpy(&blend, blend_bytes, 4);
+					add(blend);
+				}
+			}
+		}
+	}
+
+	// Mapping
+	bool map_row(const unsigned char *rgba, int count, unsigned char *indices)
+	{
+		// Palette index of every pixel (new colors are added). False when the palette is full.
+		// Runs of the color of the previous pixel, by far the most common case, are checked 4 pixels at a time
+		uint32_t run_color = 0;
+		int run_index = -1;
+		int i = 0;
+		while (i < count)
+		{
+#ifdef OBJ_RENDERER_HAS_SSE2
+			if (run_index >= 0 && i + 4 <= count)
+			{
+				__m128i block = _mm_loadu_si128((const __m128i *)(rgba + (size_t)i * 4));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi32(block, _mm_set1_epi32((int)run_color))) == 0xFFFF)
+				{
+					std::memset(indices + i, run_index, 4);
+					i += 4;
+					continue;
+				}
+			}
+#endif
+			uint32_t color;
+			std::memcpy(&color, rgba + (size_t)i * 4, 4);
+			if (run_index < 0 || color != run_color)
+			{
+				run_index = add(color);
+				if (run_index < 0)
+					return false;
+				run_color = color;
+			}
+			indices[i++] = (unsigned char)run_index;
+		}
+		return true;
+	}
+
+private:
+	static const uint32_t LOOKUP_SLOTS = 1024;
+	static uint32_t get_slot(uint32_t color) { return (color * 2654435761u) >> 22; } // Multiplicative hash (top 10 bits)
+};
+
+ByteBuffer encode_indexed_png(const ByteBuffer &indices, int width, int height, const std::vector<uint32_t> &palette)
+{
+	// Palette PNG, packing the indices in as few bits as the palette allows. Rows are left unfiltered, as recommended for palette images
+	int bit_depth = palette.size() <= 2 ? 1 : palette.size() <= 4 ? 2 : palette.size() <= 16 ? 4 : 8;
+	int pixels_per_byte = 8 / bit_depth;
+	size_t row_bytes = ((size_t)width + pixels_per_byte - 1) / pixels_per_byte;
+
+	ByteBuffer scanlines((row_bytes + 1) * height, 0);
+	for (int y = 0; y < height; y++)
+	{
+		unsigned char *row = &scanlines[(row_bytes + 1) * y + 1];
+		const unsigned char *row_indices = &indices[(size_t)y * width];
+		if (bit_depth == 8)
+		{
+			std::memcpy(row, row_indices, width);
+			continue;
+		}
+		for (int x = 0; x < width; x++)
+			row[x / pixels_per_byte] |= row_indices[x] << (8 - bit_depth * (x % pixels_per_byte + 1));
+	}
+
+	ByteBuffer out{0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	ByteBuffer ihdr;
+	put_u32_be(ihdr, width);
+	put_u32_be(ihdr, height);
+	ihdr.push_back((unsigned char)bit_depth);
+	ihdr.push_back(3); // Indexed color
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	put_png_chunk(out, "IHDR", ihdr.data(), ihdr.size());
+
+	// Colors, and their alpha up to the last one that is not opaque
+	ByteBuffer plte, trns;
+	for (uint32_t color : palette)
+	{
+		unsigned char *bytes = (unsigned char *)&color;
+		plte.insert(plte.end(), {bytes[0], bytes[1], bytes[2]});
+		trns.push_back(bytes[3]);
+	}
+	while (!trns.empty() && trns.back() == 255)
+		trns.pop_back();
+	put_png_chunk(out, "PLTE", plte.data(), plte.size());
+	if (!trns.empty())
+		put_png_chunk(out, "tRNS", trns.data(), trns.size());
+
+	ByteBuffer compressed = zlib_compress(scanlines);
+	put_png_chunk(out, "IDAT", compressed.data(), compressed.size());
+	put_png_chunk(out, "IEND", nullptr, 0);
+	return out;
+}
+
+// --------- STREAMED PNG --------- //
+class DeflateStream
+{
+	// zlib stream compressed a piece at a time (LZ77 and fixed Huffman codes), so that the whole input never has to be in memory.
+	// Each piece becomes one block, and matches can reach back into the previous pieces
+private:
+	static const int WINDOW_SIZE = 32768;
+	static const int HASH_BITS = 15;
+	static const int MAX_CHAIN = 8;
+	static const int MIN_MATCH = 3;
+	static const int MAX_MATCH = 258;
+
+	ByteBuffer window;							 // Up to WINDOW_SIZE bytes of the previous pieces, then the current one
+	long long window_start;						 // Stream position of window[0]
+	std::vector<long long> head, previous_match; // Last position of each hash, and the position before it with the same hash
+	uint32_t bit_buffer;
+	int bit_count;
+	uint32_t adler_a, adler_b;
+	bool started;
+
+public:
+	// Constructor
+	DeflateStream() : window_start(0), head((size_t)1 << HASH_BITS, -1), previous_match(WINDOW_SIZE, -1), bit_buffer(0), bit_count(0), adler_a(1), adler_b(0), started(false) {}
+
+	// Compression
+	void write(const unsigned char *data, size_t length, ByteBuffer &out)
+	{
+		// Appends the compressed bytes completed so far to out (a few bits may wait for the next piece)
+		write_header(out);
+		update_adler(data, length);
+
+		if (window.size() > (size_t)WINDOW_SIZE)
+		{
+			size_t dropped = window.size() - WINDOW_SIZE;
+			window.erase(window.begin(), window.begin() + dropped);
+			window_start += dropped;
+		}
+		size_t i = window.size();
+		window.insert(window.end(), data, data + length);
+
+		put_bits(out, 2, 3); // Not final, fixed codes
+		while (i < window.size())
+		{
+			int best_length = 0;
+			long long best_distance = 0;
+			if (i + MIN_MATCH <= window.size())
+			{
+				long long position = window_start + (long long)i;
+				int max_length = (int)std::min((size_t)MAX_MATCH, window.size() - i);
+				long long candidate = head[get_hash(&window[i])];
+				for (int chain = 0; chain < MAX_CHAIN && candidate >= window_start && position - candidate <= WINDOW_SIZE; chain++)
+				{
+					const unsigned char *a = &window[(size_t)(candidate - window_start)];
+					const unsigned char *b = &window[i];
+					int match_length = 0;
+					while (match_length < max_length && a[match_length] == b[match_length])
+						match_length++;
+					if (match_length > best_length)
+					{
+						best_length = match_length;
+						best_distance = position - candidate;
+						if (match_length == max_length)
+							break;
+					}
+
+					long long next = previous_match[candidate % WINDOW_SIZE];
+					if (next >= candidate) // Slot already reused by a newer position
+						break;
+					candidate = next;
+				}
+			}
+
+			if (best_length >= MIN_MATCH)
+			{
+				put_match(out, best_length, (int)best_distance);
+				for (int k = 0; k < best_length; k++)
+					insert_hash(i + k);
+				i += best_length;
+			}
+			else
+			{
+				put_symbol(out, window[i]);
+				insert_hash(i);
+				i++;
+			}
+		}
+		put_symbol(out, 256);
+	}
+	void finish(ByteBuffer &out)
+	{
+		// Empty final block, then the Adler-32 of everything written
+		write_header(out);
+		put_bits(out, 3, 3);
+		put_symbol(out, 256);
+		if (bit_count > 0)
+			out.push_back((unsigned char)bit_buffer);
+		bit_buffer = 0;
+		bit_count = 0;
+		put_u32_be(out, (adler_b << 16) | adler_a);
+	}
+
+private:
+	void write_header(ByteBuffer &out)
+	{
+		if (started)
+			return;
+		out.push_back(0x78);
+		out.push_back(0x01);
+		started = true;
+	}
+	void update_adler(const unsigned char *data, size_t length)
+	{
+		while (length > 0)
+		{
+			size_t block = std::min(length, (size_t)5552); // Largest block whose sums can not overflow before the modulo
+			for (size_t i = 0; i < block; i++)
+			{
+				adler_a += data[i];
+				adler_b += adler_a;
+			}
+			adler_a %= 65521;
+			adler_b %= 65521;
+			data += block;
+			length -= block;
+		}
+	}
+	static uint32_t get_hash(const unsigned char *bytes)
+	{
+		uint32_t value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16);
+		return (value * 2654435761u) >> (32 - HASH_BITS);
+	}
+	void insert_hash(size_t i)
+	{
+		if (i + MIN_MATCH > window.size())
+			return;
+		long long position = window_start + (long long)i;
+		uint32_t hash = get_hash(&window[i]);
+		previous_match[position % WINDOW_SIZE] = head[hash];
+		head[hash] = position;
+	}
+	void put_bits(ByteBuffer &out, uint32_t value, int count)
+	{
+		bit_buffer |= value << bit_count;
+		bit_count += count;
+		while (bit_count >= 8)
+		{
+			out.push_back((unsigned char)bit_buffer);
+			bit_buffer >>= 8;
+			bit_count -= 8;
+		}
+	}
+	void put_code(ByteBuffer &out, uint32_t code, int length)
+	{
+		// Huffman codes go most significant bit first
+		uint32_t reversed = 0;
+		for (int k = 0; k < length; k++)
+			reversed |= ((code >> k) & 1) << (length - 1 - k);
+		put_bits(out, reversed, length);
+	}
+	void put_symbol(ByteBuffer &out, int symbol)
+	{
+		// Fixed literal/length codes
+		if (symbol < 144)
+			put_code(out, 0x30 + symbol, 8);
+		else if (symbol < 256)
+			put_code(out, 0x190 + symbol - 144, 9);
+		else if (symbol < 280)
+			put_code(out, symbol - 256, 7);
+		else
+			put_code(out, 0xC0 + symbol - 280, 8);
+	}
+	void put_match(ByteBuffer &out, int length, int distance)
+	{
+		static const int LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+		static const int LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+		static const int DISTANCE_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+		static const int DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+		int length_code = 28;
+		while (LENGTH_BASE[length_code] > length)
+			length_code--;
+		put_symbol(out, 257 + length_code);
+		put_bits(out, length - LENGTH_BASE[length_code], LENGTH_EXTRA[length_code]);
+
+		int distance_code = 29;
+		while (DISTANCE_BASE[distance_code] > distance)
+			distance_code--;
+		put_code(out, distance_code, 5);
+		put_bits(out, distance - DISTANCE_BASE[distance_code], DISTANCE_EXTRA[distance_code]);
+	}
+};
+
+bool write_sparse_png(BasicImage &image, std::string filename)
+{
+	// Streams the image out one strip of tiles at a time, freeing each strip once encoded.
+	// Tiles never drawn onto are written as transparent rows without being allocated
+	SparseTiles *tiles = image.get_sparse_tiles();
+	std::ofstream file(filename, std::ios::binary);
+	if (!tiles || !file)
+		return false;
+
+	int width = image.get_width(), height = image.get_height(), channels = image.get_channels();
+	int tile_size = tiles->get_tile_size();
+	size_t row_bytes = (size_t)width * channels;
+
+	ByteBuffer out{0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	ByteBuffer ihdr;
+	put_u32_be(ihdr, width);
+	put_u32_be(ihdr, height);
+	ihdr.push_back(8);
+	ihdr.push_back(channels == 4 ? 6 : 2); // RGBA or RGB
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	put_png_chunk(out, "IHDR", ihdr.data(), ihdr.size());
+
+	DeflateStream deflate;
+	ByteBuffer strip, compressed;
+	for (int ty = 0; ty < tiles->count_tiles_y(); ty++)
+	{
+		// ------ Unfiltered scanlines of the strip ------ //
+		int strip_rows = std::min(tile_size, height - ty * tile_size);
+		strip.assign((row_bytes + 1) * strip_rows, 0);
+		for (int tx = 0; tx < tiles->count_tiles_x(); tx++)
+		{
+			unsigned char *tile = tiles->get_tile(tx, ty);
+			if (!tile)
+				continue;
+			size_t tile_row_bytes = (size_t)std::min(tile_size, width - tx * tile_size) * channels;
+			for (int r = 0; r < strip_rows; r++)
+				std::memcpy(&strip[(row_bytes + 1) * r + 1 + (size_t)tx * tile_size * channels], tile + (size_t)r * tiles->get_tile_stride(), tile_row_bytes);
+			tiles->release_tile(tx, ty);
+		}
+
+		// ------ Compression ------ //
+		deflate.write(strip.data(), strip.size(), compressed);
+		if (ty == tiles->count_tiles_y() - 1)
+			deflate.finish(compressed);
+		put_png_chunk(out, "IDAT", compressed.data(), compressed.size());
+		compressed.clear();
+
+		file.write((const char *)out.data(), out.size());
+		out.clear();
+	}
+
+	put_png_chunk(out, "IEND", nullptr, 0);
+	file.write((const char *)out.data(), out.size());
+	return (bool)file;
+}
+
+// --------- PARALLEL ENCODING --------- //
+class EncodeQueue
+{
+private:
+	std::deque<std::future<ByteBuffer>> pending;
+	size_t max_in_flight;
+	std::function<void(ByteBuffer &)> write_result;
+
+public:
+	// Constructor (results are handed to write_result in submission order)
+	EncodeQueue(std::function<void(ByteBuffer &)> input_write_result) : write_result(input_write_result)
+	{
+		this->max_in_flight = get_default_in_flight();
+		if (in_flight_limit() > 0)
+			this->max_in_flight = std::min(this->max_in_flight, in_flight_limit());
+	}
+
+	// Frames encoded at the same time by each queue (every one holds a copy of its frame)
+	static size_t get_default_in_flight() { return std::max(1u, std::min(8u, std::thread::hardware_concurrency())); }
+	static void limit_in_flight(size_t limit) { in_flight_limit() = limit; } // For the queues created afterwards (0 for no limit)
+
+	// Jobs
+	void submit(std::function<ByteBuffer()> job)
+	{
+		if (pending.size() >= max_in_flight)
+			write_next();
+		pending.push_back(std::async(std::launch::async, job));
+	}
+	void flush()
+	{
+		while (!pending.empty())
+			write_next();
+	}
+
+private:
+	static size_t &in_flight_limit()
+	{
+		static size_t limit = 0;
+		return limit;
+	}
+	void write_next()
+	{
+		ByteBuffer result = pending.front().get();
+		pending.pop_front();
+		write_result(result);
+	}
+};
+
+// --------- FRAME SINKS --------- //
+class FrameSink
+{
+public:
+	virtual ~FrameSink() {}
+
+	// Frames arrive in order, the image can be reused by the caller as soon as write_frame returns
+	virtual void write_frame(BasicImage &image, int frame_number) = 0;
+	virtual void finish() {}
+	virtual bool has_failed() { return false; } // Some output could not be written (checked after finish)
+
+	// Colors the frames are drawn with, before the first frame (for the indexed outputs)
+	virtual void add_palette_colors(std::vector<BasicColor> &) {}
+};
+
+// Frame handed over without copying its pixels, only valid during the callback
+struct FrameView
+{
+	const unsigned char *pixels;
+	int width, height, channels;
+	int stride; // Bytes per row
+	int frame_number;
+};
+
+class CallbackSink : public FrameSink
+{
+private:
+	std::function<void(FrameView &)> on_frame;
+	std::function<void()> on_finish;
+
+public:
+	// Constructors
+	CallbackSink(std::function<void(FrameView &)> input_on_frame) : on_frame(input_on_frame), on_finish(nullptr) {}
+	CallbackSink(std::function<void(FrameView &)> input_on_frame, std::function<void()> input_on_finish) : on_frame(input_on_frame), on_finish(input_on_finish) {}
+
+	// Output
+	void write_frame(BasicImage &image, int frame_number) override
+	{
+		FrameView view{image.get_pixels(), image.get_width(), image.get_height(), image.get_channels(), image.get_stride(), frame_number};
+		on_frame(view);
+	}
+	void finish() override
+	{
+		if (on_finish)
+			on_finish();
+	}
+};
+
+class PngSequenceSink : public FrameSink
+{
+private:
+	std::string output_prefix;
+	EncodeQueue queue;
+
+public:
+	// Constructor (frames are written to <output_prefix><frame_number>.png)
+	PngSequenceSink(std::string input_output_prefix) : output_prefix(input_output_prefix), queue([](ByteBuffer &) {}) {}
+
+	// Output
+	void write_frame(BasicImage &image, int frame_number) override
+	{
+		// The pixels are copied so that the caller can keep drawing while the frame is encoded
+		std::string filename = output_prefix + std::to_string(frame_number) + ".png";
+		int width = image.get_width(), height = image.get_height(), channels = image.get_channels(), stride = image.get_stride();
+		std::shared_ptr<ByteBuffer> pixels = std::make_shared<ByteBuffer>(image.get_pixels(), image.get_pixels() + (size_t)stride * height);
+
+		queue.submit([=]() {
+			PROFILE_SCOPE("png_encode");
+			stbi_write_png(filename.c_str(), width, height, channels, pixels->data(), stride);
+			PROFILE_COUNT(BYTES_ENCODED, (long long)std::filesystem::file_size(filename));
+			return ByteBuffer{};
+		});
+	}
+	void finish() override { queue.flush(); }
+};
+
+class IndexedPngSequenceSink : public FrameSink
+{
+private:
+	std::string output_prefix;
+	ColorPalette palette;
+	PngSequenceSink rgba_sink; // For the frames with more than 256 colors
+	int rgba_frames;
+	EncodeQueue queue;
+
+public:
+	// Constructor (frames are written to <output_prefix><frame_number>.png)
+	IndexedPngSequenceSink(std::string input_output_prefix) : output_prefix(input_output_prefix), rgba_sink(input_output_prefix), rgba_frames(0), queue([](ByteBuffer &) {}) {}
+
+	// Output
+	void add_palette_colors(std::vector<BasicColor> &colors) override { palette.add_brush_blends(colors); }
+	void write_frame(BasicImage &image, int frame_number) override
+	{
+		// Mapped to the palette here (it grows with the colors of each frame), compressed while the caller keeps drawing
+		int width = image.get_width(), height = image.get_height(), stride = image.get_stride();
+		std::shared_ptr<ByteBuffer> indices = std::make_shared<ByteBuffer>((size_t)width * height);
+		bool fits_palette = image.get_channels() == 4;
+		int palette_size = palette.count_colors();
+		{
+			PROFILE_SCOPE("palette_map");
+			for (int y = 0; y < height && fits_palette; y++)
+				fits_palette = palette.map_row(image.get_pixels() + (size_t)y * stride, width, indices->data() + (size_t)y * width);
+		}
+		if (!fits_palette)
+		{
+			palette.truncate(palette_size); // The colors of this frame would only fill up the palette for the next ones
+			rgba_frames++;
+			rgba_sink.write_frame(image, frame_number);
+			return;
+		}
+
+		std::string filename = output_prefix + std::to_string(frame_number) + ".png";
+		std::vector<uint32_t> colors = palette.get_colors();
+		queue.submit([=]() {
+			PROFILE_SCOPE("png_encode");
+			ByteBuffer png = encode_indexed_png(*indices, width, height, colors);
+			std::ofstream file{filename, std::ios::binary};
+			file.write((const char *)png.data(), png.size());
+			PROFILE_COUNT(BYTES_ENCODED, (long long)png.size());
+			return ByteBuffer{};
+		});
+	}
+	void finish() override
+	{
+		queue.flush();
+		rgba_sink.finish();
+		if (rgba_frames > 0)
+			printf("[WARNING] %i frames had more than %i colors and were written as RGBA PNGs\n", rgba_frames, ColorPalette::MAX_COLORS);
+	}
+};
+
+class ApngSink : public FrameSink
+{
+private:
+	std::string filename;
+	std::ofstream file;
+	int fps;
+	int width, height, channels;
+	int frames_written;
+	uint32_t sequence_number;
+	std::streampos actl_position;
+
+	// Previous frame, and the region drawn over its layer
+	ByteBuffer previous;
+	PixelRect previous_over_layer;
+	BasicImage *previous_layer;
+	long long previous_layer_modification;
+
+	EncodeQueue queue;
+
+public:
+	// Constructor
+	ApngSink(std::string input_filename, int input_fps) : filename(input_filename), fps(input_fps), width(0), height(0), channels(0), frames_written(0), sequence_number(0),
+														  previous_layer(nullptr), previous_layer_modification(-1), queue([this](ByteBuffer &chunks) { write_bytes(chunks); }) {}
+
+	// Output
+	void write_frame(BasicImage &image, int) override
+	{
+		PixelRect rect{0, 0, image.get_width(), image.get_height()};
+		PixelRect over_layer = image.get_bounds_over_layer();
+
+		if (frames_written == 0)
+			start_file(image);
+		else
+		{
+			// Outside of what was drawn over the (same) layer in both frames, nothing can have changed
+			PixelRect candidate = rect;
+			if (image.get_copied_layer() && image.get_copied_layer() == previous_layer && image.get_copied_layer_modification() == previous_layer_modification)
+			{
+				candidate = over_layer;
+				candidate.expand(previous_over_layer);
+			}
+			rect = find_changed_rect(image, previous.data(), candidate);
+			if (rect.is_empty())
+				rect = PixelRect{0, 0, 1, 1}; // Frames need at least one pixel
+		}
+
+		// Frame control chunk now, image data once compressed (sequence numbers are taken in order)
+		ByteBuffer fctl;
+		put_u32_be(fctl, sequence_number++);
+		put_u32_be(fctl, rect.get_width());
+		put_u32_be(fctl, rect.get_height());
+		put_u32_be(fctl, rect.x0);
+		put_u32_be(fctl, rect.y0);
+		put_u16_be(fctl, 1);
+		put_u16_be(fctl, (uint16_t)fps);
+		fctl.push_back(0); // APNG_DISPOSE_OP_NONE
+		fctl.push_back(0); // APNG_BLEND_OP_SOURCE
+
+		bool is_first = frames_written == 0;
+		uint32_t data_sequence = is_first ? 0 : sequence_number++;
+		std::shared_ptr<ByteBuffer> scanlines = std::make_shared<ByteBuffer>(extract_png_scanlines(image, rect));
+
+		queue.submit([=]() {
+			PROFILE_SCOPE("apng_encode");
+			ByteBuffer compressed = zlib_compress(*scanlines);
+
+			ByteBuffer chunks;
+			put_png_chunk(chunks, "fcTL", fctl.data(), fctl.size());
+			if (is_first)
+				put_png_chunk(chunks, "IDAT", compressed.data(), compressed.size());
+			else
+			{
+				ByteBuffer fdat;
+				put_u32_be(fdat, data_sequence);
+				fdat.insert(fdat.end(), compressed.begin(), compressed.end());
+				put_png_chunk(chunks, "fdAT", fdat.data(), fdat.size());
+			}
+			return chunks;
+		});
+
+		// Keeping this frame to compare the next one against
+		std::memcpy(previous.data(), image.get_pixels(), previous.size());
+		previous_over_layer = over_layer;
+		previous_layer = image.get_copied_layer();
+		previous_layer_modification = image.get_copied_layer_modification();
+		frames_written++;
+	}
+	void finish() override
+	{
+		if (frames_written == 0)
+			return;
+
+		queue.flush();
+		ByteBuffer iend;
+		put_png_chunk(iend, "IEND", nullptr, 0);
+		write_bytes(iend);
+
+		// Patching the number of frames, unknown when the animation control chunk was written
+		ByteBuffer actl_data;
+		put_u32_be(actl_data, frames_written);
+		put_u32_be(actl_data, 0); // Loop forever
+		ByteBuffer actl;
+		put_png_chunk(actl, "acTL", actl_data.data(), actl_data.size());
+		file.seekp(actl_position);
+		file.write((const char *)actl.data(), actl.size());
+		file.close();
+	}
+
+private:
+	void start_file(BasicImage &image)
+	{
+		width = image.get_width();
+		height = image.get_height();
+		channels = image.get_channels();
+		previous.assign((size_t)image.get_stride() * height, 0);
+
+		file.open(filename, std::ios::binary);
+		ByteBuffer header{0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+		ByteBuffer ihdr;
+		put_u32_be(ihdr, width);
+		put_u32_be(ihdr, height);
+		ihdr.push_back(8);				   // Bit depth
+		ihdr.push_back(channels == 4 ? 6 : 2); // RGBA or RGB
+		ihdr.push_back(0);
+		ihdr.push_back(0);
+		ihdr.push_back(0);
+		put_png_chunk(header, "IHDR", ihdr.data(), ihdr.size());
+		write_bytes(header);
+
+		actl_position = file.tellp();
+		ByteBuffer actl_data(8, 0);
+		ByteBuffer actl;
+		put_png_chunk(actl, "acTL", actl_data.data(), actl_data.size());
+		write_bytes(actl);
+	}
+	void write_bytes(ByteBuffer &bytes)
+	{
+		file.write((const char *)bytes.data(), bytes.size());
+		PROFILE_COUNT(BYTES_ENCODED, (long long)bytes.size());
+	}
+};
+
+class GifSink : public FrameSink
+{
+private:
+	std::string filename;
+	std::ofstream file;
+	int fps;
+	int frames_written;
+
+	// Previous frame, and the region drawn over its layer
+	ByteBuffer previous;
+	PixelRect previous_over_layer;
+	BasicImage *previous_layer;
+	long long previous_layer_modification;
+
+	EncodeQueue queue;
+
+public:
+	// Constructor
+	GifSink(std::string input_filename, int input_fps) : filename(input_filename), fps(input_fps), frames_written(0), previous_layer(nullptr), previous_layer_modification(-1),
+														 queue([this](ByteBuffer &block) { write_bytes(block); }) {}
+
+	// Output
+	void write_frame(BasicImage &image, int) override
+	{
+		PixelRect rect{0, 0, image.get_width(), image.get_height()};
+		PixelRect over_layer = image.get_bounds_over_layer();
+
+		if (frames_written == 0)
+			start_file(image);
+		else
+		{
+			PixelRect candidate = rect;
+			if (image.get_copied_layer() && image.get_copied_layer() == previous_layer && image.get_copied_layer_modification() == previous_layer_modification)
+			{
+				candidate = over_layer;
+				candidate.expand(previous_over_layer);
+			}
+			rect = find_changed_rect(image, previous.data(), candidate);
+			if (rect.is_empty())
+				rect = PixelRect{0, 0, 1, 1};
+		}
+
+		// GIF has no partial alpha, frames are flattened onto black
+		std::shared_ptr<ByteBuffer> rgb = std::make_shared<ByteBuffer>();
+		rgb->reserve((size_t)rect.get_width() * rect.get_height() * 3);
+		int channels = image.get_channels();
+		for (int y = rect.y0; y < rect.y1; y++)
+		{
+			unsigned char *row = image.get_pixels() + (size_t)y * image.get_stride();
+			for (int x = rect.x0; x < rect.x1; x++)
+			{
+				unsigned char *p = row + (size_t)x * channels;
+				int alpha = channels == 4 ? p[3] : 255;
+				for (int c = 0; c < 3; c++)
+					rgb->push_back((unsigned char)(p[c] * alpha / 255));
+			}
+		}
+
+		int delay = (int)(100.0 / fps + 0.5);
+		queue.submit([=]() {
+			PROFILE_SCOPE("gif_encode");
+			return encode_gif_frame(*rgb, rect, delay);
+		});
+
+		std::memcpy(previous.data(), image.get_pixels(), previous.size());
+		previous_over_layer = over_layer;
+		previous_layer = image.get_copied_layer();
+		previous_layer_modification = image.get_copied_layer_modification();
+		frames_written++;
+	}
+	void finish() override
+	{
+		if (frames_written == 0)
+			return;
+
+		queue.flush();
+		ByteBuffer trailer{0x3B};
+		write_bytes(trailer);
+		file.close();
+	}
+
+	// Encoding
+	static ByteBuffer encode_gif_frame(ByteBuffer &rgb, PixelRect rect, int delay)
+	{
+		// Palette: the exact colors when there are 256 at most, a 6x7x6 color cube otherwise
+		std::vector<uint32_t> palette;
+		std::unordered_map<uint32_t, unsigned char> palette_index;
+		size_t pixel_count = rgb.size() / 3;
+		for (size_t i = 0; i < pixel_count && palette.size() <= 256; i++)
+		{
+			uint32_t color = (rgb[i * 3] << 16) | (rgb[i * 3 + 1] << 8) | rgb[i * 3 + 2];
+			if (palette_index.find(color) == palette_index.end())
+			{
+				palette_index[color] = (unsigned char)palette.size();
+				palette.push_back(color);
+			}
+		}
+		bool exact = palette.size() <= 256;
+		if (!exact)
+		{
+			palette.clear();
+			for (int r = 0; r < 6; r++)
+				for (int g = 0; g < 7; g++)
+					for (int b = 0; b < 6; b++)
+						palette.push_back(((r * 255 / 5) << 16) | ((g * 255 / 6) << 8) | (b * 255 / 5));
+		}
+
+		ByteBuffer indices(pixel_count);
+		for (size_t i = 0; i < pixel_count; i++)
+		{
+			if (exact)
+				indices[i] = palette_index[(rgb[i * 3] << 16) | (rgb[i * 3 + 1] << 8) | rgb[i * 3 + 2]];
+			else
+				indices[i] = (unsigned char)(((rgb[i * 3] * 5 + 127) / 255) * 42 + ((rgb[i * 3 + 1] * 6 + 127) / 255) * 6 + (rgb[i * 3 + 2] * 5 + 127) / 255);
+		}
+
+		int table_bits = 1;
+		while ((1 << table_bits) < (int)palette.size())
+			table_bits++;
+
+		ByteBuffer out;
+		// Graphic control extension (no disposal: later frames only cover what changed)
+		out.insert(out.end(), {0x21, 0xF9, 0x04, 0x04});
+		put_u16_le(out, (uint16_t)delay);
+		out.insert(out.end(), {0x00, 0x00});
+
+		// Image descriptor with a local color table
+		out.push_back(0x2C);
+		put_u16_le(out, (uint16_t)rect.x0);
+		put_u16_le(out, (uint16_t)rect.y0);
+		put_u16_le(out, (uint16_t)rect.get_width());
+		put_u16_le(out, (uint16_t)rect.get_height());
+		out.push_back((unsigned char)(0x80 | (table_bits - 1)));
+		for (int i = 0; i < (1 << table_bits); i++)
+		{
+			uint32_t color = i < (int)palette.size() ? palette[i] : 0;
+			out.push_back((unsigned char)(color >> 16));
+			out.push_back((unsigned char)(color >> 8));
+			out.push_back((unsigned char)color);
+		}
+
+		int min_code_size = std::max(2, table_bits);
+		out.push_back((unsigned char)min_code_size);
+		ByteBuffer lzw = lzw_compress(indices, min_code_size);
+		for (size_t i = 0; i < lzw.size(); i += 255)
+		{
+			size_t block = std::min((size_t)255, lzw.size() - i);
+			out.push_back((unsigned char)block);
+			out.insert(out.end(), lzw.begin() + i, lzw.begin() + i + block);
+		}
+		out.push_back(0);
+		return out;
+	}
+	static ByteBuffer lzw_compress(ByteBuffer &indices, int min_code_size)
+	{
+		ByteBuffer out;
+		uint32_t bit_buffer = 0;
+		int bit_count = 0;
+		auto put_code = [&](int code, int size) {
+			bit_buffer |= (uint32_t)code << bit_count;
+			bit_count += size;
+			while (bit_count >= 8)
+			{
+				out.push_back((unsigned char)bit_buffer);
+				bit_buffer >>= 8;
+				bit_count -= 8;
+			}
+		};
+
+		const int clear_code = 1 << min_code_size;
+		int code_size = min_code_size + 1;
+		int max_code = clear_code + 1;
+		std::unordered_map<uint32_t, int> dictionary; // (prefix code << 8 | index) -> code
+		dictionary.reserve(4096);
+
+		put_code(clear_code, code_size);
+		if (indices.empty())
+		{
+			put_code(clear_code + 1, code_size);
+			return out;
+		}
+
+		int current = indices[0];
+		for (size_t i = 1; i < indices.size(); i++)
+		{
+			uint32_t key = ((uint32_t)current << 8) | indices[i];
+			auto found = dictionary.find(key);
+			if (found != dictionary.end())
+			{
+				current = found->second;
+				continue;
+			}
+
+			put_code(current, code_size);
+			dictionary[key] = ++max_code;
+			if (max_code >= (1 << code_size))
+				code_size++;
+			if (max_code == 4095)
+			{
+				put_code(clear_code, code_size);
+				dictionary.clear();
+				code_size = min_code_size + 1;
+				max_code = clear_code + 1;
+			}
+			current = indices[i];
+		}
+		put_code(current, code_size);
+		put_code(clear_code + 1, code_size);
+		if (bit_count > 0)
+			out.push_back((unsigned char)bit_buffer);
+		return out;
+	}
+
+private:
+	void start_file(BasicImage &image)
+	{
+		previous.assign((size_t)image.get_stride() * image.get_height(), 0);
+
+		file.open(filename, std::ios::binary);
+		ByteBuffer header{'G', 'I', 'F', '8', '9', 'a'};
+		put_u16_le(header, (uint16_t)image.get_width());
+		put_u16_le(header, (uint16_t)image.get_height());
+		header.insert(header.end(), {0x00, 0x00, 0x00}); // No global color table
+
+		// Looping forever (NETSCAPE2.0 application extension)
+		header.insert(header.end(), {0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00});
+		write_bytes(header);
+	}
+	void write_bytes(ByteBuffer &bytes)
+	{
+		file.write((const char *)bytes.data(), bytes.size());
+		PROFILE_COUNT(BYTES_ENCODED, (long long)bytes.size());
+	}
+};
+
+// --------- FRAME ARCHIVE --------- //
+// Every frame as a PNG file, one after another in a single file, with an index at the end to reach any frame without reading the others:
+//   "OBJRFRAM" | PNG files | per frame: name length (u16), name, offset (u64), size (u64) | index offset (u64), frame count (u32), "OBJRINDX"
+// Numbers are little-endian, offsets from the start of the archive
+struct FrameArchiveEntry
+{
+	std::string name; // As written by the PNG sequence output (<stem>_<frame_number>.png)
+	uint64_t offset, size;
+};
+
+class FrameArchiveSink : public FrameSink
+{
+private:
+	std::string filename;
+	std::string entry_prefix;
+	std::ofstream file;
+	ByteBuffer batch; // Bytes not written to the file yet
+	uint64_t archive_size;
+	bool failed; // Once set, nothing more is encoded or written
+	std::vector<FrameArchiveEntry> entries;
+	std::deque<std::string> pending_names; // Of the frames being encoded, in order
+	EncodeQueue queue;
+
+	// The file is written in a few big writes (frames are a few tens of KB each)
+	static const size_t WRITE_BATCH_BYTES = 8 << 20;
+
+public:
+	static constexpr const char *MAGIC = "OBJRFRAM";
+	static constexpr const char *INDEX_MAGIC = "OBJRINDX";
+	static const int TRAILER_BYTES = 20;
+
+	// Constructor (frames are stored as <entry_prefix><frame_number>.png)
+	FrameArchiveSink(std::string input_filename, std::string input_entry_prefix) : filename(input_filename), entry_prefix(input_entry_prefix), archive_size(0), failed(false),
+																				   queue([this](ByteBuffer &png) { append_frame(png); })
+	{
+		file.open(input_filename, std::ios::binary);
+		if (!file.is_open())
+		{
+			std::cerr << "[ERROR] Could not create the frame archive: " << input_filename << std::endl;
+			failed = true;
+			return;
+		}
+		ByteBuffer header{MAGIC, MAGIC + 8};
+		append(header);
+	}
+
+	// Output
+	void write_frame(BasicImage &image, int frame_number) override
+	{
+		// The pixels are copied so that the caller can keep drawing while the frame is encoded
+		if (failed)
+			return;
+		int width = image.get_width(), height = image.get_height(), channels = image.get_channels(), stride = image.get_stride();
+		std::shared_ptr<ByteBuffer> pixels = std::make_shared<ByteBuffer>(image.get_pixels(), image.get_pixels() + (size_t)stride * height);
+
+		pending_names.push_back(entry_prefix + std::to_string(frame_number) + ".png");
+		queue.submit([=]() {
+			PROFILE_SCOPE("png_encode");
+			int png_length = 0;
+			unsigned char *png = stbi_write_png_to_mem(pixels->data(), stride, width, height, channels, &png_length);
+			if (!png)
+				return ByteBuffer{}; // Reported when appended
+			ByteBuffer bytes{png, png + png_length};
+			STBIW_FREE(png);
+			return bytes;
+		});
+	}
+	void finish() override
+	{
+		queue.flush();
+		if (failed)
+			return;
+
+		uint64_t index_offset = archive_size;
+		ByteBuffer index;
+		for (FrameArchiveEntry &entry : entries)
+		{
+			put_u16_le(index, (uint16_t)entry.name.size());
+			index.insert(index.end(), entry.name.begin(), entry.name.end());
+			put_u64_le(index, entry.offset);
+			put_u64_le(index, entry.size);
+		}
+		put_u64_le(index, index_offset);
+		put_u32_le(index, (uint32_t)entries.size());
+		index.insert(index.end(), INDEX_MAGIC, INDEX_MAGIC + 8);
+		append(index);
+
+		write_batch();
+		file.close();
+		if (!file)
+			fail("could not be closed");
+	}
+	bool has_failed() override { return this->failed; }
+
+private:
+	void fail(std::string reason)
+	{
+		if (!failed)
+			std::cerr << "[ERROR] The frame archive " << filename << " " << reason << "!" << std::endl;
+		failed = true;
+	}
+	void append_frame(ByteBuffer &png)
+	{
+		if (failed)
+			return;
+		if (png.empty())
+		{
+			fail("is missing a frame that could not be encoded");
+			return;
+		}
+		entries.push_back(FrameArchiveEntry{pending_names.front(), archive_size, png.size()});
+		pending_names.pop_front();
+		PROFILE_COUNT(BYTES_ENCODED, (long long)png.size());
+		append(png);
+	}
+	void append(ByteBuffer &bytes)
+	{
+		batch.insert(batch.end(), bytes.begin(), bytes.end());
+		archive_size += bytes.size();
+		if (batch.size() >= WRITE_BATCH_BYTES)
+			write_batch();
+	}
+	void write_batch()
+	{
+		if (!file.write((const char *)batch.data(), batch.size()))
+			fail("could not be written");
+		batch.clear();
+	}
+};
+
+class FrameArchiveReader
+{
+private:
+	std::ifstream file;
+	std::vector<FrameArchiveEntry> entries;
+	std::string error; // Empty for a valid archive
+
+public:
+	// Constructor (only the index is read)
+	FrameArchiveReader(std::string filename) : file(filename, std::ios::binary) { this->error = read_index(); }
+
+	// Get
+	bool is_valid() { return this->error.empty(); }
+	std::string get_error() { return this->error; }
+	std::vector<FrameArchiveEntry> &get_entries() { return this->entries; }
+
+	// Frames
+	bool read_frame(size_t entry_index, ByteBuffer &png)
+	{
+		// False when the frame could not be read whole
+		FrameArchiveEntry &entry = entries[entry_index];
+		png.resize(entry.size);
+		file.clear();
+		file.seekg((std::streamoff)entry.offset);
+		file.read((char *)png.data(), (std::streamsize)png.size());
+		return (bool)file;
+	}
+
+private:
+	std::string read_index()
+	{
+		if (!file.is_open())
+			return "the file could not be opened";
+		file.seekg(0, std::ios::end);
+		uint64_t archive_size = (uint64_t)file.tellg();
+		if (archive_size < 8 + FrameArchiveSink::TRAILER_BYTES)
+			return "too small to be a frame archive";
+
+		unsigned char magic[8], trailer[FrameArchiveSink::TRAILER_BYTES];
+		file.seekg(0);
+		file.read((char *)magic, 8);
+		file.seekg((std::streamoff)(archive_size - FrameArchiveSink::TRAILER_BYTES));
+		file.read((char *)trailer, FrameArchiveSink::TRAILER_BYTES);
+		if (!file || std::memcmp(magic, FrameArchiveSink::MAGIC, 8) != 0 || std::memcmp(trailer + 12, FrameArchiveSink::INDEX_MAGIC, 8) != 0)
+			return "not a frame archive (or not completely written)";
+
+		uint64_t index_offset = get_uint_le(trailer, 8);
+		uint64_t frame_count = get_uint_le(trailer + 8, 4);
+		if (index_offset < 8 || index_offset > archive_size - FrameArchiveSink::TRAILER_BYTES)
+			return "corrupted index";
+		ByteBuffer index(archive_size - FrameArchiveSink::TRAILER_BYTES - index_offset);
+		file.seekg((std::streamoff)index_offset);
+		file.read((char *)index.data(), (std::streamsize)index.size());
+
+		size_t position = 0;
+		for (uint64_t i = 0; i < frame_count; i++)
+		{
+			if (position + 2 > index.size())
+				return "corrupted index";
+			size_t name_length = (size_t)get_uint_le(&index[position], 2);
+			if (position + 2 + name_length + 16 > index.size())
+				return "corrupted index";
+			FrameArchiveEntry entry;
+			entry.name.assign((const char *)&index[position + 2], name_length);
+			entry.offset = get_uint_le(&index[position + 2 + name_length], 8);
+			entry.size = get_uint_le(&index[position + 2 + name_length + 8], 8);
+			if (entry.offset < 8 || entry.offset + entry.size > index_offset || entry.name.find_first_of("/\\") != std::string::npos)
+				return "corrupted index";
+			entries.push_back(entry);
+			position += 2 + name_length + 16;
+		}
+		return "";
+	}
+};
+
+int extract_frame_archive(std::string archive_path, std::string output_folder)
+{
+	// Writes the frames as the PNG sequence output does (output folder by default: the archive path without its extension)
+	FrameArchiveReader archive{archive_path};
+	if (!archive.is_valid())
+	{
+		std::cerr << "[ERROR] Could not read " << archive_path << ": " << archive.get_error() << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (output_folder.empty())
+		output_folder = (std::filesystem::path{archive_path}.parent_path() / std::filesystem::path{archive_path}.stem()).string();
+	std::error_code error;
+	std::filesystem::create_directories(output_folder, error);
+	if (error)
+	{
+		std::cerr << "[ERROR] Could not create " << output_folder << ": " << error.message() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::vector<FrameArchiveEntry> &entries = archive.get_entries();
+	ByteBuffer png;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (!archive.read_frame(i, png))
+		{
+			std::cerr << "[ERROR] Could not read " << entries[i].name << " from " << archive_path << std::endl;
+			return EXIT_FAILURE;
+		}
+		std::string frame_path = (std::filesystem::path{output_folder} / entries[i].name).string();
+		std::ofstream frame_file{frame_path, std::ios::binary};
+		frame_file.write((const char *)png.data(), (std::streamsize)png.size());
+		frame_file.close();
+		if (!frame_file)
+		{
+			std::cerr << "[ERROR] Could not write " << frame_path << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	printf("[INFO] %i frames extracted to %s\n", (int)entries.size(), output_folder.c_str());
+	return 0;
+}
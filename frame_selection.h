@@ -0,0 +1,306 @@
+#pragma once
+/*
+ * Author: Jaime Rivera
+ * Date : 2020.04.20
+ * Copyright : Copyright 2020 Jaime Rivera | www.jaimervq.com
+ * Brief: Selection of the frames of a turntable to render (ranges, steps and shards), and the manifests of the shards
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+// --------- FRAME SELECTION --------- //
+class FrameSelection
+{
+private:
+	int first_frame, last_frame; // Both included, -1 for the last frame of the turntable
+	int step;
+	int shard_index, shard_count;
+
+public:
+	// Constructor
+	FrameSelection() : first_frame(0), last_frame(-1), step(1), shard_index(0), shard_count(1) {}
+
+	// Parsing ("a:b", "n" and "i/n")
+	bool parse_frames(std::string text)
+	{
+		size_t colon = text.find(':');
+		if (colon == std::string::npos)
+			return false;
+		try
+		{
+			this->first_frame = colon == 0 ? 0 : std::stoi(text.substr(0, colon));
+			this->last_frame = colon == text.size() - 1 ? -1 : std::stoi(text.substr(colon + 1));
+		}
+		catch (...)
+		{
+			return false;
+		}
+		return first_frame >= 0 && (last_frame == -1 || last_frame >= first_frame);
+	}
+	bool parse_every(std::string text)
+	{
+		try
+		{
+			this->step = std::stoi(text);
+		}
+		catch (...)
+		{
+			return false;
+		}
+		return step >= 1;
+	}
+	bool parse_shard(std::string text)
+	{
+		size_t slash = text.find('/');
+		if (slash == std::string::npos)
+			return false;
+		try
+		{
+			this->shard_index = std::stoi(text.substr(0, slash));
+			this->shard_count = std::stoi(text.substr(slash + 1));
+		}
+		catch (...)
+		{
+			return false;
+		}
+		return shard_count >= 1 && shard_index >= 0 && shard_index < shard_count;
+	}
+
+	// Get
+	int get_first_frame() { return this->first_frame; }
+	int get_last_frame() { return this->last_frame; }
+	int get_step() { return this->step; }
+	int get_shard_index() { return this->shard_index; }
+	int get_shard_count() { return this->shard_count; }
+	bool is_partial() { return first_frame != 0 || last_frame != -1 || step != 1 || shard_count != 1; }
+	std::string describe()
+	{
+		return std::to_string(first_frame) + ":" + (last_frame == -1 ? "" : std::to_string(last_frame)) + " every " + std::to_string(step);
+	}
+
+	// Frames
+	std::vector<int> get_selected_frames(int total_frames)
+	{
+		// Frames of the whole job (all shards together)
+		std::vector<int> frames;
+		int last = last_frame == -1 ? total_frames - 1 : std::min(last_frame, total_frames - 1);
+		for (int frame = first_frame; frame <= last; frame += step)
+			frames.push_back(frame);
+		return frames;
+	}
+	std::vector<int> get_shard_frames(int total_frames)
+	{
+		// Consecutive blocks of the selected frames, so that every shard can encode deltas between its frames
+		std::vector<int> selected = get_selected_frames(total_frames);
+		size_t begin = selected.size() * shard_index / shard_count;
+		size_t end = selected.size() * (shard_index + 1) / shard_count;
+		return std::vector<int>(selected.begin() + begin, selected.begin() + end);
+	}
+};
+
+// --------- SHARD MANIFEST --------- //
+struct ShardManifestEntry
+{
+	int frame;
+	std::string file;
+	long long bytes;
+};
+
+class ShardManifest
+{
+private:
+	std::string obj_filename;
+	std::string output_parent;
+	int rpm, fps, total_frames;
+	FrameSelection selection;
+	std::vector<ShardManifestEntry> entries;
+
+public:
+	// Constructor
+	ShardManifest(std::string input_obj_filename, std::string input_output_parent, int input_rpm, int input_fps, int input_total_frames, FrameSelection input_selection)
+		: obj_filename(input_obj_filename), output_parent(input_output_parent), rpm(input_rpm), fps(input_fps), total_frames(input_total_frames), selection(input_selection) {}
+
+	// Naming
+	static std::string get_filename(std::string output_parent, std::string obj_stem, int shard_index, int shard_count)
+	{
+		return output_parent + obj_stem + "_shard_" + std::to_string(shard_index) + "_of_" + std::to_string(shard_count) + ".json";
+	}
+	static bool is_filename_of(std::string name, std::string obj_stem)
+	{
+		// Whether the name is exactly <obj_stem>_shard_<i>_of_<n>.json (so "a" does not pick up the shards of "a_shard_x")
+		std::string prefix = obj_stem + "_shard_";
+		if (name.rfind(prefix, 0) != 0)
+			return false;
+		size_t pos = prefix.size();
+		auto skip_digits = [&]()
+		{
+			size_t start = pos;
+			while (pos < name.size() && std::isdigit((unsigned char)name[pos]))
+				pos++;
+			return pos > start;
+		};
+		if (!skip_digits() || name.compare(pos, 4, "_of_") != 0)
+			return false;
+		pos += 4;
+		return skip_digits() && name.compare(pos, std::string::npos, ".json") == 0;
+	}
+
+	// Entries (files relative to the output parent folder)
+	void add_file(int frame, std::string file)
+	{
+		std::error_code error;
+		long long bytes = (long long)std::filesystem::file_size(output_parent + file, error);
+		entries.push_back(ShardManifestEntry{frame, file, error ? -1 : bytes});
+	}
+
+	// Write to file (one entry per line, so it can be read back without a JSON parser)
+	void to_file(std::string filename)
+	{
+		std::ofstream f{filename};
+		f << "{\n";
+		f << "  \"obj\": \"" << obj_filename << "\",\n";
+		f << "  \"job\": {\"rpm\": " << rpm << ", \"fps\": " << fps << ", \"total_frames\": " << total_frames << ", \"first_frame\": " << selection.get_first_frame() << ", \"last_frame\": " << selection.get_last_frame()
+		  << ", \"every\": " << selection.get_step() << ", \"shard_index\": " << selection.get_shard_index() << ", \"shard_count\": " << selection.get_shard_count() << "},\n";
+		f << "  \"files\": [\n";
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			f << "    {\"frame\": " << entries[i].frame << ", \"file\": \"" << entries[i].file << "\", \"bytes\": " << entries[i].bytes << "}"
+			  << (i + 1 < entries.size() ? ",\n" : "\n");
+		}
+		f << "  ]\n";
+		f << "}\n";
+	}
+};
+
+// --------- SHARDS MERGE CHECK --------- //
+bool read_manifest_number(std::string line, std::string key, long long &value)
+{
+	// False when the key is missing or is not followed by a number
+	size_t pos = line.find("\"" + key + "\": ");
+	if (pos == std::string::npos)
+		return false;
+	const char *start = line.c_str() + pos + key.size() + 4;
+	char *end = nullptr;
+	errno = 0;
+	value = std::strtoll(start, &end, 10);
+	return end != start && errno == 0;
+}
+std::string read_manifest_string(std::string line, std::string key)
+{
+	size_t pos = line.find("\"" + key + "\": \"");
+	if (pos == std::string::npos)
+		return "";
+	pos += key.size() + 5;
+	return line.substr(pos, line.find('"', pos) - pos);
+}
+bool verify_shard_manifests(std::string output_parent, std::string obj_stem)
+{
+	// Checks that the manifests of all shards of a job are there, agree on the job, and that every frame of it was written
+	std::vector<std::string> manifests;
+	std::filesystem::path parent = output_parent.empty() ? "." : output_parent;
+	for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(parent))
+	{
+		std::string name = entry.path().filename().string();
+		if (ShardManifest::is_filename_of(name, obj_stem))
+			manifests.push_back(entry.path().string());
+	}
+	if (manifests.empty())
+	{
+		std::cerr << "[ERROR] No shard manifests found for " << obj_stem << "!" << std::endl;
+		return false;
+	}
+
+	bool valid = true;
+	std::string job;
+	int shard_count = -1;
+	int total_frames = 0;
+	FrameSelection selection;
+	std::set<int> shards_found;
+	std::set<int> frames_found;
+	for (std::string &manifest : manifests)
+	{
+		std::ifstream f{manifest};
+		std::string line;
+		while (std::getline(f, line))
+		{
+			if (line.find("\"job\": ") != std::string::npos)
+			{
+				long long job_total_frames, job_shard_count, shard_index, first_frame, last_frame, every;
+				if (!read_manifest_number(line, "total_frames", job_total_frames) || !read_manifest_number(line, "shard_count", job_shard_count) ||
+					!read_manifest_number(line, "shard_index", shard_index) || !read_manifest_number(line, "first_frame", first_frame) ||
+					!read_manifest_number(line, "last_frame", last_frame) || !read_manifest_number(line, "every", every))
+				{
+					std::cerr << "[ERROR] " << manifest << " is not a valid shard manifest!" << std::endl;
+					valid = false;
+					continue;
+				}
+
+				std::string this_job = line.substr(0, line.find("\"shard_index\""));
+				if (!job.empty() && this_job != job)
+				{
+					std::cerr << "[ERROR] " << manifest << " belongs to a different job!" << std::endl;
+					valid = false;
+				}
+				job = this_job;
+				total_frames = (int)job_total_frames;
+				shard_count = (int)job_shard_count;
+				selection.parse_frames(std::to_string(first_frame) + ":" + (last_frame == -1 ? "" : std::to_string(last_frame)));
+				selection.parse_every(std::to_string(every));
+				if (!shards_found.insert((int)shard_index).second)
+				{
+					std::cerr << "[ERROR] Shard " << shard_index << " has more than one manifest!" << std::endl;
+					valid = false;
+				}
+			}
+			else if (line.find("\"frame\": ") != std::string::npos)
+			{
+				long long frame, bytes;
+				if (!read_manifest_number(line, "frame", frame) || !read_manifest_number(line, "bytes", bytes))
+				{
+					std::cerr << "[ERROR] " << manifest << " is not a valid shard manifest!" << std::endl;
+					valid = false;
+					continue;
+				}
+
+				std::string file = read_manifest_string(line, "file");
+				std::error_code error;
+				if (bytes < 0 || (long long)std::filesystem::file_size(output_parent + file, error) != bytes || error)
+				{
+					std::cerr << "[ERROR] Missing or incomplete frame file: " << file << std::endl;
+					valid = false;
+				}
+				frames_found.insert((int)frame);
+			}
+		}
+	}
+
+	for (int shard = 0; shard < shard_count; shard++)
+	{
+		if (!shards_found.count(shard))
+		{
+			std::cerr << "[ERROR] The manifest of shard " << shard << "/" << shard_count << " is missing!" << std::endl;
+			valid = false;
+		}
+	}
+	int missing_frames = 0;
+	for (int frame : selection.get_selected_frames(total_frames))
+		missing_frames += frames_found.count(frame) ? 0 : 1;
+	if (missing_frames > 0)
+	{
+		std::cerr << "[ERROR] " << missing_frames << " frames of the job are missing!" << std::endl;
+		valid = false;
+	}
+
+	if (valid)
+		printf("[INFO] All %i shards are complete: %i frames (%s) of %i\n", shard_count, (int)frames_found.size(), selection.describe().c_str(), total_frames);
+	return valid;
+}
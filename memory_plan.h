@@ -0,0 +1,290 @@
+#pragma once
+/*
+ * Author: Jaime Rivera
+ * Date : 2020.04.20
+ * Copyright : Copyright 2020 Jaime Rivera | www.jaimervq.com
+ * Brief: Memory planning of the render jobs: the peak memory estimated from a pre-scan of the OBJ file, the options picked to fit a limit, and the peak RSS measured
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define OBJ_RENDERER_HAS_RUSAGE
+#endif
+
+#include "basic_obj_reader.h"
+#include "drawing_utils.h"
+#include "frame_buffer.h"
+#include "frame_output.h"
+#include "turntable.h"
+
+// --------- PEAK MEMORY --------- //
+size_t read_peak_rss_bytes()
+{
+	// Peak resident set size of the process so far (0 where it can not be read)
+#ifdef OBJ_RENDERER_HAS_RUSAGE
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#if defined(__APPLE__)
+	return (size_t)usage.ru_maxrss; // Bytes on macOS
+#else
+	return (size_t)usage.ru_maxrss * 1024; // Kilobytes elsewhere
+#endif
+#else
+	return 0;
+#endif
+}
+
+// --------- MEMORY PLAN --------- //
+class MemoryPlan
+{
+private:
+	size_t limit_bytes;
+	ObjCounts counts;
+	bool welded, has_adjacency;
+
+	// Picked to fit the limit
+	bool compact_mesh;
+	bool release_faces; // Once the edges and their adjacency are extracted
+	int encodes_in_flight; // 0 when nothing is encoded in the background (contact sheets and posters)
+
+	// Estimates (bytes)
+	size_t loading_bytes;		   // Peak while parsing and extracting the edges
+	size_t frame_bytes;			   // Framebuffers, backplates and previous frames, for all resolutions
+	size_t encode_bytes;		   // Of one frame encoded at every resolution
+	size_t poster_bytes;		   // Drawn tiles and the strip being written
+	double poster_drawn_share;	   // Of the tiles of the poster
+	size_t full_mesh_bytes;		   // Faces excluded
+	size_t faces_bytes;
+	size_t compact_mesh_bytes;	   // Replaces the full precision edges
+	size_t compacting_bytes;	   // Released once the compact mesh is built
+	size_t adjacency_bytes;		   // Normals, feature and smooth edges
+	size_t projected_lines_bytes;  // Rebuilt for every frame
+
+	// Code, libraries and stacks, an entry of the hash maps (node, buckets and the copy of the buckets while rehashing), and the allocator overhead
+	static const size_t PROCESS_BYTES = 8 * 1024 * 1024;
+	static const size_t HASH_ENTRY_BYTES = 56;
+	static constexpr double ALLOCATION_MARGIN = 1.15;
+	static constexpr double POSTER_FREE_DRAWN_SHARE = 0.5; // Of the tiles the backplate grid does not reach (the OBJ, the cross, the circle and the overlay)
+
+public:
+	// Constructor (picks the options, the job is only changed by apply)
+	MemoryPlan(TurntableJob &job, ObjCounts input_counts, size_t input_limit_bytes) : limit_bytes(input_limit_bytes), counts(input_counts), welded(job.weld_tolerance > 0.0),
+																					 has_adjacency(job.options.edges_mode == "features"), compact_mesh(job.compact_mesh), release_faces(true),
+																					 encodes_in_flight((int)EncodeQueue::get_default_in_flight()), poster_bytes(0), poster_drawn_share(0.0)
+	{
+		estimate_mesh();
+		estimate_frames(job);
+
+		// Cheapest first: fewer frames encoded at once only costs speed, a compact mesh costs some precision
+		while (estimate_peak_bytes() > limit_bytes && encodes_in_flight > 2)
+			encodes_in_flight--;
+		if (estimate_peak_bytes() > limit_bytes && !compact_mesh)
+		{
+			size_t full_precision_bytes = estimate_peak_bytes();
+			compact_mesh = true;
+			compact_mesh = estimate_peak_bytes() < full_precision_bytes / 20 * 19; // Not for a few percent, when the frames take most of the memory
+		}
+		while (estimate_peak_bytes() > limit_bytes && encodes_in_flight > 1)
+			encodes_in_flight--;
+	}
+
+	// Get
+	bool fits() { return estimate_peak_bytes() <= limit_bytes; }
+	ObjCounts &get_counts() { return this->counts; }
+	bool is_compact() { return this->compact_mesh; }
+	bool releases_faces() { return this->release_faces; }
+	size_t estimate_resident_mesh_bytes()
+	{
+		size_t mesh = (compact_mesh ? compact_mesh_bytes : full_mesh_bytes) + adjacency_bytes;
+		return with_margin(mesh + (release_faces || compact_mesh ? 0 : faces_bytes));
+	}
+	size_t estimate_peak_bytes()
+	{
+		size_t rendering = estimate_resident_mesh_bytes() + projected_lines_bytes + frame_bytes + encodes_in_flight * encode_bytes + poster_bytes;
+		size_t compacting = compact_mesh ? with_margin(full_mesh_bytes + faces_bytes + adjacency_bytes + compact_mesh_bytes + compacting_bytes) : 0; // Before the full mesh is released
+		return PROCESS_BYTES + std::max({loading_bytes, compacting, rendering});
+	}
+
+	// Plan
+	void apply(TurntableJob &job)
+	{
+		// Before the sinks are created and the mesh is loaded (with the counts, and then ObjReader::release_faces when releases_faces)
+		job.compact_mesh = compact_mesh;
+		EncodeQueue::limit_in_flight((size_t)encodes_in_flight);
+	}
+	void log(TurntableJob &job)
+	{
+		printf("[INFO] Memory plan for %lli vertices and %lli faces: about %.1f MB at peak, limit %.1f MB\n", counts.vertices, counts.faces, to_mb(estimate_peak_bytes()), to_mb(limit_bytes));
+		printf("[INFO] Memory plan: loading %.1f MB, resident mesh %.1f MB (%s%s), frames %.1f MB, %i px tiles\n", to_mb(loading_bytes), to_mb(estimate_resident_mesh_bytes()),
+			   compact_mesh ? "compact" : "full precision", release_faces && !compact_mesh ? ", faces released" : "", to_mb(frame_bytes), BasicImage::TILE_SIZE);
+		if (encodes_in_flight > 0)
+			printf("[INFO] Memory plan: frames encoded at once: %i of %i, %.1f MB each\n", encodes_in_flight, (int)EncodeQueue::get_default_in_flight(), to_mb(encode_bytes));
+		if (compact_mesh && !job.compact_mesh)
+			printf("[WARNING] Memory plan: the mesh is kept compact (as with --compact) to fit the memory limit\n");
+		if (poster_bytes > 0)
+			printf("[INFO] Memory plan: poster tiles %.1f MB (%.0f%% of them drawn)\n", to_mb(poster_bytes), poster_drawn_share * 100.0);
+		if (!fits())
+			printf("[WARNING] Memory plan: about %.1f MB needed at least, mostly %s, over the limit of %.1f MB\n", to_mb(estimate_peak_bytes()),
+				   loading_bytes + PROCESS_BYTES >= estimate_peak_bytes() ? "to load the mesh" : "to render", to_mb(limit_bytes));
+	}
+	bool check_peak_rss()
+	{
+		// After the render: false when the process went over the plan or the limit
+		size_t peak = read_peak_rss_bytes();
+		if (peak == 0)
+		{
+			printf("[WARNING] Peak memory can not be measured on this platform\n");
+			return true;
+		}
+		if (peak > limit_bytes)
+			printf("[WARNING] Peak memory: %.1f MB, over the limit of %.1f MB (planned about %.1f MB)\n", to_mb(peak), to_mb(limit_bytes), to_mb(estimate_peak_bytes()));
+		else if (peak > estimate_peak_bytes())
+			printf("[WARNING] Peak memory: %.1f MB, over the planned %.1f MB (limit %.1f MB)\n", to_mb(peak), to_mb(estimate_peak_bytes()), to_mb(limit_bytes));
+		else
+			printf("[INFO] Peak memory: %.1f MB (planned about %.1f MB, limit %.1f MB)\n", to_mb(peak), to_mb(estimate_peak_bytes()), to_mb(limit_bytes));
+		return peak <= limit_bytes && peak <= estimate_peak_bytes();
+	}
+
+private:
+	// Estimates
+	void estimate_mesh()
+	{
+		// From the containers of ObjReader, closed meshes sharing every edge between two faces
+		size_t vertices = (size_t)counts.vertices, faces = (size_t)counts.faces, corners = (size_t)counts.face_corners;
+		size_t unique_edges = corners / 2 + 1;
+		size_t pool_edges = welded ? unique_edges : corners; // Duplicates are removed after loading, without shrinking the pool
+
+		// Parsing into containers reserved from the pre-scan, then the spatial ordering of the edges (Morton keys and the reordered copy of the pool)
+		size_t temp_vertices = vertices * (sizeof(Vect3) + sizeof(int));
+		if (welded)
+			temp_vertices += vertices * HASH_ENTRY_BYTES * 2 + unique_edges * HASH_ENTRY_BYTES; // Weld grid cells and welded edges
+		this->faces_bytes = faces * sizeof(Face) + corners * sizeof(Vect3) + faces * 16; // Every face allocates its own vertices
+		this->full_mesh_bytes = pool_edges * sizeof(Edge);
+		size_t parsing = temp_vertices + faces_bytes + full_mesh_bytes;
+		size_t ordering = faces_bytes + full_mesh_bytes + pool_edges * (16 + sizeof(Edge));
+		this->loading_bytes = with_margin(std::max(parsing, ordering));
+
+		// Compact mesh (built from the unique edges, while the full mesh is still loaded)
+		size_t index_bytes = vertices <= 65536 ? sizeof(unsigned short) : sizeof(unsigned int);
+		this->compact_mesh_bytes = vertices * 3 * sizeof(unsigned short) + unique_edges * 2 * index_bytes;
+		this->compacting_bytes = vertices * HASH_ENTRY_BYTES + unique_edges * 2 * sizeof(unsigned int) + growth_bytes(vertices * 3, sizeof(unsigned short));
+
+		// Edge adjacency (the matching of the edges is released once built)
+		this->adjacency_bytes = 0;
+		if (has_adjacency)
+		{
+			this->adjacency_bytes = growth_bytes(faces, sizeof(Vect3)) * 2 + growth_bytes(unique_edges, sizeof(Edge)) + growth_bytes(unique_edges, sizeof(std::pair<int, int>));
+			size_t matching = growth_bytes(vertices, sizeof(Vect3)) + vertices * HASH_ENTRY_BYTES * 2 + unique_edges * HASH_ENTRY_BYTES +
+							  growth_bytes(unique_edges, sizeof(Edge) + sizeof(int) + sizeof(std::pair<int, int>));
+			this->loading_bytes = std::max(loading_bytes, with_margin(faces_bytes + full_mesh_bytes + adjacency_bytes + matching));
+		}
+		this->projected_lines_bytes = unique_edges * sizeof(StraightLine);
+	}
+	void estimate_frames(TurntableJob &job)
+	{
+		std::vector<std::string> resolutions = job.options.get_sorted_resolutions();
+		this->frame_bytes = 0;
+		this->encode_bytes = 0;
+		if (job.poster_width > 0)
+		{
+			// Sparse, written one strip of tiles at a time (the PNG rows of the strip and their compressed data)
+			size_t row_bytes = (size_t)job.poster_width * 4 + 1;
+			this->poster_drawn_share = estimate_poster_drawn_share(job.poster_width, job.poster_height);
+			this->poster_bytes = (size_t)(row_bytes * job.poster_height * poster_drawn_share) + row_bytes * BasicImage::TILE_SIZE * 2;
+			this->encodes_in_flight = 0;
+			return;
+		}
+		if (job.contact_sheet_columns > 0)
+		{
+			// A single image, encoded once it is drawn, with every view projected at the same time
+			this->frame_bytes = get_preset_bytes(resolutions[0]) * 3;
+			this->projected_lines_bytes *= (size_t)(job.contact_sheet_columns * job.contact_sheet_rows);
+			this->encodes_in_flight = 0;
+			return;
+		}
+		bool keeps_previous = job.output_format == "apng" || job.output_format == "gif";
+		for (std::string &resolution : resolutions)
+		{
+			// Framebuffer, backplate and the copy of the next frame, made before the oldest one in flight is done (and the previous frame of the animated formats).
+			// Every frame in flight holds its copy, its filtered rows and its compressed data, whose buffer grows by doubling
+			size_t bytes = get_preset_bytes(resolution);
+			this->frame_bytes += bytes * (keeps_previous ? 4 : 3);
+			this->encode_bytes += bytes * 4;
+		}
+	}
+
+	static double estimate_poster_drawn_share(int width, int height)
+	{
+		// The backplate grid draws onto whole rows and columns of tiles (as draw_turntable_backplate places its lines, one pixel
+		// either side for anti-aliasing), the rest of the drawing onto a share of the tiles left
+		const int tile = BasicImage::TILE_SIZE;
+		double scale = get_backplate_scale(width, height);
+		auto count_grid_tiles = [&](int size) {
+			std::vector<bool> touched((size_t)((size + tile - 1) / tile), false);
+			for (double i = -BACKPLATE_GRID_EXTENT; i < BACKPLATE_GRID_EXTENT; i += BACKPLATE_GRID_SPACING)
+			{
+				int pixel = (int)std::floor(i * scale) + size / 2;
+				int first = std::max(pixel - 1, 0), last = std::min(pixel + 1, size - 1);
+				for (int t = first / tile; first <= last && t <= last / tile; t++)
+					touched[t] = true;
+			}
+			return (double)std::count(touched.begin(), touched.end(), true);
+		};
+		double tiles_x = (width + tile - 1) / tile, tiles_y = (height + tile - 1) / tile;
+		double rows = count_grid_tiles(height), columns = count_grid_tiles(width);
+		double grid_share = (rows * tiles_x + columns * tiles_y - rows * columns) / (tiles_x * tiles_y);
+		return grid_share + (1.0 - grid_share) * POSTER_FREE_DRAWN_SHARE;
+	}
+
+	// Utility
+	static size_t growth_bytes(size_t count, size_t element_bytes)
+	{
+		// Peak of a vector filled one element at a time: when its capacity doubles for the last time, the old buffer and the half of the new one it is copied to
+		size_t capacity = 1;
+		while (capacity < count)
+			capacity *= 2;
+		return capacity * element_bytes;
+	}
+	static size_t with_margin(size_t bytes) { return (size_t)(bytes * ALLOCATION_MARGIN); }
+	static double to_mb(size_t bytes) { return bytes / (1024.0 * 1024.0); }
+	static size_t get_preset_bytes(std::string resolution)
+	{
+		int width, height, channels;
+		BasicImage::get_preset_size(resolution, width, height, channels);
+		return PixelBuffer::aligned_stride((size_t)width * channels) * height;
+	}
+};
+
+// --------- JOB MESH --------- //
+std::unique_ptr<MemoryPlan> plan_job_memory(TurntableJob &job)
+{
+	// Plan applied to the job when it has a memory limit (before anything is loaded), nullptr otherwise
+	if (job.memory_limit_mb <= 0)
+		return nullptr;
+	std::unique_ptr<MemoryPlan> memory_plan = std::make_unique<MemoryPlan>(job, scan_obj_counts(job.obj_filepath), (size_t)job.memory_limit_mb * 1024 * 1024);
+	memory_plan->log(job);
+	memory_plan->apply(job);
+	return memory_plan;
+}
+std::shared_ptr<ObjReader> load_job_mesh(TurntableJob &job, MemoryPlan *memory_plan)
+{
+	// The mesh of the job, ready to be drawn: parsed (with the counts of the plan, if any), with the edge adjacency for the
+	// feature edges, then compacted, or without its faces when the plan releases them. Meshes without faces are only parsed
+	std::shared_ptr<ObjReader> obj = std::make_shared<ObjReader>(job.obj_filepath, job.weld_tolerance, memory_plan ? memory_plan->get_counts() : ObjCounts{0, 0, 0});
+	if (obj->count_total_faces() == 0)
+		return obj;
+	if (job.options.edges_mode == "features")
+		obj->build_edge_adjacency(job.crease_angle);
+	if (job.compact_mesh)
+		obj->compact();
+	else if (memory_plan && memory_plan->releases_faces())
+		obj->release_faces();
+	return obj;
+}
@@ -0,0 +1,302 @@
+#pragma once
+/*
+ * Author: Jaime Rivera
+ * Date : 2020.04.20
+ * Copyright : Copyright 2020 Jaime Rivera | www.jaimervq.com
+ * Brief: Lightweight instrumentation (scoped timers and counters), only compiled in when OBJ_RENDERER_PROFILING is defined.
+ *        Exactly one source file defines OBJ_RENDERER_PROFILING_IMPLEMENTATION before including the renderer, for the allocation counting
+ *        (replaced global operator new/delete) and the per-thread profiles
+ */
+
+// --------- COUNTERS --------- //
+enum ProfileCounter
+{
+	EDGES_DRAWN,
+	PIXELS_BLENDED,
+	PIXELS_CLIPPED,
+	BYTES_ENCODED,
+	ALLOCATIONS,
+	SUB_MESHES_CULLED,
+	PROFILE_COUNTERS_SIZE
+};
+
+#ifdef OBJ_RENDERER_PROFILING
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+// Allocations are counted per thread in a plain thread_local, so that operator new never allocates itself
+extern thread_local long long profiling_thread_allocations;
+
+// --------- PER THREAD DATA --------- //
+struct ProfileScopeStats
+{
+	long long calls = 0;
+	long long total_ns = 0;
+	long long max_ns = 0;
+};
+
+struct ProfileTraceEvent
+{
+	const char *name;
+	long long start_ns;
+	long long duration_ns;
+};
+
+struct ThreadProfileData
+{
+	int thread_id = 0;
+	long long counters[PROFILE_COUNTERS_SIZE] = {};
+	std::map<const char *, ProfileScopeStats> scopes; // Keyed by the (literal) scope names, merged by text on export
+	std::vector<ProfileTraceEvent> trace_events;
+
+	void snapshot_allocations() { counters[ALLOCATIONS] = profiling_thread_allocations; }
+};
+
+// Registers its data with the profiler on creation, and hands it over when its thread ends
+struct ThreadProfile
+{
+	ThreadProfileData data;
+
+	ThreadProfile();
+	~ThreadProfile();
+};
+
+// --------- PROFILER --------- //
+class Profiler
+{
+private:
+	std::mutex mutex;
+	std::vector<ThreadProfileData *> live_threads;
+	std::vector<ThreadProfileData> finished_threads;
+	int next_thread_id = 0;
+	std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+public:
+	// Instance (one per process)
+	static Profiler &get()
+	{
+		static Profiler profiler;
+		return profiler;
+	}
+	static ThreadProfileData &this_thread()
+	{
+		thread_local ThreadProfile profile;
+		return profile.data;
+	}
+
+	// Recording
+	static void count(ProfileCounter counter, long long amount) { this_thread().counters[counter] += amount; }
+	long long now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	// Thread registration
+	void register_thread(ThreadProfileData *profile)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		profile->thread_id = next_thread_id++;
+		live_threads.push_back(profile);
+	}
+	void retire_thread(ThreadProfileData *profile)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		profile->snapshot_allocations();
+		finished_threads.push_back(*profile);
+		live_threads.erase(std::remove(live_threads.begin(), live_threads.end(), profile), live_threads.end());
+	}
+
+	// Export (meant to be called once the worker threads are idle)
+	std::vector<ThreadProfileData> collect()
+	{
+		this_thread().snapshot_allocations();
+
+		std::lock_guard<std::mutex> lock{mutex};
+		std::vector<ThreadProfileData> all = finished_threads;
+		for (ThreadProfileData *p : live_threads)
+			all.push_back(*p);
+		return all;
+	}
+	void write_summary_json(std::string filename)
+	{
+		const char *COUNTER_NAMES[PROFILE_COUNTERS_SIZE] = {"edges_drawn", "pixels_blended", "pixels_clipped", "bytes_encoded", "allocations", "sub_meshes_culled"};
+
+		std::vector<ThreadProfileData> threads = collect();
+		long long totals[PROFILE_COUNTERS_SIZE] = {};
+		std::map<std::string, ProfileScopeStats> total_scopes;
+
+		std::ofstream f{filename};
+		f << "{\n  \"threads\": [\n";
+		for (size_t t = 0; t < threads.size(); t++)
+		{
+			ThreadProfileData &p = threads[t];
+			f << "    {\"thread\": " << p.thread_id << ", \"counters\": {";
+			for (int c = 0; c < PROFILE_COUNTERS_SIZE; c++)
+			{
+				f << (c ? ", " : "") << "\"" << COUNTER_NAMES[c] << "\": " << p.counters[c];
+				totals[c] += p.counters[c];
+			}
+			f << "}, \"scopes\": {";
+			bool first = true;
+			for (auto &[name, stats] : p.scopes)
+			{
+				f << (first ? "" : ", ") << "\"" << name << "\": {\"calls\": " << stats.calls
+				  << ", \"total_ms\": " << stats.total_ns * 1e-6 << ", \"max_ms\": " << stats.max_ns * 1e-6 << "}";
+				first = false;
+
+				ProfileScopeStats &total = total_scopes[name];
+				total.calls += stats.calls;
+				total.total_ns += stats.total_ns;
+				total.max_ns = std::max(total.max_ns, stats.max_ns);
+			}
+			f << "}}" << (t + 1 < threads.size() ? ",\n" : "\n");
+		}
+		f << "  ],\n  \"totals\": {\"counters\": {";
+		for (int c = 0; c < PROFILE_COUNTERS_SIZE; c++)
+			f << (c ? ", " : "") << "\"" << COUNTER_NAMES[c] << "\": " << totals[c];
+		f << "}, \"scopes\": {";
+		bool first = true;
+		for (auto &[name, stats] : total_scopes)
+		{
+			f << (first ? "" : ", ") << "\"" << name << "\": {\"calls\": " << stats.calls
+			  << ", \"total_ms\": " << stats.total_ns * 1e-6 << ", \"max_ms\": " << stats.max_ns * 1e-6 << "}";
+			first = false;
+		}
+		f << "}}\n}\n";
+	}
+	void write_chrome_trace(std::string filename)
+	{
+		// Chrome's about:tracing and Perfetto both read this "Trace Event Format" json
+		std::vector<ThreadProfileData> threads = collect();
+
+		std::ofstream f{filename};
+		f << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+		bool first = true;
+		for (ThreadProfileData &p : threads)
+		{
+			f << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << p.thread_id
+			  << ", \"args\": {\"name\": \"thread " << p.thread_id << "\"}}";
+			first = false;
+			for (ProfileTraceEvent &e : p.trace_events)
+			{
+				f << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << p.thread_id
+				  << ", \"ts\": " << e.start_ns / 1000.0 << ", \"dur\": " << e.duration_ns / 1000.0 << "}";
+			}
+		}
+		f << "\n]}\n";
+	}
+};
+
+// --------- SCOPED TIMER --------- //
+class ScopedTimer
+{
+private:
+	const char *name;
+	long long start_ns;
+
+public:
+	ScopedTimer(const char *scope_name) : name(scope_name), start_ns(Profiler::get().now_ns()) {}
+	~ScopedTimer()
+	{
+		long long duration_ns = Profiler::get().now_ns() - start_ns;
+
+		ThreadProfileData &p = Profiler::this_thread();
+		ProfileScopeStats &stats = p.scopes[name];
+		stats.calls++;
+		stats.total_ns += duration_ns;
+		stats.max_ns = std::max(stats.max_ns, duration_ns);
+		p.trace_events.push_back(ProfileTraceEvent{name, start_ns, duration_ns});
+	}
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ScopedTimer PROFILE_CONCAT(profile_scope_, __LINE__){name}
+#define PROFILE_COUNT(counter, amount) Profiler::count(counter, amount)
+#define PROFILE_EXPORT(summary_filename, trace_filename)          \
+	do                                                            \
+	{                                                             \
+		Profiler::get().write_summary_json(summary_filename);    \
+		Profiler::get().write_chrome_trace(trace_filename);      \
+	} while (false)
+
+// --------- IMPLEMENTATION (one source file only) --------- //
+#ifdef OBJ_RENDERER_PROFILING_IMPLEMENTATION
+
+thread_local long long profiling_thread_allocations = 0;
+
+ThreadProfile::ThreadProfile() { Profiler::get().register_thread(&this->data); }
+ThreadProfile::~ThreadProfile() { Profiler::get().retire_thread(&this->data); }
+
+// Allocation and release, out of line so that the compiler does not pair the replaced operators with malloc and free
+#if defined(__GNUC__)
+#define PROFILING_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define PROFILING_NOINLINE __declspec(noinline)
+#else
+#define PROFILING_NOINLINE
+#endif
+
+PROFILING_NOINLINE void *profiling_allocate(std::size_t size, std::size_t alignment)
+{
+	profiling_thread_allocations++;
+	void *p = nullptr;
+	if (alignment <= alignof(std::max_align_t))
+		p = std::malloc(size == 0 ? 1 : size);
+	else
+	{
+#ifdef _MSC_VER
+		p = _aligned_malloc(size == 0 ? 1 : size, alignment);
+#else
+		p = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment + (size == 0 ? alignment : 0)); // Sizes in multiples of the alignment
+#endif
+	}
+	if (!p)
+		throw std::bad_alloc{};
+	return p;
+}
+PROFILING_NOINLINE void profiling_release(void *p, std::size_t alignment) noexcept
+{
+#ifdef _MSC_VER
+	if (alignment > alignof(std::max_align_t))
+	{
+		_aligned_free(p);
+		return;
+	}
+#else
+	(void)alignment; // Memory from aligned_alloc is released with free too
+#endif
+	std::free(p);
+}
+
+void *operator new(std::size_t size) { return profiling_allocate(size, 0); }
+void *operator new[](std::size_t size) { return profiling_allocate(size, 0); }
+void *operator new(std::size_t size, std::align_val_t alignment) { return profiling_allocate(size, (std::size_t)alignment); }
+void *operator new[](std::size_t size, std::align_val_t alignment) { return profiling_allocate(size, (std::size_t)alignment); }
+void operator delete(void *p) noexcept { profiling_release(p, 0); }
+void operator delete[](void *p) noexcept { profiling_release(p, 0); }
+void operator delete(void *p, std::size_t) noexcept { profiling_release(p, 0); }
+void operator delete[](void *p, std::size_t) noexcept { profiling_release(p, 0); }
+void operator delete(void *p, std::align_val_t alignment) noexcept { profiling_release(p, (std::size_t)alignment); }
+void operator delete[](void *p, std::align_val_t alignment) noexcept { profiling_release(p, (std::size_t)alignment); }
+void operator delete(void *p, std::size_t, std::align_val_t alignment) noexcept { profiling_release(p, (std::size_t)alignment); }
+void operator delete[](void *p, std::size_t, std::align_val_t alignment) noexcept { profiling_release(p, (std::size_t)alignment); }
+
+#endif
+
+#else
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_COUNT(counter, amount)
+#define PROFILE_EXPORT(summary_filename, trace_filename)
+
+#endif
@@ -0,0 +1,641 @@
+#pragma once
+/*
+ * Author: Jaime Rivera
+ * Date : 2020.04.20
+ * Copyright : Copyright 2020 Jaime Rivera | www.jaimervq.com
+ * Brief: Long-running render server on a Unix domain socket, with a cache of the parsed meshes, its client, and the watch mode
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define OBJ_RENDERER_HAS_UNIX_SOCKETS
+#endif
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#define OBJ_RENDERER_HAS_INOTIFY
+#endif
+
+#include "basic_obj_reader.h"
+#include "memory_plan.h"
+#include "turntable.h"
+
+// --------- MESH CACHE --------- //
+class MeshCache
+{
+private:
+	struct CachedMesh
+	{
+		unsigned long long content_hash;
+		std::shared_future<std::shared_ptr<ObjReader>> mesh;
+		size_t bytes; // 0 while loading
+	};
+
+	std::mutex mutex;
+	std::list<CachedMesh> meshes; // Most recently used first
+	size_t max_bytes, used_bytes;
+	int hits, misses;
+
+public:
+	// Constructor
+	MeshCache(size_t input_max_bytes) : max_bytes(input_max_bytes), used_bytes(0), hits(0), misses(0) {}
+
+	// Meshes
+	std::shared_ptr<ObjReader> get(TurntableJob &job, MemoryPlan *memory_plan, bool &was_cached)
+	{
+		// Meshes are keyed by the contents of the file (and how it is processed), so an edited file is parsed again under the same path
+		double crease_angle = job.options.edges_mode == "features" ? job.crease_angle : 0.0; // 0 for no edge adjacency
+		unsigned long long content_hash = hash_file(job.obj_filepath);
+		content_hash = hash_bytes(content_hash, &job.weld_tolerance, sizeof(job.weld_tolerance));
+		content_hash = hash_bytes(content_hash, &crease_angle, sizeof(crease_angle));
+		content_hash = hash_string(content_hash, job.compact_mesh ? "compact" : "");
+		std::promise<std::shared_ptr<ObjReader>> loading;
+		std::shared_future<std::shared_ptr<ObjReader>> cached_mesh;
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			for (std::list<CachedMesh>::iterator it = meshes.begin(); it != meshes.end(); it++)
+			{
+				if (it->content_hash == content_hash)
+				{
+					meshes.splice(meshes.begin(), meshes, it); // Now the most recently used
+					cached_mesh = it->mesh;
+					break;
+				}
+			}
+			was_cached = cached_mesh.valid();
+			if (was_cached)
+				hits++;
+			else
+			{
+				meshes.push_front(CachedMesh{content_hash, loading.get_future().share(), 0});
+				misses++;
+			}
+		}
+		if (was_cached)
+			return cached_mesh.get(); // Waits if another job is still parsing it
+
+		// Parsed outside the lock (jobs of the same mesh wait for this one instead of parsing it again)
+		std::shared_ptr<ObjReader> mesh;
+		try
+		{
+			mesh = load_job_mesh(job, memory_plan);
+			if (mesh->count_total_faces() == 0)
+				mesh = nullptr;
+		}
+		catch (...)
+		{
+			// The jobs waiting for this mesh get the same exception, and the entry goes away so the file is parsed again next time
+			loading.set_exception(std::current_exception());
+			std::lock_guard<std::mutex> lock{mutex};
+			forget(content_hash);
+			throw;
+		}
+		loading.set_value(mesh);
+
+		std::lock_guard<std::mutex> lock{mutex};
+		if (!mesh)
+			forget(content_hash); // Not kept, so a fixed file can be loaded later
+		else
+		{
+			for (CachedMesh &cached : meshes)
+			{
+				if (cached.content_hash == content_hash && cached.bytes == 0)
+				{
+					cached.bytes = mesh->estimate_memory_bytes();
+					used_bytes += cached.bytes;
+					break;
+				}
+			}
+		}
+		evict();
+		return mesh;
+	}
+	std::string describe()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return std::to_string(meshes.size()) + " meshes cached, " + std::to_string(used_bytes / (1024 * 1024)) + "/" + std::to_string(max_bytes / (1024 * 1024)) +
+			   " MB, " + std::to_string(hits) + " hits, " + std::to_string(misses) + " misses";
+	}
+
+private:
+	void forget(unsigned long long content_hash)
+	{
+		// Drops the entry of a mesh that is still loading
+		for (std::list<CachedMesh>::iterator it = meshes.begin(); it != meshes.end(); it++)
+		{
+			if (it->content_hash == content_hash && it->bytes == 0)
+			{
+				meshes.erase(it);
+				return;
+			}
+		}
+	}
+	void evict()
+	{
+		// Least recently used meshes go first (jobs still drawing them keep their own reference)
+		std::list<CachedMesh>::iterator it = meshes.end();
+		while (used_bytes > max_bytes && it != meshes.begin())
+		{
+			it--;
+			if (it->bytes == 0 || it == meshes.begin())
+				continue; // Still loading, or the one just used
+			used_bytes -= it->bytes;
+			it = meshes.erase(it);
+		}
+	}
+};
+
+// --------- THREAD POOL --------- //
+class ThreadPool
+{
+private:
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable task_available;
+	bool stopping;
+
+public:
+	// Constructor
+	ThreadPool(int thread_count) : stopping(false)
+	{
+		for (int i = 0; i < thread_count; i++)
+			workers.emplace_back([this]() { work(); });
+	}
+	~ThreadPool()
+	{
+		// Tasks already queued are still run
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			stopping = true;
+		}
+		task_available.notify_all();
+		for (std::thread &worker : workers)
+			worker.join();
+	}
+
+	// Tasks
+	void submit(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			tasks.push(task);
+		}
+		task_available.notify_one();
+	}
+
+private:
+	void work()
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock{mutex};
+				task_available.wait(lock, [this]() { return stopping || !tasks.empty(); });
+				if (tasks.empty())
+					return;
+				task = std::move(tasks.front());
+				tasks.pop();
+			}
+			try
+			{
+				task();
+			}
+			catch (const std::exception &e)
+			{
+				// A failed task must not take the workers (and the whole server) down with it
+				std::cerr << "[ERROR] A task failed: " << e.what() << std::endl;
+			}
+			catch (...)
+			{
+				std::cerr << "[ERROR] A task failed" << std::endl;
+			}
+		}
+	}
+};
+
+// --------- FILE WATCHER --------- //
+class FileWatcher
+{
+private:
+	std::filesystem::path filepath;
+#ifdef OBJ_RENDERER_HAS_INOTIFY
+	int inotify_fd;
+#else
+	std::filesystem::file_time_type last_write;
+#endif
+
+	// Saves can take several writes, so a change is reported once the file stays untouched for this long
+	static const int SETTLE_MS = 200;
+	static const int POLL_MS = 500; // Without inotify
+
+public:
+	// Constructor
+	FileWatcher(std::string input_filepath) : filepath(input_filepath)
+	{
+#ifdef OBJ_RENDERER_HAS_INOTIFY
+		// The folder is watched, not the file: editors often save by writing a new file and renaming it over the old one
+		std::string folder = filepath.parent_path().empty() ? "." : filepath.parent_path().string();
+		inotify_fd = inotify_init1(IN_CLOEXEC);
+		if (inotify_fd >= 0 && inotify_add_watch(inotify_fd, folder.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		{
+			close(inotify_fd);
+			inotify_fd = -1;
+		}
+#else
+		last_write = get_last_write();
+#endif
+	}
+	FileWatcher(const FileWatcher &) = delete;
+	~FileWatcher()
+	{
+#ifdef OBJ_RENDERER_HAS_INOTIFY
+		if (inotify_fd >= 0)
+			close(inotify_fd);
+#endif
+	}
+
+	// Watching
+	bool wait_for_change()
+	{
+		// Blocks until the file is written (false if it can not be watched)
+#ifdef OBJ_RENDERER_HAS_INOTIFY
+		if (inotify_fd < 0)
+			return false;
+		int file_events = 0;
+		while (file_events == 0)
+		{
+			file_events = read_events(-1);
+			if (file_events < 0)
+				return false;
+		}
+		while (read_events(SETTLE_MS) >= 0)
+			continue;
+		return true;
+#else
+		while (true)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(POLL_MS));
+			std::filesystem::file_time_type write_time = get_last_write();
+			if (write_time == last_write)
+				continue;
+			do
+			{
+				last_write = write_time;
+				std::this_thread::sleep_for(std::chrono::milliseconds(SETTLE_MS));
+			} while ((write_time = get_last_write()) != last_write);
+			return true;
+		}
+#endif
+	}
+
+private:
+#ifdef OBJ_RENDERER_HAS_INOTIFY
+	int read_events(int timeout_ms)
+	{
+		// Number of events about the file, -1 when nothing arrived in time
+		pollfd request{inotify_fd, POLLIN, 0};
+		if (poll(&request, 1, timeout_ms) <= 0)
+			return -1;
+
+		alignas(inotify_event) char buffer[4096];
+		ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+		if (length <= 0)
+			return -1;
+
+		int file_events = 0;
+		std::string filename = filepath.filename().string();
+		for (char *p = buffer; p < buffer + length;)
+		{
+			inotify_event *event = (inotify_event *)p;
+			if (event->len > 0 && filename == event->name)
+				file_events++;
+			p += sizeof(inotify_event) + event->len;
+		}
+		return file_events;
+	}
+#else
+	std::filesystem::file_time_type get_last_write()
+	{
+		std::error_code error;
+		return std::filesystem::last_write_time(filepath, error);
+	}
+#endif
+};
+
+// --------- RENDER SERVER --------- //
+// Protocol: one request per connection, a line with its arguments separated by tabs, and one line of response
+// starting with "OK" or "ERROR". The requests are the arguments of a render (OBJ_PATH [options]), STATUS or SHUTDOWN
+#ifdef OBJ_RENDERER_HAS_UNIX_SOCKETS
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+bool send_line(int socket_fd, std::string line)
+{
+	line += "\n";
+	size_t sent = 0;
+	while (sent < line.size())
+	{
+		ssize_t result = send(socket_fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+		if (result <= 0)
+			return false;
+		sent += (size_t)result;
+	}
+	return true;
+}
+bool receive_line(int socket_fd, std::string &line)
+{
+	// False when the connection closed or timed out before the end of the line
+	line.clear();
+	char c;
+	while (recv(socket_fd, &c, 1, 0) == 1)
+	{
+		if (c == '\n')
+			return true;
+		line += c;
+	}
+	return false;
+}
+sockaddr_un get_socket_address(std::string socket_path)
+{
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	socket_path.copy(address.sun_path, sizeof(address.sun_path) - 1);
+	return address;
+}
+
+class RenderServer
+{
+private:
+	std::string socket_path;
+	int server_fd;
+	std::atomic<bool> stopping;
+	MeshCache cache;
+	ThreadPool pool;
+
+	// A client that sends nothing for this long is dropped, so it can not hold a worker forever
+	static constexpr int RECEIVE_TIMEOUT_S = 10;
+	// Wait before accepting again when out of file descriptors (or memory)
+	static constexpr int ACCEPT_BACKOFF_MS = 100;
+
+public:
+	// Constructor
+	RenderServer(std::string input_socket_path, size_t cache_bytes, int thread_count) : socket_path(input_socket_path), server_fd(-1), stopping(false), cache(cache_bytes), pool(thread_count) {}
+
+	// Serving
+	bool run()
+	{
+		if (socket_path.size() >= sizeof(sockaddr_un::sun_path))
+		{
+			std::cerr << "[ERROR] The socket path is too long!" << std::endl;
+			return false;
+		}
+		server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un address = get_socket_address(socket_path);
+		unlink(socket_path.c_str()); // Left behind by a previous server
+		if (server_fd < 0 || bind(server_fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(server_fd, 64) != 0)
+		{
+			std::cerr << "[ERROR] Could not listen on " << socket_path << "!" << std::endl;
+			return false;
+		}
+
+		printf("[INFO] Render server listening on %s\n", socket_path.c_str());
+		bool failed = false;
+		while (!stopping)
+		{
+			int client_fd = accept(server_fd, nullptr, nullptr);
+			if (client_fd < 0)
+			{
+				if (stopping || errno == EINTR || errno == ECONNABORTED)
+					continue;
+				if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+				{
+					std::cerr << "[WARNING] Could not accept a connection: " << std::strerror(errno) << ", retrying" << std::endl;
+					std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_BACKOFF_MS));
+					continue;
+				}
+				std::cerr << "[ERROR] Could not accept connections: " << std::strerror(errno) << "!" << std::endl;
+				failed = true;
+				break;
+			}
+			timeval receive_timeout{RECEIVE_TIMEOUT_S, 0};
+			setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
+			pool.submit([this, client_fd]() {
+				handle_request(client_fd);
+				close(client_fd);
+			});
+		}
+
+		close(server_fd);
+		unlink(socket_path.c_str());
+		printf("[INFO] Render server stopped (%s)\n", cache.describe().c_str());
+		return !failed;
+	}
+
+private:
+	void handle_request(int client_fd)
+	{
+		std::string line;
+		if (!receive_line(client_fd, line))
+		{
+			send_line(client_fd, "ERROR Incomplete request");
+			return;
+		}
+		std::vector<std::string> arguments;
+		size_t start = 0;
+		while (start <= line.size() && !line.empty())
+		{
+			size_t tab = line.find('\t', start);
+			if (tab == std::string::npos)
+				tab = line.size();
+			arguments.push_back(line.substr(start, tab - start));
+			start = tab + 1;
+		}
+
+		if (arguments.empty())
+			send_line(client_fd, "ERROR Empty request");
+		else if (arguments[0] == "STATUS")
+			send_line(client_fd, "OK " + cache.describe());
+		else if (arguments[0] == "SHUTDOWN")
+		{
+			send_line(client_fd, "OK Shutting down");
+			stopping = true;
+			shutdown(server_fd, SHUT_RDWR); // Wakes up accept()
+		}
+		else
+		{
+			// Bad input (an unreadable OBJ, an unwritable output folder...) fails this request only
+			std::string response;
+			try
+			{
+				response = render(arguments);
+			}
+			catch (const std::exception &e)
+			{
+				response = std::string("ERROR The render failed: ") + e.what();
+			}
+			catch (...)
+			{
+				response = "ERROR The render failed";
+			}
+			send_line(client_fd, response);
+		}
+	}
+	std::string render(std::vector<std::string> arguments)
+	{
+		std::chrono::time_point job_start = std::chrono::high_resolution_clock::now();
+		TurntableJob job;
+		job.options.show_progress = false;
+		if (!job.parse_arguments(arguments))
+			return "ERROR Invalid render arguments";
+		std::string path_error = job.check_obj_file();
+		if (!path_error.empty())
+			return "ERROR " + path_error;
+		if (job.merge_shards)
+			return verify_shard_manifests(job.output_parent, job.obj_stem) ? "OK All shards are complete" : "ERROR Some shards are incomplete";
+
+		bool was_cached = false;
+		std::shared_ptr<ObjReader> mesh = cache.get(job, nullptr, was_cached);
+		if (!mesh)
+			return "ERROR The OBJ file has no faces";
+
+		int frames = render_turntable(job, *mesh);
+		if (frames < 0)
+			return "ERROR Some frames could not be written";
+		std::chrono::time_point job_end = std::chrono::high_resolution_clock::now();
+		double seconds = std::chrono::duration_cast<std::chrono::milliseconds>(job_end - job_start).count() / 1000.0;
+		return "OK " + std::to_string(frames) + " frames of " + job.obj_filename + " in " + std::to_string(seconds) + " seconds (mesh " + (was_cached ? "cached" : "parsed") + ")";
+	}
+};
+#endif
+
+// --------- ENTRY POINTS --------- //
+int run_render_server(std::vector<std::string> arguments)
+{
+	// SOCKET_PATH [--threads N] [--cache-mb N]
+#ifdef OBJ_RENDERER_HAS_UNIX_SOCKETS
+	int thread_count = std::max(1, (int)std::thread::hardware_concurrency());
+	int cache_mb = 512;
+	bool valid_arguments = arguments.size() >= 1;
+	for (size_t i = 1; i < arguments.size() && valid_arguments; i++)
+	{
+		if (arguments[i] == "--threads" && i + 1 < arguments.size())
+			valid_arguments = (thread_count = std::atoi(arguments[++i].c_str())) > 0;
+		else if (arguments[i] == "--cache-mb" && i + 1 < arguments.size())
+			valid_arguments = (cache_mb = std::atoi(arguments[++i].c_str())) > 0;
+		else
+			valid_arguments = false;
+	}
+	if (!valid_arguments)
+	{
+		std::cerr << "[ERROR] Expected: --serve SOCKET_PATH [--threads N] [--cache-mb N]" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	printf("[INFO] %i render threads, %i MB of mesh cache\n", thread_count, cache_mb);
+	RenderServer server{arguments[0], (size_t)cache_mb * 1024 * 1024, thread_count};
+	return server.run() ? 0 : EXIT_FAILURE;
+#else
+	std::cerr << "[ERROR] The render server needs Unix domain sockets, not available on this platform!" << std::endl;
+	return EXIT_FAILURE;
+#endif
+}
+int run_render_client(std::vector<std::string> arguments)
+{
+	// SOCKET_PATH then the request (OBJ_PATH [options], STATUS or SHUTDOWN)
+#ifdef OBJ_RENDERER_HAS_UNIX_SOCKETS
+	if (arguments.size() < 2)
+	{
+		std::cerr << "[ERROR] Expected: --client SOCKET_PATH OBJ_PATH [options] | STATUS | SHUTDOWN" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (arguments[1] != "STATUS" && arguments[1] != "SHUTDOWN")
+		arguments[1] = std::filesystem::absolute(arguments[1]).string(); // The server may run somewhere else
+
+	std::string request;
+	for (size_t i = 1; i < arguments.size(); i++)
+		request += (i > 1 ? "\t" : "") + arguments[i];
+
+	int client_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address = get_socket_address(arguments[0]);
+	if (client_fd < 0 || connect(client_fd, (sockaddr *)&address, sizeof(address)) != 0)
+	{
+		std::cerr << "[ERROR] Could not connect to the render server on " << arguments[0] << "!" << std::endl;
+		return EXIT_FAILURE;
+	}
+	send_line(client_fd, request);
+	std::string response;
+	receive_line(client_fd, response);
+	close(client_fd);
+
+	bool succeeded = response.rfind("OK", 0) == 0;
+	if (succeeded)
+		printf("[INFO] %s\n", response.substr(std::min<size_t>(3, response.size())).c_str());
+	else
+		std::cerr << "[ERROR] " << (response.empty() ? "No response from the render server" : response.substr(std::min<size_t>(6, response.size()))) << std::endl;
+	return succeeded ? 0 : EXIT_FAILURE;
+#else
+	std::cerr << "[ERROR] The render client needs Unix domain sockets, not available on this platform!" << std::endl;
+	return EXIT_FAILURE;
+#endif
+}
+int run_watch_mode(TurntableJob &job, MemoryPlan *memory_plan)
+{
+	// Renders the job, then again every time the contents of the OBJ file change, until interrupted. The parsed mesh
+	// stays loaded while its file is unchanged, and the backplates are drawn only once (see BackplateCache).
+	// With a memory plan, every mesh is loaded as it says (planned from the file as it was at the start)
+	MeshCache meshes{0}; // Keeps just the last mesh
+	FileWatcher watcher{job.obj_filepath};
+	bool has_rendered = false;
+	while (true)
+	{
+		bool was_cached = false;
+		std::shared_ptr<ObjReader> mesh = meshes.get(job, memory_plan, was_cached);
+		if (!mesh)
+			std::cerr << "[WARNING] No faces could be read from " << job.obj_filename << ", waiting for it to change" << std::endl;
+		else if (was_cached && has_rendered)
+			printf("[INFO] The contents of %s did not change, nothing to render\n", job.obj_filename.c_str());
+		else
+		{
+			std::chrono::time_point render_start = std::chrono::high_resolution_clock::now();
+			int frames = render_turntable(job, *mesh);
+			auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - render_start);
+			if (frames >= 0)
+				printf("[INFO] %i frames written in %.3f seconds\n", frames, duration.count() / 1000.0);
+			if (memory_plan)
+				memory_plan->check_peak_rss();
+			has_rendered = true;
+		}
+
+		printf("[INFO] Watching %s for changes (Ctrl+C to stop)\n", job.obj_filepath.c_str());
+		fflush(stdout);
+		if (!watcher.wait_for_change())
+		{
+			std::cerr << "[ERROR] The OBJ file can not be watched!" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+}
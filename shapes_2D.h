@@ -27,6 +27,10 @@ public:
 		this->end = given_end;
 	}
 
+	// Get
+	Vect2 get_origin() { return this->origin; }
+	Vect2 get_end() { return this->end; }
+
 	// Transformations
 	void move(Vect2 displacement)
 	{
@@ -93,6 +97,10 @@ public:
 		this->radius = y1 - c_y;
 	}
 
+	// Get
+	Vect2 get_center() { return this->center; }
+	double get_radius() { return this->radius; }
+
 	// Transformations
 	void move_center(Vect2 increment_point)
 	{
@@ -42,6 +42,14 @@ public:
 	Vect3 get_origin() { return this->origin_vtx; }
 	Vect3 get_end() { return this->end_vtx; }
 	double get_lenght() { return this->origin_vtx.get_distance(this->end_vtx); }
+	Edge get_canonical()
+	{
+		// Same edge starting at its lowest vertex (by x, then y, then z), so that copies read in opposite directions draw the same pixels
+		Vect3 &o = this->origin_vtx;
+		Vect3 &e = this->end_vtx;
+		bool reversed = o.get_x() != e.get_x() ? o.get_x() > e.get_x() : (o.get_y() != e.get_y() ? o.get_y() > e.get_y() : o.get_z() > e.get_z());
+		return reversed ? Edge{e, o} : *this;
+	}
 
 	// Transformations
 	void move(Vect3 displacement)
@@ -52,7 +60,10 @@ public:
 	void rotate_around_axis(double angle, Vect3 axis)
 	{
 		Matrix3by3 rotation_matrix = Matrix3by3::RotationMatrix(angle, axis);
-
+		rotate_around_axis(rotation_matrix);
+	}
+	void rotate_around_axis(Matrix3by3 &rotation_matrix)
+	{
 		this->origin_vtx = mult_matrix_by_vector3(rotation_matrix, this->origin_vtx);
 		this->end_vtx = mult_matrix_by_vector3(rotation_matrix, this->end_vtx);
 	}
@@ -0,0 +1,682 @@
+#pragma once
+/*
+ * Author: Jaime Rivera
+ * Date : 2020.04.20
+ * Copyright : Copyright 2020 Jaime Rivera | www.jaimervq.com
+ * Brief: Turntable rendering: a library entry point that hands frames to sinks, and the render jobs of the command line
+ */
+
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "basic_obj_reader.h"
+#include "drawing_utils.h"
+#include "frame_cache.h"
+#include "frame_output.h"
+#include "frame_selection.h"
+#include "profiling.h"
+
+// --------- TURNTABLE OPTIONS --------- //
+struct TurntableOptions
+{
+	// Drawing
+	std::string edges_mode; // "all" or "features" (boundary, crease and silhouette edges, needs ObjReader::build_edge_adjacency)
+	bool anti_aliasing;
+	std::vector<std::string> resolutions; // Presets, rendered at the biggest and downsampled to the others
+	std::string caption;				  // First line of the overlay text
+
+	// Frames
+	int rpm, fps;
+	FrameSelection selection;
+	std::vector<int> skipped_frames; // Sorted, frames of the selection already written elsewhere (e.g. restored from a FrameCache)
+	bool show_progress;
+
+	// Constructor
+	TurntableOptions() : edges_mode("all"), anti_aliasing(false), resolutions{"1080"}, rpm(9), fps(24), show_progress(true) {}
+
+	// Get
+	std::vector<std::string> get_sorted_resolutions()
+	{
+		// Biggest first, without repetitions (the order in which sinks get their frames)
+		auto preset_rank = [](std::string name) { return name == "4k" ? 2 : (name == "1080" ? 1 : 0); };
+		std::vector<std::string> sorted = resolutions;
+		std::sort(sorted.begin(), sorted.end(), [&](std::string a, std::string b) { return preset_rank(a) > preset_rank(b); });
+		sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+		return sorted;
+	}
+	int count_total_frames()
+	{
+		int total_frames = 0;
+		for (double d = 0.0; d < 360.0; d += get_rotation_angle())
+			total_frames++;
+		return total_frames;
+	}
+	double get_rotation_angle() { return (double)rpm * 360.0 / 60.0 / (double)fps; }
+};
+
+// --------- TURNTABLE JOB --------- //
+struct TurntableJob
+{
+	// Input
+	std::string obj_filepath, obj_filename, obj_stem;
+	std::string output_parent; // Folder of the OBJ file, where all outputs go (empty or ending in '/')
+
+	// Loading and output
+	double weld_tolerance;
+	double crease_angle;
+	bool compact_mesh; // 16-bit positions and indices in memory (ObjReader::compact)
+	std::string output_format;
+	int contact_sheet_columns, contact_sheet_rows; // 0 for a turntable
+	int poster_width, poster_height;			   // 0 for a turntable
+	std::string frame_cache_folder;				   // Empty for no frame cache
+	bool merge_shards;
+	bool watch;			 // Render again whenever the OBJ file changes
+	int memory_limit_mb; // 0 for no memory plan
+
+	// Rendering
+	TurntableOptions options;
+
+	// Constructor
+	TurntableJob() : weld_tolerance(0.0), crease_angle(30.0), compact_mesh(false), output_format("png"), contact_sheet_columns(0), contact_sheet_rows(0), poster_width(0), poster_height(0), merge_shards(false), watch(false), memory_limit_mb(0) {}
+
+	// Parsing (OBJ path first, then the options)
+	bool parse_arguments(std::vector<std::string> arguments)
+	{
+		bool valid_arguments = arguments.size() >= 1;
+		for (size_t i = 1; i < arguments.size() && valid_arguments; i++)
+		{
+			std::string arg = arguments[i];
+			bool has_value = i + 1 < arguments.size();
+			if (arg == "--format" && has_value)
+				output_format = arguments[++i];
+			else if (arg == "--edges" && has_value)
+				valid_arguments = (options.edges_mode = arguments[++i]) == "all" || options.edges_mode == "features";
+			else if (arg == "--crease-angle" && has_value)
+				valid_arguments = (crease_angle = std::atof(arguments[++i].c_str())) > 0.0 && crease_angle <= 180.0;
+			else if (arg == "--aa")
+				options.anti_aliasing = true;
+			else if (arg == "--resolutions" && has_value)
+			{
+				std::vector<std::string> &resolutions = options.resolutions;
+				resolutions.clear();
+				std::stringstream resolutions_list{arguments[++i]};
+				std::string resolution;
+				while (std::getline(resolutions_list, resolution, ','))
+				{
+					valid_arguments = valid_arguments && BasicImage::is_preset(resolution);
+					resolutions.push_back(resolution);
+				}
+				valid_arguments = valid_arguments && !resolutions.empty();
+			}
+			else if (arg == "--rpm" && has_value)
+				valid_arguments = (options.rpm = std::atoi(arguments[++i].c_str())) > 0;
+			else if (arg == "--fps" && has_value)
+				valid_arguments = (options.fps = std::atoi(arguments[++i].c_str())) > 0;
+			else if (arg == "--weld" && has_value)
+				valid_arguments = (weld_tolerance = std::atof(arguments[++i].c_str())) > 0.0;
+			else if (arg == "--frames" && has_value)
+				valid_arguments = options.selection.parse_frames(arguments[++i]);
+			else if (arg == "--every" && has_value)
+				valid_arguments = options.selection.parse_every(arguments[++i]);
+			else if (arg == "--shard" && has_value)
+				valid_arguments = options.selection.parse_shard(arguments[++i]);
+			else if (arg == "--contact-sheet" && has_value)
+				valid_arguments = std::sscanf(arguments[++i].c_str(), "%dx%d", &contact_sheet_columns, &contact_sheet_rows) == 2 && contact_sheet_columns > 0 && contact_sheet_rows > 0;
+			else if (arg == "--poster" && has_value)
+				valid_arguments = std::sscanf(arguments[++i].c_str(), "%dx%d", &poster_width, &poster_height) == 2 && poster_width > 0 && poster_height > 0 && poster_width <= 65535 && poster_height <= 65535;
+			else if (arg == "--compact")
+				compact_mesh = true;
+			else if (arg == "--cache" && has_value)
+				frame_cache_folder = arguments[++i];
+			else if (arg == "--merge")
+				merge_shards = true;
+			else if (arg == "--watch")
+				watch = true;
+			else if (arg == "--memory-limit" && has_value)
+				valid_arguments = (memory_limit_mb = std::atoi(arguments[++i].c_str())) > 0;
+			else
+				valid_arguments = false;
+		}
+		bool is_png_sequence = output_format == "png" || output_format == "png8";
+		if (!is_png_sequence && output_format != "apng" && output_format != "gif" && output_format != "archive")
+			valid_arguments = false;
+		if (options.selection.is_partial() && !is_png_sequence)
+		{
+			std::cerr << "[ERROR] Frame selection and sharding are only available for the png and png8 formats!" << std::endl;
+			valid_arguments = false;
+		}
+		if (contact_sheet_columns > 0 && (options.selection.is_partial() || output_format != "png"))
+		{
+			std::cerr << "[ERROR] A contact sheet is a single png image, without frame selection!" << std::endl;
+			valid_arguments = false;
+		}
+		if (poster_width > 0 && (options.selection.is_partial() || output_format != "png" || contact_sheet_columns > 0))
+		{
+			std::cerr << "[ERROR] A poster is a single png image, without frame selection!" << std::endl;
+			valid_arguments = false;
+		}
+		if (!frame_cache_folder.empty() && (!is_png_sequence || contact_sheet_columns > 0 || poster_width > 0))
+		{
+			std::cerr << "[ERROR] The frame cache is only available for turntables in the png and png8 formats!" << std::endl;
+			valid_arguments = false;
+		}
+		if (watch && merge_shards)
+		{
+			std::cerr << "[ERROR] The watch mode renders, it can not be used to merge shards!" << std::endl;
+			valid_arguments = false;
+		}
+		if (!valid_arguments)
+			return false;
+
+		std::filesystem::path p = arguments[0];
+		this->obj_filepath = p.string();
+		this->obj_filename = p.filename().string();
+		this->obj_stem = p.stem().string();
+		this->options.caption = this->obj_filename;
+		this->output_parent = p.parent_path().string();
+		if (!this->output_parent.empty())
+			this->output_parent += "/";
+		return true;
+	}
+	static std::string get_usage(std::string program)
+	{
+		return "Usage: " + program + " OBJ_PATH [--format png|png8|apng|gif|archive] [--aa] [--resolutions 720,1080,4k] [--rpm N] [--fps N]\n" +
+			   "                [--edges all|features] [--crease-angle DEG] [--weld TOLERANCE] [--frames A:B] [--every N] [--shard I/N] [--merge]\n" +
+			   "                [--contact-sheet YAWSxPITCHES] [--poster WIDTHxHEIGHT] [--compact] [--cache FOLDER] [--watch]\n" +
+			   "                [--memory-limit MB]\n" +
+			   "Example: " + program + " my_geo_1.obj\n" +
+			   "         " + program + " my_geo_1.obj --format apng\n" +
+			   "         " + program + " my_geo_1.obj --format archive (then --extract my_geo_1_turntable.frames, if files are needed)\n" +
+			   "         " + program + " my_geo_1.obj --resolutions 4k,1080,720\n" +
+			   "         " + program + " my_geo_1.obj --shard 0/4 (then --merge, once all shards are done)\n" +
+			   "         " + program + " my_geo_1.obj --contact-sheet 8x3\n" +
+			   "         " + program + " my_geo_1.obj --poster 16384x16384\n" +
+			   "         " + program + " my_geo_1.obj --cache frame_cache --watch\n" +
+			   "         " + program + " my_geo_1.obj --resolutions 4k,1080 --memory-limit 512\n";
+	}
+
+	// Hash of the mesh contents and every option that changes the pixels of the frames (not of which frames are rendered)
+	unsigned long long hash_render_inputs()
+	{
+		unsigned long long hash = hash_file(obj_filepath);
+		hash = hash_bytes(hash, &weld_tolerance, sizeof(weld_tolerance));
+		hash = hash_bytes(hash, &crease_angle, sizeof(crease_angle));
+		hash = hash_string(hash, output_format + " " + options.edges_mode + (options.anti_aliasing ? " aa" : "") + (compact_mesh ? " compact" : ""));
+		hash = hash_string(hash, options.get_sorted_resolutions()[0]); // The one the others are downsampled from
+		return hash_string(hash, options.caption);
+	}
+
+	// Input path analysis (empty when the OBJ file can be read)
+	std::string check_obj_file()
+	{
+		std::filesystem::path p = obj_filepath;
+		if (!std::filesystem::exists(p))
+			return "The specified OBJ file does not exist!";
+		if (!(p.extension().string() == ".obj") && !(p.extension().string() == ".OBJ"))
+			return "The specified file is not an OBJ (.obj/.OBJ) file!";
+		return "";
+	}
+};
+
+// --------- BACKPLATE CACHE --------- //
+class BackplateCache
+{
+	// Backplates of the presets, drawn the first time they are needed and kept for the rest of the process
+	// (watch mode and the render server draw them only once for all their renders)
+private:
+	std::mutex mutex;
+	std::map<std::string, std::unique_ptr<BasicImage>> backplates;
+
+public:
+	// Shared instance
+	static BackplateCache &shared()
+	{
+		FrameBufferPool::shared(); // Created first so that it outlives the cached backplates, which go back to it
+		static BackplateCache cache;
+		return cache;
+	}
+
+	// Backplates
+	BasicImage &get(std::string resolution, std::string source_resolution, bool anti_aliasing, std::function<void(BasicImage &)> draw)
+	{
+		// Downsampled backplates depend on the resolution they come from. Once drawn, backplates are never modified
+		std::string key = resolution + "/" + source_resolution + (anti_aliasing ? "/aa" : "");
+		std::lock_guard<std::mutex> lock{mutex};
+		std::unique_ptr<BasicImage> &backplate = backplates[key];
+		if (!backplate)
+		{
+			backplate = std::make_unique<BasicImage>(BasicImage::from_preset(resolution));
+			draw(*backplate);
+		}
+		return *backplate;
+	}
+};
+
+// --------- TURNTABLE RENDER --------- //
+const double BACKPLATE_GRID_EXTENT = 2000.0; // Lines of the grid from the center, at scale 1
+const double BACKPLATE_GRID_SPACING = 50.0;
+
+double get_backplate_scale(int width, int height)
+{
+	// Scale of the backplate and the overlay that fills an image of any size as the preset resolutions are filled
+	return std::max(width / 1920.0, height / 1080.0);
+}
+void draw_turntable_backplate(BasicImage &backplate, double scale, BasicBrush &line_brush, BasicBrush &tick_brush)
+{
+	// Grid, ticks, cross and circle behind the OBJ (scale 1 fits the preset resolutions)
+	const double extent = BACKPLATE_GRID_EXTENT;
+	backplate.draw_solid_line(StraightLine{-extent * scale, 0, extent * scale, 0}, line_brush);
+	backplate.draw_solid_line(StraightLine{0, -extent * scale, 0, extent * scale}, line_brush);
+	for (double i = -extent; i < extent; i += BACKPLATE_GRID_SPACING)
+	{
+		if (i != 0)
+		{
+			backplate.draw_dotted_line(StraightLine{-extent * scale, i * scale, extent * scale, i * scale}, line_brush);
+			backplate.draw_dotted_line(StraightLine{i * scale, -extent * scale, i * scale, extent * scale}, line_brush);
+
+			backplate.draw_solid_line(StraightLine{-15 * scale, i * scale, 15 * scale, i * scale}, tick_brush);
+			backplate.draw_solid_line(StraightLine{i * scale, -15 * scale, i * scale, 15 * scale}, tick_brush);
+		}
+	}
+
+	StraightLine diagonal_cross{-1500 * scale, 0, 1500 * scale, 0};
+	diagonal_cross.rotate(29);
+	backplate.draw_solid_line(diagonal_cross, line_brush);
+	diagonal_cross.rotate(122);
+	backplate.draw_solid_line(diagonal_cross, line_brush);
+
+	Circumference circular_frame{Vect2{0, 0}, 700 * scale};
+	backplate.draw_dotted_circle(circular_frame, BasicBrush{line_brush.get_color(), 3, BasicBrush::ROUND_TIP_SHAPE});
+}
+void draw_turntable_overlay(BasicImage &image, ObjReader &obj, std::string caption, double scale, BasicBrush text_brush, BasicBrush &frame_brush)
+{
+	// Caption and polycount, framed, at the bottom left (scale 1 fits the preset resolutions, as in draw_turntable_backplate)
+	int text_height = (int)(20 * scale);
+	int glyph_size = BasicImage::get_glyph_size(text_height);
+	int margin = (int)(10 * scale);
+	int text_x = (int)(0.04 * image.get_width());
+	int text_y = (int)(0.88 * image.get_height());
+	int line_increment = (int)(image.get_line_increment_coef() * text_height);
+
+	int total_faces = obj.count_total_faces();
+	int total_verts = obj.count_total_vertices();
+	std::string polycount = "faces: " + std::to_string(total_faces) + " / vertices: " + std::to_string(total_verts);
+
+	image.draw_text(text_x, text_y, caption + "\n" + polycount, text_height, text_brush);
+	image.draw_frame(text_x - margin, text_y - margin,
+					 text_x - margin + (int)polycount.size() * glyph_size + 2 * margin, text_y - margin + 2 * line_increment + margin,
+					 frame_brush);
+}
+int render_turntable(ObjReader &obj, TurntableOptions &options, std::vector<FrameSink *> sinks)
+{
+	// Renders the selected frames of the turntable (obj already loaded and centered, and not modified), handing them to the sinks:
+	// one per resolution, biggest first. Sinks are finished before returning. Returns the number of frames rendered
+	std::vector<std::string> resolutions = options.get_sorted_resolutions();
+	if (sinks.size() != resolutions.size())
+	{
+		std::cerr << "[ERROR] " << sinks.size() << " frame sinks given for " << resolutions.size() << " resolutions!" << std::endl;
+		return 0;
+	}
+	FrameSelection &selection = options.selection;
+
+	// ------ Base image (rendered at the biggest resolution, the others are downsampled from it) ------ //
+	BasicImage out_image = BasicImage::from_preset(resolutions[0]);
+	out_image.estimate_obj_drawing_params(obj);
+	if (obj.is_compact())
+		printf("[INFO] Compact mesh quantization error: at most %.4f pixels at %s\n", obj.get_compact_mesh().get_max_error() * out_image.get_max_pixels_per_unit(obj.get_bb()),
+			   resolutions[0].c_str());
+
+	std::vector<BasicImage> downsampled_images;
+	for (size_t i = 1; i < resolutions.size(); i++)
+		downsampled_images.push_back(BasicImage::from_preset(resolutions[i]));
+
+	// ------ Drawing colors and brushes ------ //
+	BasicColor retro_blue{0.2, 0.60, 1.0};
+	BasicColor faded_blue{0.1, 0.35, 0.6};
+	BasicColor retro_yellow{0.8, 0.57, 0.05};
+	BasicColor retro_orange{1.0, 0.35, 0.05};
+
+	BasicBrush regular_faded_blue_brush{faded_blue};
+	BasicBrush thick_faded_blue_brush{faded_blue, 4, BasicBrush::SQUARE_TIP_SHAPE};
+	BasicBrush regular_yellow_brush{retro_yellow};
+	BasicBrush thick_orange_brush{retro_orange, 3, BasicBrush::SQUARE_TIP_SHAPE};
+
+	for (BasicBrush *brush : {&regular_faded_blue_brush, &thick_faded_blue_brush, &regular_yellow_brush, &thick_orange_brush})
+		brush->set_anti_aliased(options.anti_aliasing);
+
+	std::vector<BasicColor> palette_colors{retro_blue, faded_blue, retro_yellow, retro_orange};
+	for (FrameSink *sink : sinks)
+		sink->add_palette_colors(palette_colors);
+
+	// ------ RPM calculation ------ //
+	double rotation_angle = options.get_rotation_angle();
+
+	// ------ Frames to render (numbers and angles are always the ones of the whole turntable) ------ //
+	int total_frames = options.count_total_frames();
+	std::vector<int> frames_to_render = selection.get_shard_frames(total_frames);
+	if (selection.is_partial())
+		printf("[INFO] Rendering %i of the %i frames (shard %i/%i)\n", (int)frames_to_render.size(), total_frames, selection.get_shard_index(), selection.get_shard_count());
+	if (!options.skipped_frames.empty())
+	{
+		std::vector<int> remaining_frames;
+		std::set_difference(frames_to_render.begin(), frames_to_render.end(), options.skipped_frames.begin(), options.skipped_frames.end(), std::back_inserter(remaining_frames));
+		frames_to_render = remaining_frames;
+	}
+	if (frames_to_render.empty())
+	{
+		for (FrameSink *sink : sinks)
+			sink->finish();
+		return 0;
+	}
+
+	// ------ Backplate (identical in every frame, so drawn only once and kept for later renders) ------ //
+	BackplateCache &backplate_cache = BackplateCache::shared();
+	BasicImage &backplate = backplate_cache.get(resolutions[0], resolutions[0], options.anti_aliasing, [&](BasicImage &image) {
+		PROFILE_SCOPE("backplate");
+		draw_turntable_backplate(image, 1.0, regular_faded_blue_brush, thick_faded_blue_brush);
+	});
+
+	std::vector<BasicImage *> downsampled_backplates;
+	for (size_t i = 1; i < resolutions.size(); i++)
+		downsampled_backplates.push_back(&backplate_cache.get(resolutions[i], resolutions[0], options.anti_aliasing, [&](BasicImage &image) { image.downsample_from(backplate); }));
+
+	// ------ Frames writing ------ //
+	if (options.show_progress)
+		printf("[INFO] Drawing frames");
+	int frame_count = 0;
+	for (double d = 0.0; d < 360.0; d += rotation_angle, frame_count++)
+	{
+		if (!std::binary_search(frames_to_render.begin(), frames_to_render.end(), frame_count))
+			continue;
+
+		// Feedback
+		int percentaje = (int)(d / 360.0 * 100);
+		if (options.show_progress)
+			printf("\r[INFO] Drawing frames %i%%", percentaje);
+		PROFILE_SCOPE("frame");
+
+		// Backplate
+		{
+			PROFILE_SCOPE("backplate_copy");
+			out_image.copy_from(backplate);
+		}
+
+		// Drawing the OBJ
+		{
+			PROFILE_SCOPE("draw_obj");
+			if (options.edges_mode == "features")
+				out_image.draw_obj_features(obj, d, regular_yellow_brush, thick_orange_brush);
+			else
+				out_image.draw_obj(obj, d, regular_yellow_brush, thick_orange_brush);
+		}
+
+		// Output data text
+		{
+			PROFILE_SCOPE("overlay");
+			draw_turntable_overlay(out_image, obj, options.caption, 1.0, BasicBrush{retro_blue}, thick_orange_brush);
+		}
+
+		// Downsampling (only what was drawn over the backplate, the rest is the downsampled backplate)
+		{
+			PROFILE_SCOPE("downsample");
+			PixelRect over_backplate = out_image.get_bounds_over_layer();
+			std::vector<std::future<void>> downsamples;
+			for (size_t i = 0; i < downsampled_images.size(); i++)
+			{
+				downsamples.push_back(std::async(std::launch::async, [&, i]() {
+					downsampled_images[i].copy_from(*downsampled_backplates[i]);
+					downsampled_images[i].downsample_from(out_image, over_backplate);
+				}));
+			}
+			for (std::future<void> &downsample : downsamples)
+				downsample.get();
+		}
+
+		// Writing the output files
+		sinks[0]->write_frame(out_image, frame_count);
+		for (size_t i = 0; i < downsampled_images.size(); i++)
+			sinks[i + 1]->write_frame(downsampled_images[i], frame_count);
+	}
+	for (FrameSink *sink : sinks)
+		sink->finish();
+
+	if (options.show_progress)
+	{
+		printf("\r[INFO] Drawing frames 100%%\n");
+		printf("[INFO] All frames of the turntable written!\n");
+	}
+
+	return (int)frames_to_render.size();
+}
+int render_turntable(ObjReader &obj, TurntableOptions &options, FrameSink &sink)
+{
+	// Single resolution (the biggest one of the options)
+	TurntableOptions single_options = options;
+	single_options.resolutions = {options.get_sorted_resolutions()[0]};
+	return render_turntable(obj, single_options, std::vector<FrameSink *>{&sink});
+}
+int render_contact_sheet(ObjReader &obj, TurntableOptions &options, int columns, int rows, FrameSink &sink)
+{
+	// All views in a single image (at the biggest resolution): yaws spread over the columns, pitches over the rows, from above to below
+	BasicImage sheet = BasicImage::from_preset(options.get_sorted_resolutions()[0]);
+	sheet.estimate_obj_drawing_params(obj);
+
+	BasicColor faded_blue{0.1, 0.35, 0.6};
+	BasicColor retro_yellow{0.8, 0.57, 0.05};
+	BasicColor retro_orange{1.0, 0.35, 0.05};
+	BasicBrush faces_brush{retro_yellow};
+	BasicBrush bb_brush{retro_orange};
+	BasicBrush frame_brush{faded_blue};
+	faces_brush.set_anti_aliased(options.anti_aliasing);
+	bb_brush.set_anti_aliased(options.anti_aliasing);
+
+	const double MAX_PITCH = 30.0;
+	std::vector<Matrix3by3> view_matrices;
+	std::vector<std::string> labels;
+	for (int row = 0; row < rows; row++)
+	{
+		double pitch = rows > 1 ? MAX_PITCH - 2.0 * MAX_PITCH * row / (rows - 1) : 0.0;
+		for (int column = 0; column < columns; column++)
+		{
+			double yaw = 360.0 * column / columns;
+			view_matrices.push_back(mult_matrices(Matrix3by3::RotationMatrix(-pitch, Vect3::XAxis), Matrix3by3::RotationMatrix(yaw, Vect3::YAxis)));
+			labels.push_back("yaw " + std::to_string((int)std::round(yaw)) + " pitch " + std::to_string((int)std::round(pitch)));
+		}
+	}
+	{
+		PROFILE_SCOPE("contact_sheet");
+		sheet.draw_obj_views(obj, view_matrices, columns, faces_brush, bb_brush);
+	}
+
+	// Cell frames and labels
+	int cell_width = sheet.get_width() / columns;
+	int cell_height = sheet.get_height() / rows;
+	size_t longest_label = 0;
+	for (std::string &label : labels)
+		longest_label = std::max(longest_label, label.size());
+	int text_height = std::max(6, std::min({20, cell_height / 16, cell_width / (int)(longest_label + 1)}));
+	for (int view = 0; view < columns * rows; view++)
+	{
+		int x = view % columns * cell_width;
+		int y = view / columns * cell_height;
+		sheet.draw_frame(x, y, x + cell_width - 1, y + cell_height - 1, frame_brush);
+		sheet.draw_text(x + text_height / 2, y + text_height / 2, (view == 0 ? options.caption + "\n" : "") + labels[view], text_height, frame_brush);
+	}
+
+	sink.write_frame(sheet, 0);
+	sink.finish();
+	return 1;
+}
+int render_poster(ObjReader &obj, TurntableOptions &options, int width, int height, std::string filename)
+{
+	// First frame of the turntable at any size, even too big to fit in memory: only the tiles drawn onto are allocated,
+	// and they are freed as the PNG is streamed out
+	BasicImage poster = BasicImage::sparse(width, height, 4);
+	poster.estimate_obj_drawing_params(obj);
+
+	BasicColor retro_blue{0.2, 0.60, 1.0};
+	BasicColor faded_blue{0.1, 0.35, 0.6};
+	BasicColor retro_yellow{0.8, 0.57, 0.05};
+	BasicColor retro_orange{1.0, 0.35, 0.05};
+
+	BasicBrush regular_faded_blue_brush{faded_blue};
+	BasicBrush thick_faded_blue_brush{faded_blue, 4, BasicBrush::SQUARE_TIP_SHAPE};
+	BasicBrush regular_yellow_brush{retro_yellow};
+	BasicBrush thick_orange_brush{retro_orange, 3, BasicBrush::SQUARE_TIP_SHAPE};
+
+	for (BasicBrush *brush : {&regular_faded_blue_brush, &thick_faded_blue_brush, &regular_yellow_brush, &thick_orange_brush})
+		brush->set_anti_aliased(options.anti_aliasing);
+
+	{
+		PROFILE_SCOPE("poster");
+		double backplate_scale = get_backplate_scale(width, height);
+		draw_turntable_backplate(poster, backplate_scale, regular_faded_blue_brush, thick_faded_blue_brush);
+		if (options.edges_mode == "features")
+			poster.draw_obj_features(obj, 0.0, regular_yellow_brush, thick_orange_brush);
+		else
+			poster.draw_obj(obj, 0.0, regular_yellow_brush, thick_orange_brush);
+		draw_turntable_overlay(poster, obj, options.caption, backplate_scale, BasicBrush{retro_blue}, thick_orange_brush);
+	}
+
+	SparseTiles *tiles = poster.get_sparse_tiles();
+	size_t total_tiles = (size_t)tiles->count_tiles_x() * tiles->count_tiles_y();
+	size_t drawn_tiles = tiles->count_allocated_tiles();
+	bool written;
+	{
+		PROFILE_SCOPE("poster_encode");
+		written = write_sparse_png(poster, filename);
+	}
+	if (!written)
+	{
+		std::cerr << "[ERROR] Could not write the poster: " << filename << std::endl;
+		return 0;
+	}
+
+	printf("[INFO] Poster tiles drawn: %zu of %zu (%.2f MB of pixels, instead of %.2f MB)\n", drawn_tiles, total_tiles,
+		   tiles->count_peak_tiles() * tiles->get_tile_bytes() / (1024.0 * 1024.0), (double)width * height * 4 / (1024.0 * 1024.0));
+	return 1;
+}
+int render_turntable(TurntableJob &job, ObjReader &obj)
+{
+	// Renders the frames of the job to files next to the OBJ file (and the manifest of the shard). Returns the number of frames written,
+	// or -1 when some output could not be written
+	TurntableOptions &options = job.options;
+	if (job.contact_sheet_columns > 0)
+	{
+		std::string filename = job.output_parent + job.obj_stem + "_contact_sheet.png";
+		CallbackSink sheet_sink{[&](FrameView &sheet) { stbi_write_png(filename.c_str(), sheet.width, sheet.height, sheet.channels, sheet.pixels, sheet.stride); }};
+		int frames = render_contact_sheet(obj, options, job.contact_sheet_columns, job.contact_sheet_rows, sheet_sink);
+		printf("[INFO] Contact sheet written: %s\n", filename.c_str());
+		return frames;
+	}
+	if (job.poster_width > 0)
+	{
+		std::string filename = job.output_parent + job.obj_stem + "_poster.png";
+		int frames = render_poster(obj, options, job.poster_width, job.poster_height, filename);
+		if (frames)
+			printf("[INFO] Poster written: %s\n", filename.c_str());
+		return frames;
+	}
+
+	std::vector<std::string> resolutions = options.get_sorted_resolutions();
+	std::string &output_format = job.output_format;
+	std::string &output_parent = job.output_parent;
+	std::string &obj_stem = job.obj_stem;
+	FrameSelection &selection = options.selection;
+
+	// ------ Output of the frames (one per resolution, suffixed when there are several) ------ //
+	std::vector<std::unique_ptr<FrameSink>> sinks;
+	std::vector<FrameSink *> sink_pointers;
+	std::vector<std::string> output_names;
+	for (std::string &resolution : resolutions)
+	{
+		std::string output_name = obj_stem + "_turntable" + (resolutions.size() > 1 ? "_" + resolution : "");
+		output_names.push_back(output_name);
+		if (output_format == "apng")
+			sinks.push_back(std::make_unique<ApngSink>(output_parent + output_name + ".png", options.fps));
+		else if (output_format == "gif")
+			sinks.push_back(std::make_unique<GifSink>(output_parent + output_name + ".gif", options.fps));
+		else if (output_format == "archive")
+			sinks.push_back(std::make_unique<FrameArchiveSink>(output_parent + output_name + ".frames", obj_stem + "_"));
+		else
+		{
+			std::filesystem::create_directory(output_parent + output_name);
+			if (output_format == "png8")
+				sinks.push_back(std::make_unique<IndexedPngSequenceSink>(output_parent + output_name + "/" + obj_stem + "_"));
+			else
+				sinks.push_back(std::make_unique<PngSequenceSink>(output_parent + output_name + "/" + obj_stem + "_"));
+		}
+		sink_pointers.push_back(sinks.back().get());
+	}
+
+	// ------ Frame cache (frames rendered before from the same mesh and options are copied, not rendered) ------ //
+	int total_frames = options.count_total_frames();
+	std::vector<int> shard_frames = selection.get_shard_frames(total_frames);
+	auto get_frame_path = [&](size_t r, int frame) { return output_parent + output_names[r] + "/" + obj_stem + "_" + std::to_string(frame) + ".png"; };
+
+	std::unique_ptr<FrameCache> frame_cache;
+	TurntableOptions render_options = options;
+	if (!job.frame_cache_folder.empty())
+	{
+		frame_cache = std::make_unique<FrameCache>(job.frame_cache_folder, job.hash_render_inputs());
+		for (int frame : shard_frames)
+		{
+			// Restored only when cached at every resolution
+			double angle = frame * options.get_rotation_angle();
+			bool cached = true;
+			for (size_t r = 0; r < resolutions.size() && cached; r++)
+				cached = frame_cache->contains(frame_cache->get_key(resolutions[r], angle));
+			for (size_t r = 0; r < resolutions.size() && cached; r++)
+				cached = frame_cache->restore(frame_cache->get_key(resolutions[r], angle), get_frame_path(r, frame));
+			if (cached)
+				render_options.skipped_frames.push_back(frame);
+		}
+	}
+
+	int frames_rendered = render_turntable(obj, render_options, sink_pointers);
+	for (FrameSink *sink : sink_pointers)
+	{
+		if (sink->has_failed())
+		{
+			std::cerr << "[ERROR] Some frames of the turntable could not be written!" << std::endl;
+			return -1; // Nothing cached or listed in the manifest
+		}
+	}
+
+	if (frame_cache)
+	{
+		for (int frame : shard_frames)
+		{
+			if (std::binary_search(render_options.skipped_frames.begin(), render_options.skipped_frames.end(), frame))
+				continue;
+			for (size_t r = 0; r < resolutions.size(); r++)
+				frame_cache->store(frame_cache->get_key(resolutions[r], frame * options.get_rotation_angle()), get_frame_path(r, frame));
+		}
+		printf("[INFO] Frame cache: %i frames restored, %i rendered\n", (int)render_options.skipped_frames.size(), frames_rendered);
+	}
+
+	// ------ Shard manifest (lists the frames written, for the merge check) ------ //
+	if (selection.is_partial())
+	{
+		ShardManifest manifest{job.obj_filename, output_parent, options.rpm, options.fps, total_frames, selection};
+		for (int frame : shard_frames)
+		{
+			for (std::string &output_name : output_names)
+				manifest.add_file(frame, output_name + "/" + obj_stem + "_" + std::to_string(frame) + ".png");
+		}
+		std::string manifest_filename = ShardManifest::get_filename(output_parent, obj_stem, selection.get_shard_index(), selection.get_shard_count());
+		manifest.to_file(manifest_filename);
+		printf("[INFO] Shard manifest written: %s\n", manifest_filename.c_str());
+	}
+
+	return frames_rendered + (int)render_options.skipped_frames.size();
+}